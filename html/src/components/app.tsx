@@ -46,6 +46,7 @@ const termOptions = {
     } as ITheme,
     allowProposedApi: true,
 } as ITerminalOptions;
+const bootstrap = window.ttydBootstrap;
 const flowControl = {
     limit: 100000,
     highWater: 10,
@@ -62,6 +63,7 @@ export class App extends Component {
                 clientOptions={clientOptions}
                 termOptions={termOptions}
                 flowControl={flowControl}
+                bootstrap={bootstrap}
             />
         );
     }
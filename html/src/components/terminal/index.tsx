@@ -23,7 +23,8 @@ export class Terminal extends Component<Props, State> {
     }
 
     async componentDidMount() {
-        await this.xterm.refreshToken();
+        // a bootstrapped page carries a websocket ticket instead
+        if (!this.props.bootstrap) await this.xterm.refreshToken();
         this.xterm.open(this.container);
         this.xterm.connect();
     }
@@ -20,6 +20,7 @@ interface TtydTerminal extends Terminal {
 declare global {
     interface Window {
         term: TtydTerminal;
+        ttydBootstrap?: Bootstrap;
     }
 }
 
@@ -28,6 +29,8 @@ enum Command {
     OUTPUT = '0',
     SET_WINDOW_TITLE = '1',
     SET_PREFERENCES = '2',
+    SET_RESUME_ID = '3',
+    RECONNECT = '4',
 
     // client side
     INPUT = '0',
@@ -59,12 +62,20 @@ export interface FlowControl {
     lowWater: number;
 }
 
+// rendered into index.html by `ttyd --inline-bootstrap`
+export interface Bootstrap {
+    title: string;
+    prefs: Preferences;
+    ticket: string;
+}
+
 export interface XtermOptions {
     wsUrl: string;
     tokenUrl: string;
     flowControl: FlowControl;
     clientOptions: ClientOptions;
     termOptions: ITerminalOptions;
+    bootstrap?: Bootstrap;
 }
 
 function toDisposable(f: () => void): IDisposable {
@@ -94,6 +105,11 @@ export class Xterm {
 
     private socket?: WebSocket;
     private token: string;
+    private ticket?: string;
+    private ticketSent = false;
+    // kept per tab, so a reload gets the still running session back too
+    private resumeKey = `ttyd-resume:${window.location.pathname}`;
+    private resumed = false;
     private opened = false;
     private title?: string;
     private titleFixed?: string;
@@ -167,6 +183,13 @@ export class Xterm {
 
         terminal.open(parent);
         fitAddon.fit();
+
+        const { bootstrap } = this.options;
+        if (bootstrap) {
+            this.ticket = bootstrap.ticket;
+            this.title = bootstrap.title;
+            document.title = this.title;
+        }
     }
 
     @bind
@@ -246,7 +269,18 @@ export class Xterm {
 
     @bind
     public connect() {
-        this.socket = new WebSocket(this.options.wsUrl, ['tty']);
+        let url = this.options.wsUrl;
+        // the ticket is single use, reconnects go through the token handshake
+        this.ticketSent = !!this.ticket;
+        if (this.ticket) {
+            const { cols, rows } = this.terminal;
+            url += `${url.includes('?') ? '&' : '?'}ticket=${this.ticket}&cols=${cols}&rows=${rows}`;
+            this.ticket = undefined;
+        }
+        const resumeId = window.sessionStorage.getItem(this.resumeKey);
+        this.resumed = !!resumeId;
+        if (resumeId) url += `${url.includes('?') ? '&' : '?'}resume=${resumeId}`;
+        this.socket = new WebSocket(url, ['tty']);
         const { socket, register } = this;
 
         socket.binaryType = 'arraybuffer';
@@ -261,11 +295,14 @@ export class Xterm {
         console.log('[ttyd] websocket connection opened');
 
         const { textEncoder, terminal, overlayAddon } = this;
-        const msg = JSON.stringify({ AuthToken: this.token, columns: terminal.cols, rows: terminal.rows });
-        this.socket?.send(textEncoder.encode(msg));
+        if (!this.ticketSent) {
+            const msg = JSON.stringify({ AuthToken: this.token, columns: terminal.cols, rows: terminal.rows });
+            this.socket?.send(textEncoder.encode(msg));
+        }
 
         if (this.opened) {
-            terminal.reset();
+            // a resumed session carries on where it was, the screen stays
+            if (!this.resumed) terminal.reset();
             terminal.options.disableStdin = false;
             overlayAddon.showOverlay('Reconnected', 300);
         } else {
@@ -274,6 +311,8 @@ export class Xterm {
 
         this.doReconnect = this.reconnect;
         this.initListeners();
+        // the server skips SET_PREFERENCES for a ticket, the page already carries them
+        if (this.ticketSent && this.options.bootstrap) this.setPreferences(this.options.bootstrap.prefs);
         terminal.focus();
     }
 
@@ -285,7 +324,8 @@ export class Xterm {
         overlayAddon.showOverlay('Connection Closed');
         this.dispose();
 
-        // 1000: CLOSE_NORMAL
+        // 1000: CLOSE_NORMAL, the process exited and there is nothing to resume
+        if (event.code === 1000) window.sessionStorage.removeItem(this.resumeKey);
         if (event.code !== 1000 && doReconnect) {
             overlayAddon.showOverlay('Reconnecting...');
             refreshToken().then(connect);
@@ -355,18 +395,33 @@ export class Xterm {
                 document.title = this.title;
                 break;
             case Command.SET_PREFERENCES:
-                this.applyPreferences({
-                    ...this.options.clientOptions,
-                    ...JSON.parse(textDecoder.decode(data)),
-                    ...this.parseOptsFromUrlQuery(window.location.search),
-                } as Preferences);
+                this.setPreferences(JSON.parse(textDecoder.decode(data)));
                 break;
+            case Command.SET_RESUME_ID:
+                window.sessionStorage.setItem(this.resumeKey, textDecoder.decode(data));
+                break;
+            case Command.RECONNECT: {
+                // the session moved to the ttyd on this port of the same host, the reconnect resumes it there
+                const url = new URL(this.options.wsUrl);
+                url.port = textDecoder.decode(data);
+                this.options.wsUrl = url.toString();
+                break;
+            }
             default:
                 console.warn(`[ttyd] unknown command: ${cmd}`);
                 break;
         }
     }
 
+    @bind
+    private setPreferences(prefs: Preferences) {
+        this.applyPreferences({
+            ...this.options.clientOptions,
+            ...prefs,
+            ...this.parseOptsFromUrlQuery(window.location.search),
+        } as Preferences);
+    }
+
     @bind
     private applyPreferences(prefs: Preferences) {
         const { terminal, fitAddon, register } = this;
@@ -54,6 +54,21 @@ const baseConfig = {
             },
             title: 'ttyd - Terminal',
             template: './template.html',
+            publicPath: '',
+            inline: true,
+        }),
+        // html shell referencing the content-hashed bundle, served by `ttyd --assets-dir dist`
+        new HtmlWebpackPlugin({
+            inject: false,
+            minify: {
+                removeComments: true,
+                collapseWhitespace: true,
+            },
+            title: 'ttyd - Terminal',
+            template: './template.html',
+            filename: 'shell.html',
+            publicPath: 'assets/',
+            inline: false,
         }),
     ],
     performance: {
@@ -0,0 +1,414 @@
+#include "cache.h"
+
+#include <ctype.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "utils.h"
+
+// editors save in several steps (truncate, write, rename), reload once they settled
+#define RELOAD_DELAY_MS 100
+
+static struct {
+  char *path;
+  char *dir;
+  char *name;
+  cache_entry_t *entry;
+  uv_fs_event_t watcher;
+  uv_timer_t timer;
+} index_cache;
+
+typedef struct asset_ {
+  char *name;
+  char *path;
+  cache_entry_t *entry;
+  const char *content_type;
+  bool immutable;
+  // stat of the file the entry was read from, non-hashed files are checked against it on every request
+  time_t mtime;
+  off_t size;
+  ino_t ino;
+  struct asset_ *next;
+} asset_t;
+
+static char *assets_dir = NULL;
+static asset_t *assets = NULL;
+
+static const struct {
+  const char *ext;
+  const char *type;
+} mime_types[] = {{".js", "application/javascript"},
+                  {".css", "text/css"},
+                  {".html", "text/html"},
+                  {".png", "image/png"},
+                  {".svg", "image/svg+xml"},
+                  {".ico", "image/x-icon"},
+                  {".woff", "font/woff"},
+                  {".woff2", "font/woff2"},
+                  {".ttf", "font/ttf"},
+                  {".map", "application/json"},
+                  {".json", "application/json"},
+                  {".txt", "text/plain"},
+                  {NULL, NULL}};
+
+static char *read_file(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) return NULL;
+
+  struct stat st;
+  char *buf = NULL;
+  // an empty file is most likely a save in progress, keep serving the previous version
+  if (fstat(fileno(fp), &st) == 0 && st.st_size > 0) {
+    buf = xmalloc((size_t)st.st_size);
+    if (fread(buf, 1, (size_t)st.st_size, fp) != (size_t)st.st_size) {
+      free(buf);
+      buf = NULL;
+    }
+    *len = (size_t)st.st_size;
+  }
+
+  fclose(fp);
+  return buf;
+}
+
+static bool gzip_buf(const char *in, size_t in_len, char **out, size_t *out_len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+  size_t cap = deflateBound(&stream, (uLong)in_len);
+  char *buf = xmalloc(cap);
+  stream.next_in = (Bytef *)in;
+  stream.avail_in = (uInt)in_len;
+  stream.next_out = (Bytef *)buf;
+  stream.avail_out = (uInt)cap;
+
+  int ret = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END || stream.total_out >= in_len) {
+    free(buf);
+    return false;
+  }
+
+  *out = buf;
+  *out_len = stream.total_out;
+  return true;
+}
+
+const unsigned char cache_gzip_header[10] = {0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03};
+
+cache_entry_t *cache_entry_new(char *data, size_t len, char *gz, size_t gz_len) {
+  cache_entry_t *entry = xmalloc(sizeof(cache_entry_t));
+  memset(entry, 0, sizeof(cache_entry_t));
+  entry->refs = 1;
+  entry->data = data;
+  entry->len = len;
+  entry->gz = gz;
+  entry->gz_len = gz != NULL ? gz_len : 0;
+
+  unsigned long crc = crc32(0L, (const Bytef *)data, (uInt)len);
+  snprintf(entry->etag, sizeof(entry->etag), "\"%08lx-%zx\"", crc, len);
+  snprintf(entry->gz_etag, sizeof(entry->gz_etag), "\"%08lx-%zx-gz\"", crc, len);
+
+  return entry;
+}
+
+cache_entry_t *cache_entry_load(const char *path) {
+  size_t len = 0;
+  char *data = read_file(path, &len);
+  if (data == NULL) return NULL;
+
+  char *gz = NULL;
+  size_t gz_len = 0;
+  if (!gzip_buf(data, len, &gz, &gz_len)) gz = NULL;
+  return cache_entry_new(data, len, gz, gz_len);
+}
+
+cache_entry_t *cache_entry_ref(cache_entry_t *entry) {
+  if (entry != NULL) entry->refs++;
+  return entry;
+}
+
+void cache_entry_unref(cache_entry_t *entry) {
+  if (entry == NULL || --entry->refs > 0) return;
+  if (entry->splice != NULL) {
+    free(entry->splice->gz_head);
+    free(entry->splice->gz_tail);
+    free(entry->splice);
+  }
+  free(entry->data);
+  free(entry->gz);
+  free(entry);
+}
+
+// raw deflate (no zlib/gzip wrapper), so independently compressed pieces can be concatenated
+static bool deflate_raw(const char *in, size_t len, int level, int flush, char **out, size_t *out_len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+  // room for the empty stored block a sync flush appends
+  size_t cap = deflateBound(&stream, (uLong)len) + 16;
+  char *buf = xmalloc(cap);
+  stream.next_in = (Bytef *)in;
+  stream.avail_in = (uInt)len;
+  stream.next_out = (Bytef *)buf;
+  stream.avail_out = (uInt)cap;
+
+  int ret = deflate(&stream, flush);
+  deflateEnd(&stream);
+  if ((flush == Z_FINISH && ret != Z_STREAM_END) || (flush != Z_FINISH && (ret != Z_OK || stream.avail_in != 0))) {
+    free(buf);
+    return false;
+  }
+
+  *out = buf;
+  *out_len = stream.total_out;
+  return true;
+}
+
+static const char *find_head(const char *data, size_t len) {
+  const char *p = data, *end = data + len;
+  while ((p = memchr(p, '<', (size_t)(end - p))) != NULL) {
+    if (end - p > 6 && strncasecmp(p, "<head", 5) == 0 && (p[5] == '>' || isspace((unsigned char)p[5]))) {
+      return memchr(p, '>', (size_t)(end - p));
+    }
+    p++;
+  }
+  return NULL;
+}
+
+bool cache_splice_init(cache_entry_t *entry) {
+  if (entry->splice != NULL) return true;
+
+  const char *gt = find_head(entry->data, entry->len);
+  if (gt == NULL) return false;
+
+  cache_splice_t *splice = xmalloc(sizeof(cache_splice_t));
+  splice->pos = (size_t)(gt + 1 - entry->data);
+  const char *tail = entry->data + splice->pos;
+  size_t tail_len = entry->len - splice->pos;
+  if (!deflate_raw(entry->data, splice->pos, Z_BEST_COMPRESSION, Z_SYNC_FLUSH, &splice->gz_head,
+                   &splice->gz_head_len)) {
+    free(splice);
+    return false;
+  }
+  if (!deflate_raw(tail, tail_len, Z_BEST_COMPRESSION, Z_FINISH, &splice->gz_tail, &splice->gz_tail_len)) {
+    free(splice->gz_head);
+    free(splice);
+    return false;
+  }
+  splice->head_crc = crc32(0L, (const Bytef *)entry->data, (uInt)splice->pos);
+  splice->tail_crc = crc32(0L, (const Bytef *)tail, (uInt)tail_len);
+
+  entry->splice = splice;
+  return true;
+}
+
+bool cache_splice_deflate(const char *in, size_t len, char **out, size_t *out_len) {
+  return deflate_raw(in, len, Z_DEFAULT_COMPRESSION, Z_SYNC_FLUSH, out, out_len);
+}
+
+void cache_splice_trailer(cache_entry_t *entry, const char *insert, size_t insert_len, unsigned char trailer[8]) {
+  cache_splice_t *splice = entry->splice;
+  unsigned long crc = crc32(0L, (const Bytef *)insert, (uInt)insert_len);
+  crc = crc32_combine(splice->head_crc, crc, (z_off_t)insert_len);
+  crc = crc32_combine(crc, splice->tail_crc, (z_off_t)(entry->len - splice->pos));
+  unsigned long size = (unsigned long)(entry->len + insert_len);
+  for (int i = 0; i < 4; i++) {
+    trailer[i] = (unsigned char)(crc >> (8 * i));
+    trailer[4 + i] = (unsigned char)(size >> (8 * i));
+  }
+}
+
+static void reload_cb(uv_timer_t *timer) {
+  cache_entry_t *entry = cache_entry_load(index_cache.path);
+  if (entry == NULL) {
+    lwsl_warn("failed to reload index.html: %s, keep serving the previous version\n", index_cache.path);
+    return;
+  }
+  if (index_cache.entry != NULL && strcmp(index_cache.entry->etag, entry->etag) == 0) {
+    cache_entry_unref(entry);
+    return;
+  }
+
+  // in-flight responses keep their own reference to the old entry
+  cache_entry_unref(index_cache.entry);
+  index_cache.entry = entry;
+  lwsl_notice("reloaded index.html: %s, etag: %s\n", index_cache.path, entry->etag);
+}
+
+static void fs_event_cb(uv_fs_event_t *handle, const char *filename, int events, int status) {
+  if (status < 0) return;
+  if (filename != NULL && strcmp(filename, index_cache.name) != 0) return;
+  uv_timer_start(&index_cache.timer, reload_cb, RELOAD_DELAY_MS, 0);
+}
+
+bool index_cache_init(uv_loop_t *loop, const char *path) {
+  index_cache.path = strdup(path);
+  index_cache.entry = cache_entry_load(path);
+  if (index_cache.entry == NULL) {
+    free(index_cache.path);
+    index_cache.path = NULL;
+    return false;
+  }
+
+  // watch the directory rather than the file, so atomic replace (write + rename) is noticed too
+  char *sep = strrchr(index_cache.path, '/');
+#ifdef _WIN32
+  char *bsep = strrchr(index_cache.path, '\\');
+  if (bsep > sep) sep = bsep;
+#endif
+  if (sep == NULL) {
+    index_cache.dir = strdup(".");
+    index_cache.name = strdup(index_cache.path);
+  } else {
+    index_cache.dir = strdup(index_cache.path);
+    index_cache.dir[sep - index_cache.path] = '\0';
+    if (index_cache.dir[0] == '\0') strcpy(index_cache.dir, "/");
+    index_cache.name = strdup(sep + 1);
+  }
+
+  uv_timer_init(loop, &index_cache.timer);
+  uv_fs_event_init(loop, &index_cache.watcher);
+  int err = uv_fs_event_start(&index_cache.watcher, fs_event_cb, index_cache.dir, 0);
+  if (err) lwsl_warn("can not watch %s for changes: %s\n", index_cache.dir, uv_strerror(err));
+
+  return true;
+}
+
+cache_entry_t *index_cache_get() { return cache_entry_ref(index_cache.entry); }
+
+void index_cache_close() {
+  if (index_cache.path == NULL) return;
+  uv_fs_event_stop(&index_cache.watcher);
+  uv_timer_stop(&index_cache.timer);
+  uv_close((uv_handle_t *)&index_cache.watcher, NULL);
+  uv_close((uv_handle_t *)&index_cache.timer, NULL);
+  cache_entry_unref(index_cache.entry);
+  index_cache.entry = NULL;
+  free(index_cache.path);
+  free(index_cache.dir);
+  free(index_cache.name);
+  index_cache.path = NULL;
+}
+
+static const char *mime_type(const char *name) {
+  for (int i = 0; mime_types[i].ext != NULL; i++) {
+    if (endswith(name, mime_types[i].ext)) return mime_types[i].type;
+  }
+  return "application/octet-stream";
+}
+
+// webpack names bundle files [name].[contenthash].[ext], those never change under the same name
+static bool content_hashed(const char *name) {
+  const char *p = strchr(name, '.');
+  while (p != NULL) {
+    const char *q = strchr(p + 1, '.');
+    if (q == NULL) break;
+    size_t n = (size_t)(q - p - 1);
+    if (n >= 8 && strspn(p + 1, "0123456789abcdef") == n) return true;
+    p = q;
+  }
+  return false;
+}
+
+static bool valid_name(const char *name) {
+  return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL && strchr(name, '\\') == NULL;
+}
+
+static void asset_stat(asset_t *asset, const struct stat *st) {
+  asset->mtime = st->st_mtime;
+  asset->size = st->st_size;
+  asset->ino = st->st_ino;
+}
+
+static asset_t *asset_load(const char *name) {
+  size_t len = strlen(assets_dir) + strlen(name) + 2;
+  char *path = xmalloc(len);
+  snprintf(path, len, "%s/%s", assets_dir, name);
+  // stat before reading: a write racing the read changes mtime and is picked up on the next request
+  struct stat st;
+  cache_entry_t *entry = stat(path, &st) == 0 ? cache_entry_load(path) : NULL;
+  if (entry == NULL) {
+    free(path);
+    return NULL;
+  }
+
+  asset_t *asset = xmalloc(sizeof(asset_t));
+  asset->name = strdup(name);
+  asset->path = path;
+  asset->entry = entry;
+  asset_stat(asset, &st);
+  asset->content_type = mime_type(name);
+  asset->immutable = content_hashed(name);
+  asset->next = assets;
+  assets = asset;
+  return asset;
+}
+
+bool assets_init(uv_loop_t *loop, const char *dir) {
+  uv_fs_t req;
+  uv_dirent_t ent;
+  int count = 0;
+
+  if (uv_fs_scandir(loop, &req, dir, 0, NULL) < 0) {
+    uv_fs_req_cleanup(&req);
+    return false;
+  }
+  assets_dir = strdup(dir);
+  while (uv_fs_scandir_next(&req, &ent) != UV_EOF) {
+    if (ent.type != UV_DIRENT_FILE || !valid_name(ent.name)) continue;
+    if (asset_load(ent.name) != NULL) count++;
+  }
+  uv_fs_req_cleanup(&req);
+
+  lwsl_notice("loaded %d assets from %s\n", count, dir);
+  return true;
+}
+
+cache_entry_t *assets_get(const char *name, const char **content_type, bool *immutable) {
+  if (assets_dir == NULL || !valid_name(name)) return NULL;
+
+  asset_t *asset = assets;
+  while (asset != NULL && strcmp(asset->name, name) != 0) asset = asset->next;
+  // files of a newer bundle show up after an upgrade, load those on first use
+  if (asset == NULL) asset = asset_load(name);
+  if (asset == NULL) return NULL;
+
+  // no-cache files keep their name across builds, re-read them once they changed on disk; while the
+  // file is missing or unreadable (e.g. halfway through a deploy) the copy already loaded is served
+  struct stat st;
+  if (!asset->immutable && stat(asset->path, &st) == 0 &&
+      (st.st_mtime != asset->mtime || st.st_size != asset->size || st.st_ino != asset->ino)) {
+    cache_entry_t *entry = cache_entry_load(asset->path);
+    if (entry != NULL) {
+      lwsl_notice("asset %s changed on disk, reloaded\n", asset->name);
+      cache_entry_unref(asset->entry);
+      asset->entry = entry;
+      asset_stat(asset, &st);
+    }
+  }
+
+  *content_type = asset->content_type;
+  *immutable = asset->immutable;
+  return cache_entry_ref(asset->entry);
+}
+
+void assets_close() {
+  while (assets != NULL) {
+    asset_t *next = assets->next;
+    cache_entry_unref(assets->entry);
+    free(assets->name);
+    free(assets->path);
+    free(assets);
+    assets = next;
+  }
+  free(assets_dir);
+  assets_dir = NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef TTYD_CACHE_H
+#define TTYD_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+// precompressed halves of an html page, split right after <head> to insert per-request data
+typedef struct {
+  size_t pos;          // split offset in the identity body
+  char *gz_head;       // raw deflate of data[0, pos), ends with a sync flush
+  size_t gz_head_len;
+  unsigned long head_crc;
+  char *gz_tail;       // raw deflate of data[pos, len), final block
+  size_t gz_tail_len;
+  unsigned long tail_crc;
+} cache_splice_t;
+
+// an immutable, refcounted in-memory copy of a file, with a gzipped variant
+typedef struct {
+  int refs;
+  char *data;      // identity body
+  size_t len;
+  char *gz;        // gzip body, NULL if it does not compress
+  size_t gz_len;
+  char etag[32];   // quoted strong etag of the identity body
+  char gz_etag[36];
+  cache_splice_t *splice;
+} cache_entry_t;
+
+// gzip member header for spliced bodies, followed by the deflate blocks and a cache_splice_trailer()
+extern const unsigned char cache_gzip_header[10];
+
+// takes ownership of data and gz (which may be NULL), returns an entry with one reference
+cache_entry_t *cache_entry_new(char *data, size_t len, char *gz, size_t gz_len);
+// read path into memory and gzip it, returns an entry with one reference
+cache_entry_t *cache_entry_load(const char *path);
+cache_entry_t *cache_entry_ref(cache_entry_t *entry);
+void cache_entry_unref(cache_entry_t *entry);
+
+// prepare entry->splice, false if the page has no <head> to insert after
+bool cache_splice_init(cache_entry_t *entry);
+// raw deflate of the inserted bytes, fits between gz_head and gz_tail
+bool cache_splice_deflate(const char *in, size_t len, char **out, size_t *out_len);
+// gzip trailer (crc32 and size) for head + insert + tail
+void cache_splice_trailer(cache_entry_t *entry, const char *insert, size_t insert_len, unsigned char trailer[8]);
+
+// the custom index.html, reloaded when the file changes on disk
+bool index_cache_init(uv_loop_t *loop, const char *path);
+// returns a new reference to the current index, NULL if it never loaded
+cache_entry_t *index_cache_get();
+void index_cache_close();
+
+// files of the webpack bundle (--assets-dir), loaded at startup and on first request; files without a
+// content hash in their name are re-read when they change on disk
+bool assets_init(uv_loop_t *loop, const char *dir);
+// returns a new reference to the named asset, NULL if it does not exist
+cache_entry_t *assets_get(const char *name, const char **content_type, bool *immutable);
+void assets_close();
+
+#endif  // TTYD_CACHE_H
@@ -0,0 +1,262 @@
+#include "cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// a cgroup still holding processes after cgroup.kill is retried this often, and this many times
+#define CGROUP_RETRY_MS 100
+#define CGROUP_RETRIES 50
+#define CGROUP_LIMITS 3
+
+struct cgroup {
+  char *path;
+  int procs_fd;  // cgroup.procs, open across fork so the child only has to write
+  pid_t pid;
+  int retries;
+  struct cgroup *next;
+};
+
+static struct {
+  uv_loop_t *loop;
+  char *root;
+  unsigned serial;
+  struct {
+    const char *file;
+    char *value;
+  } limits[CGROUP_LIMITS];
+  struct cgroup *live;   // bound to a running command
+  struct cgroup *dying;  // waiting for its last processes to go
+  uv_timer_t *timer;
+} cg_state;
+
+static bool write_file(const char *dir, const char *file, const char *value) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  ssize_t n = write(fd, value, strlen(value));
+  close(fd);
+  return n == (ssize_t)strlen(value);
+}
+
+static bool read_file(const char *dir, const char *file, char *buf, size_t len) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  ssize_t n = read(fd, buf, len - 1);
+  close(fd);
+  if (n < 0) return false;
+  buf[n] = '\0';
+  return true;
+}
+
+bool cgroup_set_limit(const char *file, const char *value) {
+  static const char *files[CGROUP_LIMITS] = {"cpu.max", "memory.max", "pids.max"};
+  for (int i = 0; i < CGROUP_LIMITS; i++) {
+    if (strcmp(files[i], file) != 0) continue;
+    free(cg_state.limits[i].value);
+    cg_state.limits[i].file = files[i];
+    cg_state.limits[i].value = strdup(value);
+    return true;
+  }
+  return false;
+}
+
+bool cgroup_init(uv_loop_t *loop, const char *root) {
+  char buf[256];
+  if (!read_file(root, "cgroup.controllers", buf, sizeof(buf))) {
+    lwsl_err("%s is not a cgroup v2 directory: %s\n", root, strerror(errno));
+    return false;
+  }
+  // the limits need their controllers enabled for the children of root
+  for (int i = 0; i < CGROUP_LIMITS; i++) {
+    if (cg_state.limits[i].value == NULL) continue;
+    char controller[16] = "+";
+    strncat(controller, cg_state.limits[i].file, strcspn(cg_state.limits[i].file, "."));
+    if (strstr(buf, controller + 1) == NULL || !write_file(root, "cgroup.subtree_control", controller)) {
+      lwsl_err("can not enable the %s controller in %s: %s\n", controller + 1, root, strerror(errno));
+      return false;
+    }
+  }
+  cg_state.loop = loop;
+  cg_state.root = strdup(root);
+  cg_state.timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, cg_state.timer);
+  return true;
+}
+
+static void cgroup_free(struct cgroup *cg) {
+  if (cg->procs_fd >= 0) close(cg->procs_fd);
+  free(cg->path);
+  free(cg);
+}
+
+// false while processes are left in it
+static bool cgroup_remove(struct cgroup *cg) {
+  if (rmdir(cg->path) == 0 || errno == ENOENT) return true;
+  if (errno != EBUSY) {
+    lwsl_warn("can not remove cgroup %s: %s\n", cg->path, strerror(errno));
+    return true;
+  }
+  return false;
+}
+
+static void retry_cb(uv_timer_t *timer) {
+  struct cgroup **link = &cg_state.dying;
+  while (*link != NULL) {
+    struct cgroup *cg = *link;
+    if (cgroup_remove(cg) || ++cg->retries >= CGROUP_RETRIES) {
+      if (cg->retries >= CGROUP_RETRIES) lwsl_warn("giving up on removing cgroup %s\n", cg->path);
+      *link = cg->next;
+      cgroup_free(cg);
+    } else {
+      link = &cg->next;
+    }
+  }
+  if (cg_state.dying != NULL) uv_timer_start(timer, retry_cb, CGROUP_RETRY_MS, 0);
+}
+
+struct cgroup *cgroup_new() {
+  if (cg_state.root == NULL) return NULL;
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/ttyd-%d-%u", cg_state.root, (int)getpid(), ++cg_state.serial);
+  if (mkdir(path, 0755) != 0) {
+    lwsl_err("can not create cgroup %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct cgroup *cg = xmalloc(sizeof(struct cgroup));
+  memset(cg, 0, sizeof(struct cgroup));
+  cg->path = strdup(path);
+  cg->pid = -1;
+  cg->procs_fd = -1;
+  // a command that would run without the limits the operator asked for does not run at all
+  for (int i = 0; i < CGROUP_LIMITS; i++) {
+    if (cg_state.limits[i].value == NULL) continue;
+    if (!write_file(path, cg_state.limits[i].file, cg_state.limits[i].value)) {
+      lwsl_err("can not set %s of cgroup %s: %s\n", cg_state.limits[i].file, path, strerror(errno));
+      rmdir(path);
+      cgroup_free(cg);
+      return NULL;
+    }
+  }
+  char procs[PATH_MAX];
+  snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+  cg->procs_fd = open(procs, O_WRONLY | O_CLOEXEC);
+  if (cg->procs_fd < 0) {
+    lwsl_err("can not open %s: %s\n", procs, strerror(errno));
+    rmdir(path);
+    cgroup_free(cg);
+    return NULL;
+  }
+  return cg;
+}
+
+bool cgroup_enter(struct cgroup *cg) {
+  // "0" moves the writer, which is the child before it executes the command
+  return cg == NULL || write(cg->procs_fd, "0", 1) == 1;
+}
+
+void cgroup_bind(struct cgroup *cg, pid_t pid) {
+  if (cg == NULL) return;
+  close(cg->procs_fd);
+  cg->procs_fd = -1;
+  if (pid < 0) {
+    rmdir(cg->path);
+    cgroup_free(cg);
+    return;
+  }
+  cg->pid = pid;
+  cg->next = cg_state.live;
+  cg_state.live = cg;
+}
+
+bool cgroup_enabled() { return cg_state.root != NULL; }
+
+bool cgroup_attach(pid_t pid) {
+  if (!cgroup_enabled()) return true;
+  struct cgroup *cg = cgroup_new();
+  if (cg == NULL) return false;
+  char buf[16];
+  int n = snprintf(buf, sizeof(buf), "%d", (int)pid);
+  bool ok = write(cg->procs_fd, buf, (size_t)n) == n;
+  if (!ok) lwsl_err("can not move pid %d into cgroup %s\n", (int)pid, cg->path);
+  cgroup_bind(cg, pid);
+  return ok;
+}
+
+static struct cgroup *cgroup_find(pid_t pid, bool unlink) {
+  for (struct cgroup **link = &cg_state.live; *link != NULL; link = &(*link)->next) {
+    struct cgroup *cg = *link;
+    if (cg->pid != pid) continue;
+    if (unlink) *link = cg->next;
+    return cg;
+  }
+  return NULL;
+}
+
+void cgroup_release(pid_t pid) {
+  struct cgroup *cg = cgroup_find(pid, true);
+  if (cg == NULL) return;
+  if (cgroup_remove(cg)) {
+    cgroup_free(cg);
+    return;
+  }
+  // background jobs of the session outlive its command, they go with it (linux 5.14+)
+  write_file(cg->path, "cgroup.kill", "1");
+  cg->next = cg_state.dying;
+  cg_state.dying = cg;
+  if (!uv_is_active((uv_handle_t *)cg_state.timer)) uv_timer_start(cg_state.timer, retry_cb, CGROUP_RETRY_MS, 0);
+}
+
+bool cgroup_usage(pid_t pid, uint64_t *cpu_usec, uint64_t *memory) {
+  struct cgroup *cg = cgroup_find(pid, false);
+  if (cg == NULL) return false;
+  char buf[1024];
+  *cpu_usec = 0;
+  *memory = 0;
+  if (read_file(cg->path, "cpu.stat", buf, sizeof(buf))) {
+    char *p = strstr(buf, "usage_usec ");
+    if (p != NULL) *cpu_usec = strtoull(p + 11, NULL, 10);
+  }
+  if (read_file(cg->path, "memory.current", buf, sizeof(buf))) *memory = strtoull(buf, NULL, 10);
+  return true;
+}
+
+bool cgroup_freeze(pid_t pid, bool freeze) {
+  struct cgroup *cg = cgroup_find(pid, false);
+  return cg != NULL && write_file(cg->path, "cgroup.freeze", freeze ? "1" : "0");
+}
+
+static void timer_close_cb(uv_handle_t *handle) { free(handle); }
+
+// commands still running keep their cgroups, they are not ttyd's to kill on the way out
+void cgroup_close() {
+  struct cgroup *lists[] = {cg_state.live, cg_state.dying};
+  for (int i = 0; i < 2; i++) {
+    for (struct cgroup *cg = lists[i], *next; cg != NULL; cg = next) {
+      next = cg->next;
+      if (i == 1) rmdir(cg->path);
+      cgroup_free(cg);
+    }
+  }
+  cg_state.live = cg_state.dying = NULL;
+  if (cg_state.timer != NULL) {
+    uv_timer_stop(cg_state.timer);
+    uv_close((uv_handle_t *)cg_state.timer, timer_close_cb);
+    cg_state.timer = NULL;
+  }
+  for (int i = 0; i < CGROUP_LIMITS; i++) free(cg_state.limits[i].value);
+  free(cg_state.root);
+  cg_state.root = NULL;
+}
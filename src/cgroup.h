@@ -0,0 +1,37 @@
+#ifndef TTYD_CGROUP_H
+#define TTYD_CGROUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <uv.h>
+
+struct cgroup;
+
+// put every spawned command into a cgroup of its own under root, a cgroup v2 directory delegated
+// to ttyd (which must not run in it), with the limits set by cgroup_set_limit()
+bool cgroup_init(uv_loop_t *loop, const char *root);
+// a control file written to each new cgroup, eg: memory.max, before the command starts
+bool cgroup_set_limit(const char *file, const char *value);
+void cgroup_close();
+// --cgroup is set: a command that can not get its cgroup must not run
+bool cgroup_enabled();
+
+// before fork: create the cgroup for the next command, NULL if cgroups are off or that failed
+struct cgroup *cgroup_new();
+// in the forked child, before exec: move into the cgroup, async-signal-safe; false if that failed,
+// the child must then exit instead of running the command
+bool cgroup_enter(struct cgroup *cg);
+// in the parent: the command runs as pid, or fork failed if pid < 0
+void cgroup_bind(struct cgroup *cg, pid_t pid);
+// move an already running process into a new cgroup, for children spawned without a fork hook;
+// false if cgroups are on and that failed
+bool cgroup_attach(pid_t pid);
+// the command exited: kill what is left of its process tree and remove the cgroup
+void cgroup_release(pid_t pid);
+// cpu time and memory of the command and its children, false if it has no cgroup
+bool cgroup_usage(pid_t pid, uint64_t *cpu_usec, uint64_t *memory);
+// freeze or thaw the whole process tree of the command, false if it has no cgroup
+bool cgroup_freeze(pid_t pid, bool freeze);
+
+#endif  // TTYD_CGROUP_H
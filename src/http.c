@@ -1,15 +1,44 @@
+#if defined(__has_include)
+#  if __has_include(<json-c/json.h>)
+#    include <json-c/json.h>
+#  else
+#    include <json.h>
+#  endif
+#else
+#  include <json-c/json.h>
+#endif
 #include <libwebsockets.h>
 #include <string.h>
+#include <unistd.h> /* gethostname */
 #include <zlib.h>
 
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+#include "cache.h"
 #include "html.h"
+#include "httpexec.h"
+#include "httpstream.h"
+#include "metrics.h"
 #include "server.h"
+#include "ticket.h"
 #include "utils.h"
 
 enum { AUTH_OK, AUTH_FAIL, AUTH_ERROR };
 
+extern pty_process *process_prespawn(struct lws *wsi, const char *user);
+extern void process_release(void *process);
+
+// bounds for a single body write, the actual size follows SO_SNDBUF
+#define HTTP_MIN_CHUNK 4096
+#define HTTP_MAX_CHUNK (256 * 1024)
+
 static char *html_cache = NULL;
 static size_t html_cache_len = 0;
+static cache_entry_t *html_entry = NULL;
+static char *bootstrap_head = NULL;
+static const char *bootstrap_tail = "\"};</script>";
 
 static int send_unauthorized(struct lws *wsi, unsigned int code, enum lws_token_indexes header) {
   unsigned char buffer[1024 + LWS_PRE], *p, *end;
@@ -47,7 +76,13 @@ static int check_auth(struct lws *wsi, struct pss_http *pss) {
                              WSI_TOKEN_HTTP_PROXY_AUTHENTICATE);
   }
 
-  /* fall through to whatever your non-proxy auth path is, or AUTH_OK if none */
+  if (server->credential != NULL) {
+    char buf[256];
+    int len = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_AUTHORIZATION);
+    if (len > 0 && strstr(buf, "Basic ") && !strcmp(buf + 6, server->credential)) return AUTH_OK;
+    return send_unauthorized(wsi, HTTP_STATUS_UNAUTHORIZED, WSI_TOKEN_HTTP_WWW_AUTHENTICATE);
+  }
+
   return AUTH_OK;
 }
 
@@ -89,9 +124,246 @@ static bool uncompress_html(char **output, size_t *output_len) {
 }
 
 static void pss_buffer_free(struct pss_http *pss) {
-  if (pss->buffer != (char *)index_html && pss->buffer != html_cache) free(pss->buffer);
+  if (pss->exec != NULL) {
+    http_exec_free(pss->exec);
+    pss->exec = NULL;
+  }
+  if (pss->stream != NULL) {
+    http_stream_free(pss->stream);
+    pss->stream = NULL;
+  }
+  if (pss->entry != NULL) {
+    cache_entry_unref(pss->entry);
+    pss->entry = NULL;
+  }
+  if (pss->buffer != NULL) {
+    free(pss->buffer);
+    pss->buffer = NULL;
+  }
+  pss->body_count = pss->body_index = 0;
+  pss->body_offset = 0;
+  if (pss->chunk != NULL) {
+    free(pss->chunk);
+    pss->chunk = NULL;
+  }
+}
+
+static void body_add(struct pss_http *pss, const void *base, size_t len) {
+  pss->body[pss->body_count].base = base;
+  pss->body[pss->body_count].len = len;
+  pss->body_count++;
 }
 
+static size_t body_len(struct pss_http *pss) {
+  size_t len = 0;
+  for (int i = 0; i < pss->body_count; i++) len += pss->body[i].len;
+  return len;
+}
+
+// the built-in index as a cache entry, it keeps its first reference forever
+static cache_entry_t *builtin_entry() {
+  if (html_entry != NULL) return html_entry;
+
+  char *output;
+  size_t output_len;
+  if (!uncompress_html(&output, &output_len)) return NULL;
+#ifdef LWS_WITH_HTTP_STREAM_COMPRESSION
+  html_entry = cache_entry_new(output, output_len, NULL, 0);
+#else
+  html_entry = cache_entry_new(output, output_len, (char *)index_html, index_html_len);
+#endif
+  return html_entry;
+}
+
+static bool etag_match(struct lws *wsi, const char *etag) {
+  char buf[256];
+  int len = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_IF_NONE_MATCH);
+  return len > 0 && strstr(buf, etag) != NULL;
+}
+
+// revalidate on every use, an unchanged file then costs a 304 without body
+static const char *no_cache = "no-cache";
+static const char *immutable = "public, max-age=31536000, immutable";
+
+static int add_cache_headers(struct lws *wsi, const char *etag, const char *cache_control, unsigned char **p,
+                             unsigned char *end) {
+  return lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_ETAG, (const unsigned char *)etag, (int)strlen(etag), p,
+                                      end) ||
+         lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (const unsigned char *)cache_control,
+                                      (int)strlen(cache_control), p, end) ||
+         lws_add_http_header_by_name(wsi, (const unsigned char *)"vary:", (const unsigned char *)"Accept-Encoding", 15,
+                                     p, end);
+}
+
+static int send_not_modified(struct lws *wsi, const char *etag, const char *cache_control) {
+  unsigned char buffer[1024 + LWS_PRE], *p, *end;
+  p = buffer + LWS_PRE;
+  end = p + sizeof(buffer) - LWS_PRE;
+
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_NOT_MODIFIED, &p, end) ||
+      add_cache_headers(wsi, etag, cache_control, &p, end) || lws_add_http_header_content_length(wsi, 0, &p, end) ||
+      lws_finalize_http_header(wsi, &p, end) ||
+      lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+    return 1;
+  return 0;
+}
+
+// takes over the entry reference, returns -1 on error, 1 if answered with 304, 0 if the body is pending
+static int serve_entry(struct lws *wsi, struct pss_http *pss, cache_entry_t *entry, const char *content_type,
+                       const char *cache_control) {
+  unsigned char buffer[1024 + LWS_PRE], *p, *end;
+  p = buffer + LWS_PRE;
+  end = p + sizeof(buffer) - LWS_PRE;
+
+  bool gzip = entry->gz != NULL && accept_gzip(wsi);
+  const char *etag = gzip ? entry->gz_etag : entry->etag;
+  if (etag_match(wsi, etag)) {
+    cache_entry_unref(entry);
+    return send_not_modified(wsi, etag, cache_control) ? -1 : 1;
+  }
+
+  // the entry stays alive for this response even if the file is reloaded meanwhile
+  pss->entry = entry;
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)content_type,
+                                   (int)strlen(content_type), &p, end) ||
+      (gzip &&
+       lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, (unsigned char *)"gzip", 4, &p, end)) ||
+      add_cache_headers(wsi, etag, cache_control, &p, end) ||
+      lws_add_http_header_content_length(wsi, (unsigned long)(gzip ? entry->gz_len : entry->len), &p, end) ||
+      lws_finalize_http_header(wsi, &p, end) ||
+      lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+    return -1;
+
+  if (gzip)
+    body_add(pss, entry->gz, entry->gz_len);
+  else
+    body_add(pss, entry->data, entry->len);
+  lws_callback_on_writable(wsi);
+  return 0;
+}
+
+static char *json_escape_html(const char *json) {
+  // "<" would let a string in the json close the <script> element early
+  size_t n = 0;
+  for (const char *p = json; *p; p++) n += *p == '<' ? 6 : 1;
+  char *out = xmalloc(n + 1), *q = out;
+  for (const char *p = json; *p; p++) {
+    if (*p == '<') {
+      memcpy(q, "\\u003c", 6);
+      q += 6;
+    } else {
+      *q++ = *p;
+    }
+  }
+  *q = '\0';
+  return out;
+}
+
+static const char *bootstrap_script() {
+  if (bootstrap_head != NULL) return bootstrap_head;
+
+  char hostname[128] = "";
+  gethostname(hostname, sizeof(hostname) - 1);
+  size_t len = strlen(server->command) + strlen(hostname) + 4;
+  char *title = xmalloc(len);
+  snprintf(title, len, "%s (%s)", server->command, hostname);
+
+  json_object *obj = json_object_new_object();
+  json_object_object_add(obj, "title", json_object_new_string(title));
+  json_object_object_add(obj, "prefs", json_tokener_parse(server->prefs_json));
+  char *json = json_escape_html(json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
+  json_object_put(obj);
+  free(title);
+
+  // the object is left open, the per-request ticket and bootstrap_tail complete it
+  size_t json_len = strlen(json);
+  len = json_len + 64;
+  bootstrap_head = xmalloc(len);
+  snprintf(bootstrap_head, len, "<script>window.ttydBootstrap=%.*s,\"ticket\":\"", (int)(json_len - 1), json);
+  free(json);
+  return bootstrap_head;
+}
+
+// serve index.html with a <script> carrying title, prefs and a websocket ticket right after <head>,
+// returns -1 on error, 1 if the page can not carry it, 0 if the body is pending
+static int serve_bootstrap(struct lws *wsi, struct pss_http *pss, cache_entry_t *entry) {
+  unsigned char buffer[1024 + LWS_PRE], *p, *end;
+  p = buffer + LWS_PRE;
+  end = p + sizeof(buffer) - LWS_PRE;
+
+  if (!cache_splice_init(entry)) return 1;
+
+  char user[30] = "";
+  if (server->auth_header != NULL)
+    lws_hdr_custom_copy(wsi, user, sizeof(user), server->auth_header, (int)strlen(server->auth_header));
+  // with --prespawn the shell starts up while the browser is still loading the page
+  pty_process *process = server->prespawn ? process_prespawn(wsi, user) : NULL;
+  char ticket[TICKET_LEN];
+  if (!ticket_issue(user, process, process_release, ticket, sizeof(ticket))) {
+    if (process != NULL) process_release(process);
+    return 1;
+  }
+
+  const char *head = bootstrap_script();
+  size_t insert_len = strlen(head) + strlen(ticket) + strlen(bootstrap_tail);
+  char *insert = xmalloc(insert_len + 1);
+  snprintf(insert, insert_len + 1, "%s%s%s", head, ticket, bootstrap_tail);
+
+  // only the few hundred inserted bytes are compressed per request, the rest of the page is precompressed
+  bool gzip = entry->gz != NULL && accept_gzip(wsi);
+  cache_splice_t *splice = entry->splice;
+  if (gzip) {
+    char *gz = NULL;
+    size_t gz_len = 0;
+    if (!cache_splice_deflate(insert, insert_len, &gz, &gz_len)) {
+      free(insert);
+      return -1;
+    }
+    cache_splice_trailer(entry, insert, insert_len, pss->trailer);
+    free(insert);
+    pss->buffer = gz;
+    body_add(pss, cache_gzip_header, sizeof(cache_gzip_header));
+    body_add(pss, splice->gz_head, splice->gz_head_len);
+    body_add(pss, gz, gz_len);
+    body_add(pss, splice->gz_tail, splice->gz_tail_len);
+    body_add(pss, pss->trailer, sizeof(pss->trailer));
+  } else {
+    pss->buffer = insert;
+    body_add(pss, entry->data, splice->pos);
+    body_add(pss, insert, insert_len);
+    body_add(pss, entry->data + splice->pos, entry->len - splice->pos);
+  }
+  pss->entry = entry;
+
+  // the ticket makes every response unique
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)"text/html", 9, &p, end) ||
+      (gzip &&
+       lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, (unsigned char *)"gzip", 4, &p, end)) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (const unsigned char *)"no-store", 8, &p, end) ||
+      lws_add_http_header_content_length(wsi, (unsigned long)body_len(pss), &p, end) ||
+      lws_finalize_http_header(wsi, &p, end) ||
+      lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+    return -1;
+
+  lws_callback_on_writable(wsi);
+  return 0;
+}
+
+static size_t chunk_size(struct lws *wsi) {
+  size_t n = HTTP_MAX_CHUNK;
+  int sndbuf = 0;
+  socklen_t optlen = sizeof(sndbuf);
+  if (getsockopt(lws_get_socket_fd(lws_get_network_wsi(wsi)), SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, &optlen) == 0 &&
+      sndbuf > 0 && (size_t)sndbuf < n)
+    n = (size_t)sndbuf;
+  return n < HTTP_MIN_CHUNK ? HTTP_MIN_CHUNK : n;
+}
+
+// h2 streams are children of the network connection, h1 connections are their own network wsi
+static bool is_h2_stream(struct lws *wsi) { return lws_get_network_wsi(wsi) != wsi; }
+
 static void access_log(struct lws *wsi, const char *path) {
   char rip[50];
 
@@ -103,10 +375,11 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
   struct pss_http *pss = (struct pss_http *)user;
   unsigned char buffer[4096 + LWS_PRE], *p, *end;
   char buf[256];
-  bool done = false;
 
   switch (reason) {
     case LWS_CALLBACK_HTTP:
+      pss_buffer_free(pss);
+      pss->chunk_size = 0;
       access_log(wsi, (const char *)in);
       snprintf(pss->path, sizeof(pss->path), "%s", (const char *)in);
       switch (check_auth(wsi, pss)) {
@@ -133,8 +406,28 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
             lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
           return 1;
 
-        pss->buffer = pss->ptr = strdup(buf);
-        pss->len = n;
+        pss->buffer = strdup(buf);
+        body_add(pss, pss->buffer, n);
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
+      if (server->metrics && strcmp(pss->path, endpoints.metrics) == 0) {
+        size_t n = 0;
+        char *text = metrics_render(&n);
+        if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE,
+                                         (unsigned char *)"text/plain; version=0.0.4; charset=utf-8", 40, &p, end) ||
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (unsigned char *)"no-store", 8, &p, end) ||
+            lws_add_http_header_content_length(wsi, (unsigned long)n, &p, end) ||
+            lws_finalize_http_header(wsi, &p, end) ||
+            lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0) {
+          free(text);
+          return 1;
+        }
+
+        pss->buffer = text;
+        body_add(pss, pss->buffer, n);
         lws_callback_on_writable(wsi);
         break;
       }
@@ -150,73 +443,117 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         goto try_to_reuse;
       }
 
+      if (server->http_exec && strcmp(pss->path, endpoints.exec) == 0) {
+        pss->exec = http_exec_start(wsi);
+        if (pss->exec == NULL) goto try_to_reuse;
+        break;
+      }
+
+      if (server->stream && strcmp(pss->path, endpoints.stream) == 0) {
+        pss->stream = http_stream_start(wsi);
+        if (pss->stream == NULL) goto try_to_reuse;
+        break;
+      }
+
+      size_t assets_len = strlen(endpoints.assets);
+      if (server->assets_dir != NULL && strncmp(pss->path, endpoints.assets, assets_len) == 0) {
+        const char *type = NULL;
+        bool hashed = false;
+        cache_entry_t *entry = assets_get(pss->path + assets_len, &type, &hashed);
+        if (entry == NULL) {
+          lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+          goto try_to_reuse;
+        }
+        int n = serve_entry(wsi, pss, entry, type, hashed ? immutable : no_cache);
+        if (n < 0) return 1;
+        if (n > 0) goto try_to_reuse;
+        break;
+      }
+
       if (strcmp(pss->path, endpoints.index) != 0) {
         lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
         goto try_to_reuse;
       }
 
-      const char *content_type = "text/html";
-      if (server->index != NULL) {
-        int n = lws_serve_http_file(wsi, server->index, content_type, NULL, 0);
-        if (n < 0 || (n > 0 && lws_http_transaction_completed(wsi))) return 1;
-      } else {
-        char *output = (char *)index_html;
-        size_t output_len = index_html_len;
-        if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
-            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)content_type, 9, &p,
-                                         end))
-          return 1;
-#ifdef LWS_WITH_HTTP_STREAM_COMPRESSION
-        if (!uncompress_html(&output, &output_len)) return 1;
-#else
-        if (accept_gzip(wsi)) {
-          if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, (unsigned char *)"gzip", 4, &p, end))
-            return 1;
-        } else {
-          if (!uncompress_html(&output, &output_len)) return 1;
-        }
-#endif
+      cache_entry_t *entry = server->index != NULL ? index_cache_get() : cache_entry_ref(builtin_entry());
+      if (entry == NULL) {
+        lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+        goto try_to_reuse;
+      }
+      if (server->bootstrap) {
+        int n = serve_bootstrap(wsi, pss, entry);
+        if (n < 0) return 1;
+        if (n == 0) break;
+        // no <head> or too many outstanding tickets, the client falls back to /token
+      }
+      int n = serve_entry(wsi, pss, entry, "text/html", no_cache);
+      if (n < 0) return 1;
+      if (n > 0) goto try_to_reuse;
+      break;
 
-        if (lws_add_http_header_content_length(wsi, (unsigned long)output_len, &p, end) ||
-            lws_finalize_http_header(wsi, &p, end) ||
-            lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
-          return 1;
+    case LWS_CALLBACK_HTTP_BODY:
+      if (pss->exec != NULL) http_exec_body(pss->exec, in, len);
+      break;
 
-        pss->buffer = pss->ptr = output;
-        pss->len = output_len;
-        lws_callback_on_writable(wsi);
-      }
+    case LWS_CALLBACK_HTTP_BODY_COMPLETION:
+      if (pss->exec != NULL) http_exec_body_done(pss->exec);
       break;
 
     case LWS_CALLBACK_HTTP_WRITEABLE:
-      if (!pss->buffer || pss->len == 0) {
+      if (pss->exec != NULL) {
+        int n = http_exec_writable(pss->exec);
+        if (n == 0) break;
+        pss_buffer_free(pss);
+        if (n < 0) return -1;
+        goto try_to_reuse;
+      }
+      if (pss->stream != NULL) {
+        int n = http_stream_writable(pss->stream);
+        if (n == 0) break;
+        pss_buffer_free(pss);
+        if (n < 0) return -1;
+        goto try_to_reuse;
+      }
+      if (pss->body_count == 0) {
         goto try_to_reuse;
       }
+      if (pss->chunk_size == 0) pss->chunk_size = chunk_size(wsi);
+
+      // write straight from the cached body, h1 does not touch the LWS_PRE area before the payload
+      while (pss->body_index < pss->body_count) {
+        size_t left = pss->body[pss->body_index].len - pss->body_offset;
+        if (left == 0) {
+          pss->body_index++;
+          pss->body_offset = 0;
+          continue;
+        }
+        if (lws_send_pipe_choked(wsi)) {
+          lws_callback_on_writable(wsi);
+          return 0;
+        }
 
-      do {
-        int n = sizeof(buffer) - LWS_PRE;
+        size_t n = pss->chunk_size;
         int m = lws_get_peer_write_allowance(wsi);
         if (m == 0) {
           lws_callback_on_writable(wsi);
           return 0;
-        } else if (m != -1 && m < n) {
-          n = m;
+        } else if (m > 0 && (size_t)m < n) {
+          n = (size_t)m;
         }
-        if (pss->ptr + n > pss->buffer + pss->len) {
-          n = (int)(pss->len - (pss->ptr - pss->buffer));
-          done = true;
+        if (n > left) n = left;
+
+        unsigned char *data = (unsigned char *)pss->body[pss->body_index].base + pss->body_offset;
+        if (is_h2_stream(wsi)) {
+          // h2 writes its frame header in front of the payload, never let it scribble on the shared cache
+          if (pss->chunk == NULL) pss->chunk = xmalloc(LWS_PRE + pss->chunk_size);
+          memcpy(pss->chunk + LWS_PRE, data, n);
+          data = pss->chunk + LWS_PRE;
         }
-        memcpy(buffer + LWS_PRE, pss->ptr, n);
-        pss->ptr += n;
-        if (lws_write_http(wsi, buffer + LWS_PRE, (size_t)n) < n) {
+        pss->body_offset += n;
+        if (lws_write_http(wsi, data, n) < (int)n) {
           pss_buffer_free(pss);
           return -1;
         }
-      } while (!lws_send_pipe_choked(wsi) && !done);
-
-      if (!done && pss->ptr < pss->buffer + pss->len) {
-        lws_callback_on_writable(wsi);
-        break;
       }
 
       pss_buffer_free(pss);
@@ -224,6 +561,10 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
     case LWS_CALLBACK_HTTP_FILE_COMPLETION:
       goto try_to_reuse;
+
+    case LWS_CALLBACK_CLOSED_HTTP:
+      pss_buffer_free(pss);
+      break;
 #if (defined(LWS_OPENSSL_SUPPORT) || defined(LWS_WITH_TLS)) && !defined(LWS_WITH_MBEDTLS)
     case LWS_CALLBACK_OPENSSL_PERFORM_CLIENT_CERT_VERIFICATION:
       if (!len || (SSL_get_verify_result((SSL *)in) != X509_V_OK)) {
@@ -0,0 +1,284 @@
+#include "httpexec.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "runcmd.h"
+#include "server.h"
+#include "urlargs.h"
+#include "utils.h"
+#include "wspipe.h"
+
+// bytes of stdout per chunk, and the room in front of it for the chunk size line
+#define EXEC_CHUNK 32768
+#define EXEC_CHUNK_HDR 16
+
+struct http_exec {
+  struct lws *wsi;
+  bool h2;
+  pid_t pid;
+  struct pipe_child *child;
+  int status;
+  bool exited;
+
+  int fd_in;
+  uv_poll_t *in_poll;
+  unsigned char *body;  // request body stdin did not take yet, socket reads stop meanwhile
+  size_t body_len;
+  size_t body_off;
+  bool body_done;
+
+  int fd_out;
+  uv_poll_t *out_poll;
+  unsigned char *frame;  // LWS_PRE + chunk size line + data + CRLF
+  size_t frame_len;
+  int fd_err;
+  uv_poll_t *err_poll;
+};
+
+static void handle_free_cb(uv_handle_t *handle) { free(handle); }
+
+static uv_poll_t *poll_open(struct http_exec *exec, int fd, int events, uv_poll_cb cb) {
+  uv_poll_t *handle = xmalloc(sizeof(uv_poll_t));
+  if (uv_poll_init(server->loop, handle, fd) != 0) {
+    free(handle);
+    return NULL;
+  }
+  handle->data = exec;
+  if (events) uv_poll_start(handle, events, cb);
+  return handle;
+}
+
+static void fd_close(uv_poll_t **handle, int *fd) {
+  if (*handle != NULL) {
+    uv_poll_stop(*handle);
+    uv_close((uv_handle_t *)*handle, handle_free_cb);
+    *handle = NULL;
+  }
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+static bool exec_done(struct http_exec *exec) { return exec->exited && exec->fd_out < 0 && exec->frame_len == 0; }
+
+static void in_close(struct http_exec *exec) {
+  fd_close(&exec->in_poll, &exec->fd_in);
+  free(exec->body);
+  exec->body = NULL;
+  exec->body_len = exec->body_off = 0;
+  lws_rx_flow_control(exec->wsi, 1);
+}
+
+static void in_flush(struct http_exec *exec);
+
+static void in_cb(uv_poll_t *handle, int status, int events) { in_flush((struct http_exec *)handle->data); }
+
+static void in_flush(struct http_exec *exec) {
+  while (exec->body_off < exec->body_len) {
+    ssize_t n = write(exec->fd_in, exec->body + exec->body_off, exec->body_len - exec->body_off);
+    if (n > 0) {
+      exec->body_off += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      uv_poll_start(exec->in_poll, UV_WRITABLE, in_cb);
+      return;
+    }
+    // EPIPE: the command does not want more input
+    in_close(exec);
+    return;
+  }
+
+  free(exec->body);
+  exec->body = NULL;
+  exec->body_len = exec->body_off = 0;
+  uv_poll_stop(exec->in_poll);
+  if (exec->body_done)
+    in_close(exec);
+  else
+    lws_rx_flow_control(exec->wsi, 1);
+}
+
+void http_exec_body(struct http_exec *exec, const void *in, size_t len) {
+  if (exec->fd_in < 0 || len == 0) return;
+  // reading the socket stops until stdin took the body, lws may still hand over what it had buffered
+  // before that took effect: it goes behind what is pending
+  size_t pending = exec->body_len - exec->body_off;
+  unsigned char *body = xmalloc(pending + len);
+  if (pending > 0) memcpy(body, exec->body + exec->body_off, pending);
+  memcpy(body + pending, in, len);
+  free(exec->body);
+  exec->body = body;
+  exec->body_len = pending + len;
+  exec->body_off = 0;
+  lws_rx_flow_control(exec->wsi, 0);
+  // with input pending, in_cb is waiting for stdin already
+  if (pending == 0) in_flush(exec);
+}
+
+void http_exec_body_done(struct http_exec *exec) {
+  exec->body_done = true;
+  if (exec->fd_in >= 0 && exec->body == NULL) in_close(exec);
+}
+
+static void out_read(struct http_exec *exec) {
+  if (exec->fd_out < 0 || exec->frame_len > 0) return;
+  if (exec->frame == NULL) exec->frame = xmalloc(LWS_PRE + EXEC_CHUNK_HDR + EXEC_CHUNK + 2);
+  ssize_t n = read(exec->fd_out, exec->frame + LWS_PRE + EXEC_CHUNK_HDR, EXEC_CHUNK);
+  if (n > 0) {
+    exec->frame_len = (size_t)n;
+    // the chunk goes out before more is read, so a slow client slows the command down
+    uv_poll_stop(exec->out_poll);
+    lws_callback_on_writable(exec->wsi);
+    return;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+  fd_close(&exec->out_poll, &exec->fd_out);
+  if (exec_done(exec)) lws_callback_on_writable(exec->wsi);
+}
+
+static void out_cb(uv_poll_t *handle, int status, int events) { out_read((struct http_exec *)handle->data); }
+
+static void err_cb(uv_poll_t *handle, int status, int events) {
+  struct http_exec *exec = (struct http_exec *)handle->data;
+  char buf[1024];
+  ssize_t n = read(exec->fd_err, buf, sizeof(buf) - 1);
+  if (n > 0) {
+    while (n > 0 && buf[n - 1] == '\n') n--;
+    buf[n] = '\0';
+    lwsl_warn("[exec:%d] %s\n", (int)exec->pid, buf);
+    return;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+  fd_close(&exec->err_poll, &exec->fd_err);
+}
+
+static void exit_cb(void *data, int status) {
+  struct http_exec *exec = (struct http_exec *)data;
+  exec->child = NULL;
+  exec->exited = true;
+  exec->status = status;
+  exec->pid = -1;
+  if (exec_done(exec)) lws_callback_on_writable(exec->wsi);
+}
+
+static bool send_headers(struct http_exec *exec) {
+  unsigned char buffer[1024 + LWS_PRE], *p, *end;
+  p = buffer + LWS_PRE;
+  end = p + sizeof(buffer) - LWS_PRE;
+  struct lws *wsi = exec->wsi;
+
+  // HTTP/2 frames the body itself, HTTP/1.1 gets chunks since the length is unknown
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (unsigned char *)"application/octet-stream", 24,
+                                   &p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (unsigned char *)"no-store", 8, &p, end) ||
+      (!exec->h2 && lws_add_http_header_by_name(wsi, (unsigned char *)"transfer-encoding:", (unsigned char *)"chunked",
+                                                7, &p, end)) ||
+      (!exec->h2 && lws_add_http_header_by_name(wsi, (unsigned char *)"trailer:",
+                                                (unsigned char *)"x-ttyd-exit-status", 18, &p, end)) ||
+      lws_finalize_http_header(wsi, &p, end) ||
+      lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+    return false;
+  return true;
+}
+
+struct http_exec *http_exec_start(struct lws *wsi) {
+  if (lws_hdr_total_length(wsi, WSI_TOKEN_POST_URI) <= 0) {
+    lws_return_http_status(wsi, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL);
+    return NULL;
+  }
+
+  // same command and url args as the pipe protocol
+  int argc = 0;
+  char **args = server->url_arg ? ttyd_collect_url_args(wsi, &argc) : NULL;
+  const char *const *base = ttyd_runcmd();
+  int basec = 0;
+  while (base[basec] != NULL) basec++;
+  const char **argv = xmalloc((basec + argc + 1) * sizeof(char *));
+  memcpy(argv, base, basec * sizeof(char *));
+  for (int i = 0; i < argc; i++) argv[basec + i] = args[i];
+  argv[basec + argc] = NULL;
+
+  struct http_exec *exec = xmalloc(sizeof(struct http_exec));
+  memset(exec, 0, sizeof(struct http_exec));
+  exec->wsi = wsi;
+  exec->h2 = lws_get_network_wsi(wsi) != wsi;
+  exec->fd_in = exec->fd_out = exec->fd_err = -1;
+  int rc = spawn_pipes((const char *const *)argv, &exec->pid, &exec->fd_in, &exec->fd_out, &exec->fd_err);
+  free(argv);
+  if (args != NULL) ttyd_free_argv(args);
+  if (rc < 0) {
+    lwsl_err("exec spawn: %d (%s)\n", errno, strerror(errno));
+    free(exec);
+    lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+    return NULL;
+  }
+  lwsl_notice("started exec process, pid: %d\n", exec->pid);
+
+  exec->in_poll = poll_open(exec, exec->fd_in, 0, in_cb);
+  exec->out_poll = poll_open(exec, exec->fd_out, UV_READABLE, out_cb);
+  exec->err_poll = poll_open(exec, exec->fd_err, UV_READABLE, err_cb);
+  if (exec->in_poll == NULL || exec->out_poll == NULL || exec->err_poll == NULL || !send_headers(exec)) {
+    http_exec_free(exec);
+    return NULL;
+  }
+  // read-only servers run the command without input
+  if (!server->writable) in_close(exec);
+  exec->child = pipe_child_watch(exec->pid, exit_cb, exec);
+  return exec;
+}
+
+static int write_final(struct http_exec *exec) {
+  unsigned char buf[LWS_PRE + 64];
+  unsigned char *p = buf + LWS_PRE;
+  int code = WIFSIGNALED(exec->status) ? 128 + WTERMSIG(exec->status) : WEXITSTATUS(exec->status);
+  int n = 0;
+  if (!exec->h2) n = snprintf((char *)p, 64, "0\r\nx-ttyd-exit-status: %d\r\n\r\n", code);
+  return lws_write(exec->wsi, p, (size_t)n, LWS_WRITE_HTTP_FINAL) < 0 ? -1 : 1;
+}
+
+int http_exec_writable(struct http_exec *exec) {
+  if (exec->frame_len > 0) {
+    unsigned char *data = exec->frame + LWS_PRE + EXEC_CHUNK_HDR;
+    size_t len = exec->frame_len;
+    if (!exec->h2) {
+      char hdr[EXEC_CHUNK_HDR];
+      int n = snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+      data -= n;
+      memcpy(data, hdr, (size_t)n);
+      memcpy(data + n + len, "\r\n", 2);
+      len += (size_t)n + 2;
+    }
+    if (lws_write(exec->wsi, data, len, LWS_WRITE_HTTP) < (int)len) return -1;
+    exec->frame_len = 0;
+    if (exec->out_poll != NULL) uv_poll_start(exec->out_poll, UV_READABLE, out_cb);
+    if (exec_done(exec)) lws_callback_on_writable(exec->wsi);
+    return 0;
+  }
+  if (exec_done(exec)) return write_final(exec);
+  return 0;
+}
+
+void http_exec_free(struct http_exec *exec) {
+  if (exec == NULL) return;
+  fd_close(&exec->in_poll, &exec->fd_in);
+  fd_close(&exec->out_poll, &exec->fd_out);
+  fd_close(&exec->err_poll, &exec->fd_err);
+  if (exec->pid > 0) {
+    lwsl_notice("killing exec process, pid: %d\n", exec->pid);
+    kill(exec->pid, SIGHUP);
+    kill(exec->pid, SIGTERM);
+  }
+  pipe_child_forget(exec->child);
+  free(exec->body);
+  free(exec->frame);
+  free(exec);
+}
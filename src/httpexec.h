@@ -0,0 +1,19 @@
+#ifndef TTYD_HTTPEXEC_H
+#define TTYD_HTTPEXEC_H
+
+#include <libwebsockets.h>
+#include <stdbool.h>
+
+struct http_exec;
+
+// POST <base-path>/exec: the request body is the command's stdin, its stdout is streamed back
+// chunked on HTTP/1.1 or as DATA frames on HTTP/2; returns NULL after answering with an error
+struct http_exec *http_exec_start(struct lws *wsi);
+void http_exec_body(struct http_exec *exec, const void *in, size_t len);
+void http_exec_body_done(struct http_exec *exec);
+// returns -1 on error, 1 when the response is complete, 0 if more is to come
+int http_exec_writable(struct http_exec *exec);
+// the connection is gone or the response is done, kills the command if it still runs
+void http_exec_free(struct http_exec *exec);
+
+#endif  // TTYD_HTTPEXEC_H
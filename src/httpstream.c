@@ -0,0 +1,125 @@
+#include "httpstream.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "session.h"
+#include "utils.h"
+
+struct http_stream {
+  struct lws *wsi;
+  bool h2;
+  bool sse;
+  struct session_viewer *viewer;
+};
+
+static void stream_wake(void *data) { lws_callback_on_writable(((struct http_stream *)data)->wsi); }
+
+static bool send_headers(struct http_stream *stream) {
+  unsigned char buffer[1024 + LWS_PRE], *p, *end;
+  p = buffer + LWS_PRE;
+  end = p + sizeof(buffer) - LWS_PRE;
+  struct lws *wsi = stream->wsi;
+  const char *type = stream->sse ? "text/event-stream" : "application/octet-stream";
+
+  if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (unsigned char *)type, (int)strlen(type), &p,
+                                   end) ||
+      lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (unsigned char *)"no-store", 8, &p, end) ||
+      (!stream->h2 && lws_add_http_header_by_name(wsi, (unsigned char *)"transfer-encoding:",
+                                                  (unsigned char *)"chunked", 7, &p, end)) ||
+      lws_finalize_http_header(wsi, &p, end) ||
+      lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+    return false;
+  return true;
+}
+
+struct http_stream *http_stream_start(struct lws *wsi) {
+  struct http_stream *stream = xmalloc(sizeof(struct http_stream));
+  memset(stream, 0, sizeof(struct http_stream));
+  stream->wsi = wsi;
+  stream->h2 = lws_get_network_wsi(wsi) != wsi;
+
+  char accept[256];
+  if (lws_hdr_copy(wsi, accept, sizeof(accept), WSI_TOKEN_HTTP_ACCEPT) > 0 &&
+      strstr(accept, "text/event-stream") != NULL)
+    stream->sse = true;
+
+  stream->viewer = session_watch(stream_wake, stream);
+  if (stream->viewer == NULL) {
+    free(stream);
+    lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+    return NULL;
+  }
+  if (!send_headers(stream)) {
+    http_stream_free(stream);
+    return NULL;
+  }
+  lws_callback_on_writable(wsi);
+  return stream;
+}
+
+// output is terminal bytes, which event data lines can not carry as is
+static session_frame_t *sse_frame(session_frame_t *frame) {
+  if (frame->sse != NULL) return frame->sse;
+  const char *prefix = frame->reset ? "event: reset\ndata: " : "data: ";
+  size_t prefix_len = strlen(prefix);
+  size_t b64_len = 4 * ((frame->len + 2) / 3);
+  session_frame_t *sse = session_frame_new(NULL, prefix_len + b64_len + 1 + 2);
+  memcpy(sse->data, prefix, prefix_len);
+  int n = lws_b64_encode_string((const char *)frame->data, (int)frame->len, (char *)sse->data + prefix_len,
+                                (int)b64_len + 1);
+  if (n < 0) {
+    session_frame_unref(sse);
+    return NULL;
+  }
+  memcpy(sse->data + prefix_len + n, "\n\n", 2);
+  sse->len = prefix_len + (size_t)n + 2;
+  frame->sse = sse;
+  return sse;
+}
+
+static int write_final(struct http_stream *stream) {
+  unsigned char buf[LWS_PRE + 8];
+  unsigned char *p = buf + LWS_PRE;
+  int n = 0;
+  if (!stream->h2) n = snprintf((char *)p, 8, "0\r\n\r\n");
+  return lws_write(stream->wsi, p, (size_t)n, LWS_WRITE_HTTP_FINAL) < 0 ? -1 : 1;
+}
+
+int http_stream_writable(struct http_stream *stream) {
+  session_frame_t *frame;
+  while ((frame = session_next(stream->viewer)) != NULL) {
+    if (lws_send_pipe_choked(stream->wsi)) {
+      lws_callback_on_writable(stream->wsi);
+      return 0;
+    }
+    // every viewer writes the same frame, only the chunk size line in its headroom is rewritten,
+    // h2 puts its frame header there instead
+    if (stream->sse && (frame = sse_frame(frame)) == NULL) return -1;
+    unsigned char *data = frame->data;
+    size_t len = frame->len;
+    if (len > 0) {
+      if (!stream->h2) {
+        char hdr[SESSION_FRAME_HDR];
+        int n = snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+        data -= n;
+        memcpy(data, hdr, (size_t)n);
+        memcpy(data + n + len, "\r\n", 2);
+        len += (size_t)n + 2;
+      }
+      if (lws_write(stream->wsi, data, len, LWS_WRITE_HTTP) < (int)len) return -1;
+    }
+    session_sent(stream->viewer);
+  }
+  if (session_ended(stream->viewer)) return write_final(stream);
+  return 0;
+}
+
+void http_stream_free(struct http_stream *stream) {
+  if (stream == NULL) return;
+  session_unwatch(stream->viewer);
+  free(stream);
+}
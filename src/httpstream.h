@@ -0,0 +1,15 @@
+#ifndef TTYD_HTTPSTREAM_H
+#define TTYD_HTTPSTREAM_H
+
+#include <libwebsockets.h>
+
+struct http_stream;
+
+// GET <base-path>/stream: a read-only view of the shared session, as server-sent events with the
+// output base64 encoded if the client accepts them, raw bytes otherwise; returns NULL after answering with an error
+struct http_stream *http_stream_start(struct lws *wsi);
+// returns -1 on error, 1 when the session ended and the response is complete, 0 if more is to come
+int http_stream_writable(struct http_stream *stream);
+void http_stream_free(struct http_stream *stream);
+
+#endif  // TTYD_HTTPSTREAM_H
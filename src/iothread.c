@@ -0,0 +1,484 @@
+#include "iothread.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define IOTHREAD_MAX 64
+// per session and powers of two: output the thread reads ahead of the websocket, input not written yet
+#define RING_OUT_SIZE (256 * 1024)
+#define RING_IN_SIZE (64 * 1024)
+// output handed to read_cb at once, what a read on the loop would take
+#define DELIVER_MAX 65536
+
+// single producer, single consumer byte ring: head only moves on the producer's thread, tail only on
+// the consumer's, each side publishes what it did with a release store and reads the other with acquire
+typedef struct {
+  char *data;
+  size_t size;
+  size_t head;  // bytes written ever
+  size_t tail;  // bytes read ever
+} spsc_t;
+
+struct io_thread;
+
+struct iothread_io {
+  struct io_thread *thread;
+  int fd;        // a dup of the pty master, the thread closes it
+  spsc_t out;    // pty output: the thread produces, the server loop consumes
+  spsc_t in;     // input: the server loop produces, the thread consumes
+  int eof;       // set by the thread once the pty hung up, after its last output went into out
+  int closing;   // set by the server loop, the thread then lets go of the session and frees it
+
+  // server loop side
+  pty_process *process;
+  bool paused;
+  bool eof_sent;
+  pty_write_t *writes, *writes_last;  // input in had no room for
+  struct iothread_io *next;
+
+  // thread side
+  uv_poll_t poll;
+  bool started;  // poll is initialized
+  bool closed;
+  int events;
+  struct iothread_io *io_next;
+};
+
+struct io_thread {
+  uv_thread_t tid;
+  uv_loop_t loop;
+  uv_async_t wake;    // on the thread: new sessions, input, room in out, sessions to close, stop
+  uv_check_t check;   // on the thread: sends notify once per iteration
+  uv_async_t notify;  // on the server loop: output, room in in, eof
+  uv_mutex_t lock;    // guards adds
+  struct iothread_io *adds;
+  int stop;
+
+  // server loop side
+  struct iothread_io *ios;
+  int count;
+  unsigned gen;  // bumped when a session goes away
+
+  // thread side
+  struct iothread_io *sessions;
+  bool notify_pending;
+};
+
+static struct io_thread **threads = NULL;
+static int thread_count = 0;
+
+static bool ring_init(spsc_t *r, size_t size) {
+  r->data = malloc(size);
+  r->size = size;
+  r->head = r->tail = 0;
+  return r->data != NULL;
+}
+
+static size_t ring_used(spsc_t *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+// producer: contiguous free space at head
+static size_t ring_space(spsc_t *r, char **ptr) {
+  size_t head = r->head;
+  size_t free = r->size - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+  size_t off = head & (r->size - 1);
+  *ptr = r->data + off;
+  return free < r->size - off ? free : r->size - off;
+}
+
+static void ring_commit(spsc_t *r, size_t n) { __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE); }
+
+// consumer: contiguous bytes at tail
+static size_t ring_peek(spsc_t *r, char **ptr) {
+  size_t tail = r->tail;
+  size_t used = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+  size_t off = tail & (r->size - 1);
+  *ptr = r->data + off;
+  return used < r->size - off ? used : r->size - off;
+}
+
+static void ring_consume(spsc_t *r, size_t n) { __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE); }
+
+static size_t ring_put(spsc_t *r, const char *buf, size_t len) {
+  size_t done = 0;
+  char *p;
+  size_t n;
+  while (done < len && (n = ring_space(r, &p)) > 0) {
+    if (n > len - done) n = len - done;
+    memcpy(p, buf + done, n);
+    ring_commit(r, n);
+    done += n;
+  }
+  return done;
+}
+
+static size_t ring_get(spsc_t *r, char *buf, size_t len) {
+  size_t done = 0;
+  char *p;
+  size_t n;
+  while (done < len && (n = ring_peek(r, &p)) > 0) {
+    if (n > len - done) n = len - done;
+    memcpy(buf + done, p, n);
+    ring_consume(r, n);
+    done += n;
+  }
+  return done;
+}
+
+static void io_destroy(struct iothread_io *io) {
+  while (io->writes != NULL) {
+    pty_write_t *w = io->writes;
+    io->writes = w->next;
+    pty_buf_free(w->buf);
+    free(w);
+  }
+  close(io->fd);
+  free(io->out.data);
+  free(io->in.data);
+  free(io);
+}
+
+// on the thread
+
+static void io_poll_cb(uv_poll_t *handle, int status, int events);
+
+// read while out has room, write while in has input
+static void io_update(struct iothread_io *io) {
+  int events = 0;
+  char *p;
+  if (!io->started) return;
+  if (!__atomic_load_n(&io->eof, __ATOMIC_RELAXED) && ring_space(&io->out, &p) > 0) events |= UV_READABLE;
+  if (ring_used(&io->in) > 0) events |= UV_WRITABLE;
+  if (events == io->events) return;
+  io->events = events;
+  if (events == 0) {
+    uv_poll_stop(&io->poll);
+  } else {
+    uv_poll_start(&io->poll, events, io_poll_cb);
+  }
+}
+
+static void io_poll_cb(uv_poll_t *handle, int status, int events) {
+  struct iothread_io *io = (struct iothread_io *) handle->data;
+  struct io_thread *t = io->thread;
+  char *p;
+  size_t len;
+  ssize_t n;
+
+  if (status == 0 && (events & UV_WRITABLE)) {
+    while ((len = ring_peek(&io->in, &p)) > 0) {
+      n = write(io->fd, p, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && errno == EAGAIN) break;
+      // a failed write is dropped like libuv drops it, the pty is most likely gone
+      ring_consume(&io->in, n > 0 ? (size_t) n : len);
+      t->notify_pending = true;
+    }
+  }
+
+  if (status != 0) {
+    __atomic_store_n(&io->eof, 1, __ATOMIC_RELEASE);
+    t->notify_pending = true;
+  } else if (events & UV_READABLE) {
+    // straight into the ring, until the pty is empty or the ring full
+    while ((len = ring_space(&io->out, &p)) > 0) {
+      n = read(io->fd, p, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && errno == EAGAIN) break;
+      t->notify_pending = true;
+      if (n <= 0) {
+        __atomic_store_n(&io->eof, 1, __ATOMIC_RELEASE);
+        break;
+      }
+      ring_commit(&io->out, (size_t) n);
+    }
+  }
+  io_update(io);
+}
+
+static void io_close_cb(uv_handle_t *handle) {
+  struct iothread_io *io = (struct iothread_io *) handle->data;
+  struct iothread_io **link = &io->thread->sessions;
+  while (*link != io) link = &(*link)->io_next;
+  *link = io->io_next;
+  io_destroy(io);
+}
+
+static void wake_cb(uv_async_t *handle) {
+  struct io_thread *t = (struct io_thread *) handle->data;
+
+  uv_mutex_lock(&t->lock);
+  struct iothread_io *adds = t->adds;
+  t->adds = NULL;
+  uv_mutex_unlock(&t->lock);
+  while (adds != NULL) {
+    struct iothread_io *io = adds;
+    adds = io->io_next;
+    io->io_next = t->sessions;
+    t->sessions = io;
+    io->poll.data = io;
+    io->started = uv_poll_init(&t->loop, &io->poll, io->fd) == 0;
+    if (!io->started) {
+      __atomic_store_n(&io->eof, 1, __ATOMIC_RELEASE);
+      t->notify_pending = true;
+    }
+  }
+
+  bool stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+  struct iothread_io *io = t->sessions;
+  while (io != NULL) {
+    struct iothread_io *next = io->io_next;
+    if (io->closed) {
+      // closing already
+    } else if (__atomic_load_n(&io->closing, __ATOMIC_ACQUIRE)) {
+      io->closed = true;
+      if (io->started) {
+        uv_close((uv_handle_t *) &io->poll, io_close_cb);
+      } else {
+        io_close_cb((uv_handle_t *) &io->poll);
+      }
+    } else if (stop) {
+      // still open on the server loop, iothread_close() frees it after the join
+      io->closed = true;
+      if (io->started) uv_close((uv_handle_t *) &io->poll, NULL);
+    } else {
+      io_update(io);
+    }
+    io = next;
+  }
+
+  if (stop) {
+    uv_close((uv_handle_t *) &t->wake, NULL);
+    uv_close((uv_handle_t *) &t->check, NULL);
+  }
+}
+
+// whatever the sessions of this iteration have for the server loop, one wakeup for all of them
+static void check_cb(uv_check_t *handle) {
+  struct io_thread *t = (struct io_thread *) handle->data;
+  if (!t->notify_pending) return;
+  t->notify_pending = false;
+  uv_async_send(&t->notify);
+}
+
+static void thread_main(void *arg) {
+  struct io_thread *t = (struct io_thread *) arg;
+  uv_run(&t->loop, UV_RUN_DEFAULT);
+}
+
+// on the server loop
+
+// move queued input into in, true if it took any
+static bool flush_writes(struct iothread_io *io) {
+  bool moved = false;
+  while (io->writes != NULL) {
+    pty_write_t *w = io->writes;
+    size_t n = ring_put(&io->in, w->buf->base + w->off, w->buf->len - w->off);
+    if (n == 0) break;
+    moved = true;
+    w->off += n;
+    if (w->off < w->buf->len) break;
+    io->writes = w->next;
+    pty_buf_free(w->buf);
+    free(w);
+  }
+  return moved;
+}
+
+// one chunk per pty_resume(), like a read on the loop; true if it made room in out. The callback may
+// free the process
+static bool deliver(struct iothread_io *io) {
+  if (io->paused || io->eof_sent) return false;
+  // eof first: once it is seen, all the output before it is in out
+  bool eof = __atomic_load_n(&io->eof, __ATOMIC_ACQUIRE);
+  size_t n = ring_used(&io->out);
+  if (n == 0 && !eof) return false;
+
+  pty_process *process = io->process;
+  io->paused = true;
+  if (n == 0) {
+    io->eof_sent = true;
+    process->read_cb(process, NULL, true);
+    return false;
+  }
+  if (n > DELIVER_MAX) n = DELIVER_MAX;
+  pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
+  buf->base = xmalloc(n);
+  buf->len = ring_get(&io->out, buf->base, n);
+  process->read_cb(process, buf, false);
+  return true;
+}
+
+static void notify_cb(uv_async_t *handle) {
+  struct io_thread *t = (struct io_thread *) handle->data;
+  bool wake = false;
+  struct iothread_io *io = t->ios;
+  while (io != NULL) {
+    struct iothread_io *next = io->next;
+    unsigned gen = t->gen;
+    if (flush_writes(io)) wake = true;
+    if (deliver(io)) wake = true;
+    // a callback freed a session, maybe the next one: start over, the delivered ones are paused now
+    io = gen == t->gen ? next : t->ios;
+  }
+  if (wake) uv_async_send(&t->wake);
+}
+
+static void thread_free_cb(uv_handle_t *handle) { free(handle->data); }
+
+static void thread_stop(struct io_thread *t) {
+  __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+  uv_async_send(&t->wake);
+  uv_thread_join(&t->tid);
+  uv_loop_close(&t->loop);
+  uv_mutex_destroy(&t->lock);
+  while (t->ios != NULL) {
+    struct iothread_io *io = t->ios;
+    t->ios = io->next;
+    io->process->iothread = NULL;
+    io_destroy(io);
+  }
+  uv_close((uv_handle_t *) &t->notify, thread_free_cb);
+}
+
+bool iothread_init(uv_loop_t *loop, int count) {
+  if (count < 1 || count > IOTHREAD_MAX) return false;
+  threads = xmalloc(sizeof(struct io_thread *) * (size_t) count);
+  for (thread_count = 0; thread_count < count; thread_count++) {
+    struct io_thread *t = xmalloc(sizeof(struct io_thread));
+    memset(t, 0, sizeof(struct io_thread));
+    uv_loop_init(&t->loop);
+    uv_mutex_init(&t->lock);
+    uv_async_init(&t->loop, &t->wake, wake_cb);
+    t->wake.data = t;
+    uv_check_init(&t->loop, &t->check);
+    t->check.data = t;
+    uv_check_start(&t->check, check_cb);
+    uv_async_init(loop, &t->notify, notify_cb);
+    t->notify.data = t;
+    if (uv_thread_create(&t->tid, thread_main, t) != 0) {
+      uv_close((uv_handle_t *) &t->wake, NULL);
+      uv_close((uv_handle_t *) &t->check, NULL);
+      uv_run(&t->loop, UV_RUN_DEFAULT);
+      uv_loop_close(&t->loop);
+      uv_mutex_destroy(&t->lock);
+      uv_close((uv_handle_t *) &t->notify, thread_free_cb);
+      iothread_close();
+      return false;
+    }
+    threads[thread_count] = t;
+  }
+  return true;
+}
+
+bool iothread_enabled() { return threads != NULL; }
+
+int iothread_count() { return thread_count; }
+
+void iothread_close() {
+  if (threads == NULL) return;
+  for (int i = 0; i < thread_count; i++) thread_stop(threads[i]);
+  free(threads);
+  threads = NULL;
+  thread_count = 0;
+}
+
+int iothread_open(pty_process *process, int fd) {
+  // the thread closes its fd when it is done with it, which may be after process_free() closed the master
+  int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (dup_fd < 0) return -errno;
+
+  struct io_thread *t = threads[0];
+  for (int i = 1; i < thread_count; i++) {
+    if (threads[i]->count < t->count) t = threads[i];
+  }
+
+  struct iothread_io *io = xmalloc(sizeof(struct iothread_io));
+  memset(io, 0, sizeof(struct iothread_io));
+  io->fd = dup_fd;
+  if (!ring_init(&io->out, RING_OUT_SIZE) || !ring_init(&io->in, RING_IN_SIZE)) {
+    io_destroy(io);
+    return UV_ENOMEM;
+  }
+  io->thread = t;
+  io->process = process;
+  io->paused = true;
+  io->next = t->ios;
+  t->ios = io;
+  t->count++;
+  process->iothread = io;
+
+  uv_mutex_lock(&t->lock);
+  io->io_next = t->adds;
+  t->adds = io;
+  uv_mutex_unlock(&t->lock);
+  uv_async_send(&t->wake);
+  return 0;
+}
+
+void iothread_pause(pty_process *process) { process->iothread->paused = true; }
+
+void iothread_resume(pty_process *process) {
+  struct iothread_io *io = process->iothread;
+  if (!io->paused) return;
+  io->paused = false;
+  // whatever out holds goes to read_cb from the loop, not from in here
+  uv_async_send(&io->thread->notify);
+}
+
+int iothread_write(pty_process *process, pty_buf_t *buf) {
+  struct iothread_io *io = process->iothread;
+  pty_write_t *w = xmalloc(sizeof(pty_write_t));
+  w->buf = buf;
+  w->off = 0;
+  w->next = NULL;
+  if (io->writes == NULL) {
+    io->writes = w;
+  } else {
+    io->writes_last->next = w;
+  }
+  io->writes_last = w;
+  if (flush_writes(io)) uv_async_send(&io->thread->wake);
+  return 0;
+}
+
+void iothread_free(pty_process *process) {
+  struct iothread_io *io = process->iothread;
+  struct io_thread *t = io->thread;
+  struct iothread_io **link = &t->ios;
+  while (*link != io) link = &(*link)->next;
+  *link = io->next;
+  t->count--;
+  t->gen++;
+  process->iothread = NULL;
+
+  // from here on only the thread touches it
+  while (io->writes != NULL) {
+    pty_write_t *w = io->writes;
+    io->writes = w->next;
+    pty_buf_free(w->buf);
+    free(w);
+  }
+  io->process = NULL;
+  __atomic_store_n(&io->closing, 1, __ATOMIC_RELEASE);
+  uv_async_send(&t->wake);
+}
+#else
+bool iothread_init(uv_loop_t *loop, int count) { return false; }
+bool iothread_enabled() { return false; }
+int iothread_count() { return 0; }
+void iothread_close() {}
+int iothread_open(pty_process *process, int fd) { return UV_ENOSYS; }
+void iothread_pause(pty_process *process) {}
+void iothread_resume(pty_process *process) {}
+int iothread_write(pty_process *process, pty_buf_t *buf) { return UV_ENOSYS; }
+void iothread_free(pty_process *process) {}
+#endif
@@ -0,0 +1,28 @@
+#ifndef TTYD_IOTHREAD_H
+#define TTYD_IOTHREAD_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+#include "pty.h"
+
+// --pty-threads: the ptys are read and written on dedicated threads with a loop each, every session
+// has a lock-free single producer, single consumer ring per direction between its thread and the
+// server loop; either side wakes the other once per loop iteration, however many sessions are ready
+
+// start count threads, false if one of them could not be started
+bool iothread_init(uv_loop_t *loop, int count);
+bool iothread_enabled();
+int iothread_count();
+// stop the threads, sessions still open are dropped with them
+void iothread_close();
+
+// hand the pty master fd of process to the least busy thread, it keeps a dup of it; 0 on success
+int iothread_open(pty_process *process, int fd);
+void iothread_pause(pty_process *process);
+void iothread_resume(pty_process *process);
+int iothread_write(pty_process *process, pty_buf_t *buf);
+// output still in the ring is dropped, the thread lets go of the pty on its next iteration
+void iothread_free(pty_process *process);
+
+#endif  // TTYD_IOTHREAD_H
@@ -0,0 +1,121 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgroup.h"
+#include "sched.h"
+#include "server.h"
+#include "utils.h"
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} metrics_buf_t;
+
+static void put(metrics_buf_t *buf, const char *fmt, ...) {
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < buf->cap - buf->len) {
+      buf->len += (size_t)n;
+      return;
+    }
+    buf->cap = (buf->cap + (size_t)n) * 2;
+    buf->data = xrealloc(buf->data, buf->cap);
+  }
+}
+
+// label values come from auth headers, quote them the way the exposition format wants
+static const char *label(const char *value, char *out, size_t size) {
+  size_t n = 0;
+  for (; *value != '\0' && n + 3 < size; value++) {
+    if (*value == '\\' || *value == '"' || *value == '\n') {
+      out[n++] = '\\';
+      out[n++] = *value == '\n' ? 'n' : *value;
+    } else {
+      out[n++] = *value;
+    }
+  }
+  out[n] = '\0';
+  return out;
+}
+
+static void describe(metrics_buf_t *buf, const char *name, const char *type, const char *help) {
+  put(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+char *metrics_render(size_t *len) {
+  metrics_buf_t buf = {xmalloc(4096), 0, 4096};
+  char user[64];
+
+  describe(&buf, "ttyd_clients", "gauge", "Connected websocket clients.");
+  put(&buf, "ttyd_clients %d\n", server->client_count);
+
+  describe(&buf, "ttyd_session_queue_bytes", "gauge", "Output read from the session's pty and not sent yet.");
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next)
+    put(&buf, "ttyd_session_queue_bytes{pid=\"%d\",user=\"%s\"} %zu\n", e->pid, label(e->user, user, sizeof(user)),
+        e->pending);
+
+  describe(&buf, "ttyd_session_sent_bytes_total", "counter", "Output sent to the session's client.");
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next)
+    put(&buf, "ttyd_session_sent_bytes_total{pid=\"%d\",user=\"%s\"} %llu\n", e->pid,
+        label(e->user, user, sizeof(user)), (unsigned long long)e->sent);
+
+  describe(&buf, "ttyd_session_weight", "gauge", "Output quantums the session gets per scheduling round.");
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next)
+    put(&buf, "ttyd_session_weight{pid=\"%d\",user=\"%s\"} %d\n", e->pid, label(e->user, user, sizeof(user)),
+        e->weight);
+
+  describe(&buf, "ttyd_session_throttled_total", "counter", "Times reading the session's pty paused for its rate limit.");
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next) {
+    struct pss_tty *pss = container_of(e, struct pss_tty, sched);
+    put(&buf, "ttyd_session_throttled_total{pid=\"%d\",user=\"%s\"} %llu\n", e->pid,
+        label(e->user, user, sizeof(user)), (unsigned long long)pss->rate.throttled);
+  }
+
+  describe(&buf, "ttyd_session_throttled_seconds_total", "counter",
+           "Time reading the session's pty was paused for its rate limit.");
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next) {
+    struct pss_tty *pss = container_of(e, struct pss_tty, sched);
+    put(&buf, "ttyd_session_throttled_seconds_total{pid=\"%d\",user=\"%s\"} %.3f\n", e->pid,
+        label(e->user, user, sizeof(user)), (double)pss->rate.throttled_ms / 1000);
+  }
+
+  describe(&buf, "ttyd_session_rate_tokens", "gauge", "Output bytes the session may send before it is throttled.");
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next) {
+    struct pss_tty *pss = container_of(e, struct pss_tty, sched);
+    if (pss->rate.session == NULL) continue;
+    put(&buf, "ttyd_session_rate_tokens{pid=\"%d\",user=\"%s\"} %.0f\n", e->pid,
+        label(e->user, user, sizeof(user)), ratelimit_tokens(pss->rate.session));
+  }
+
+  describe(&buf, "ttyd_user_rate_tokens", "gauge", "Output bytes the user's sessions may send before they are throttled.");
+  for (rate_bucket_t *b = ratelimit_users(); b != NULL; b = b->next)
+    put(&buf, "ttyd_user_rate_tokens{user=\"%s\"} %.0f\n", label(b->user, user, sizeof(user)), ratelimit_tokens(b));
+
+  describe(&buf, "ttyd_session_cpu_seconds_total", "counter", "CPU time of the session's cgroup (with --cgroup).");
+  uint64_t cpu_usec, memory;
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next) {
+    if (e->pid <= 0 || !cgroup_usage(e->pid, &cpu_usec, &memory)) continue;
+    put(&buf, "ttyd_session_cpu_seconds_total{pid=\"%d\",user=\"%s\"} %.6f\n", e->pid,
+        label(e->user, user, sizeof(user)), (double)cpu_usec / 1000000);
+  }
+
+  describe(&buf, "ttyd_session_memory_bytes", "gauge", "Memory charged to the session's cgroup (with --cgroup).");
+  for (sched_entry_t *e = sched_entries(); e != NULL; e = e->next) {
+    if (e->pid <= 0 || !cgroup_usage(e->pid, &cpu_usec, &memory)) continue;
+    put(&buf, "ttyd_session_memory_bytes{pid=\"%d\",user=\"%s\"} %llu\n", e->pid,
+        label(e->user, user, sizeof(user)), (unsigned long long)memory);
+  }
+
+  *len = buf.len;
+  return buf.data;
+}
@@ -0,0 +1,9 @@
+#ifndef TTYD_METRICS_H
+#define TTYD_METRICS_H
+
+#include <stddef.h>
+
+// the prometheus text exposition of server and per-session counters, in a new heap buffer
+char *metrics_render(size_t *len);
+
+#endif  // TTYD_METRICS_H
@@ -0,0 +1,217 @@
+#include "migrate.h"
+
+#include <errno.h>
+#include <libwebsockets.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pty.h"
+#include "server.h"
+#include "upgrade.h"
+#include "utils.h"
+
+// both ends of an admin connection are local and answer right away, the loop waits at most this long
+#define MIGRATE_TIMEOUT_S 5
+#define MIGRATE_LINE_MAX 512
+
+extern pty_ctx_t *process_sessions();
+extern bool process_movable(pty_ctx_t *ctx);
+extern void process_handoff(int pid, int port);
+
+static struct {
+  int fd;
+  uv_poll_t *poll;
+  char *path;
+  int port;  // the clients of adopted sessions reconnect here
+} admin = {.fd = -1};
+
+static void set_timeouts(int fd) {
+  struct timeval tv = {MIGRATE_TIMEOUT_S, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// a byte at a time: the records of an adopt follow its line on the same socket
+static bool read_line(int fd, char *line, size_t len) {
+  size_t n = 0;
+  while (n + 1 < len) {
+    ssize_t r = recv(fd, line + n, 1, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    if (line[n] == '\n') break;
+    n++;
+  }
+  if (n > 0 && line[n - 1] == '\r') n--;
+  line[n] = '\0';
+  return true;
+}
+
+static void reply(int fd, const char *fmt, ...) {
+  char buf[MIGRATE_LINE_MAX];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  if ((size_t)n >= sizeof(buf)) n = sizeof(buf) - 1;
+  send(fd, buf, (size_t)n, MSG_NOSIGNAL);
+}
+
+static int connect_to(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  set_timeouts(fd);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void list_sessions(int fd) {
+  for (pty_ctx_t *ctx = process_sessions(); ctx != NULL; ctx = ctx->next) {
+    if (ctx->process == NULL || ctx->ws_closed) continue;
+    const char *state = ctx->parked ? "parked" : ctx->pss != NULL ? "attached" : "starting";
+    reply(fd, "%d %s %ux%u %s%s\n", ctx->process->pid, ctx->user[0] != '\0' ? ctx->user : "-",
+          ctx->process->columns, ctx->process->rows, state, process_movable(ctx) ? "" : " (pinned)");
+  }
+  reply(fd, "ok\n");
+}
+
+// send the sessions of pid (0: all of them) to the ttyd with the admin socket at path, it answers with the
+// port their clients reconnect to
+static void migrate(int fd, int pid, const char *path) {
+  int movable = 0;
+  for (pty_ctx_t *ctx = process_sessions(); ctx != NULL; ctx = ctx->next) {
+    if (process_movable(ctx) && (pid == 0 || ctx->process->pid == pid)) movable++;
+  }
+  if (movable == 0) {
+    reply(fd, "error: no session to move\n");
+    return;
+  }
+
+  int sock = connect_to(path);
+  if (sock < 0) {
+    reply(fd, "error: connect %s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  char line[MIGRATE_LINE_MAX];
+  int count = 0, port = 0;
+  const char *adopt = "adopt\n";
+  bool ok = send(sock, adopt, strlen(adopt), MSG_NOSIGNAL) == (ssize_t)strlen(adopt) &&
+            upgrade_send(sock, -1, pid, &count) && read_line(sock, line, sizeof(line));
+  close(sock);
+  if (!ok) {
+    reply(fd, "error: %s did not take the sessions\n", path);
+    return;
+  }
+  if (sscanf(line, "ok %d", &port) != 1) {
+    reply(fd, "%s\n", line);
+    return;
+  }
+
+  // from here on the other ttyd owns them, this one only reaps its children
+  process_handoff(pid, port);
+  lwsl_notice("migrated %d session(s) to %s, port: %d\n", count, path, port);
+  reply(fd, "ok %d\n", count);
+}
+
+static void adopt(int fd) {
+  // the clients come back with their resume id, that needs somewhere to park the sessions until then
+  if (server->resume_timeout == 0) {
+    reply(fd, "error: sessions can not be resumed here, see --resume-timeout\n");
+    return;
+  }
+  int listen_fd, count;
+  if (!upgrade_recv(fd, &listen_fd, &count)) {
+    reply(fd, "error: broken handover\n");
+    return;
+  }
+  if (listen_fd >= 0) close(listen_fd);
+  lwsl_notice("adopted %d migrated session(s)\n", count);
+  reply(fd, "ok %d\n", admin.port);
+}
+
+static void command(int fd, char *line) {
+  char target[16], path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+  if (strcmp(line, "sessions") == 0) {
+    list_sessions(fd);
+  } else if (strcmp(line, "adopt") == 0) {
+    adopt(fd);
+  } else if (sscanf(line, "migrate %15s %107s", target, path) == 2) {
+    int pid = strcmp(target, "all") == 0 ? 0 : atoi(target);
+    if (pid < 0 || (pid == 0 && strcmp(target, "all") != 0)) {
+      reply(fd, "error: bad pid: %s\n", target);
+      return;
+    }
+    migrate(fd, pid, path);
+  } else {
+    reply(fd, "error: unknown command\n");
+  }
+}
+
+static void poll_cb(uv_poll_t *handle, int status, int events) {
+  if (status != 0) return;
+  int fd = accept4(admin.fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) return;
+  set_timeouts(fd);
+  char line[MIGRATE_LINE_MAX];
+  if (read_line(fd, line, sizeof(line))) command(fd, line);
+  close(fd);
+}
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+bool migrate_init(uv_loop_t *loop, const char *path, int port) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    lwsl_err("admin socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) return false;
+  unlink(path);
+  // whoever can connect can take sessions away, only the user ttyd runs as
+  mode_t mask = umask(077);
+  int err = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (err != 0 || listen(fd, 8) != 0) {
+    lwsl_err("admin socket %s: %d (%s)\n", path, errno, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  admin.fd = fd;
+  admin.path = strdup(path);
+  admin.port = port;
+  admin.poll = xmalloc(sizeof(uv_poll_t));
+  uv_poll_init(loop, admin.poll, fd);
+  uv_poll_start(admin.poll, UV_READABLE, poll_cb);
+  return true;
+}
+
+void migrate_close() {
+  if (admin.fd < 0) return;
+  uv_poll_stop(admin.poll);
+  uv_close((uv_handle_t *)admin.poll, close_cb);
+  close(admin.fd);
+  unlink(admin.path);
+  free(admin.path);
+  admin.fd = -1;
+}
@@ -0,0 +1,14 @@
+#ifndef TTYD_MIGRATE_H
+#define TTYD_MIGRATE_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+// the admin socket (--admin-socket) of a ttyd listening on port, it takes one line commands:
+//   sessions                    list the sessions: pid, user, size, attached or parked
+//   migrate <pid|all> <socket>  move sessions to the ttyd with that admin socket, their clients follow
+//   adopt                       sent by a migrating ttyd, the sessions follow as upgrade_send() records
+bool migrate_init(uv_loop_t *loop, const char *path, int port);
+void migrate_close();
+
+#endif  // TTYD_MIGRATE_H
@@ -0,0 +1,323 @@
+#include "pipepool.h"
+
+#include <libwebsockets.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgroup.h"
+#include "server.h"
+#include "utils.h"
+#include "wspipe.h"
+
+// a worker that dies sooner than this after starting is replaced only after the same delay
+#define RESPAWN_DELAY_MS 1000
+// upper bound of a single answer, a worker exceeding it is killed
+#define RESPONSE_MAX (64 * 1024 * 1024)
+
+typedef struct pool_job_ {
+  struct pool_job_ *next;
+  struct pss_raw *pss;  // NULL once the connection is gone
+  size_t len;
+  unsigned char data[];  // length prefix + request
+} pool_job_t;
+
+typedef struct {
+  uv_process_t process;
+  uv_pipe_t in;
+  uv_pipe_t out;
+  int open_handles;
+  bool exited;
+  uint64_t started;
+
+  pool_job_t *job;  // request in flight, owned by its write request until write_cb
+  int served;
+  unsigned char *rbuf;  // answer read so far
+  size_t rlen;
+  size_t rcap;
+} pool_worker_t;
+
+static struct {
+  uv_loop_t *loop;
+  const char *const *argv;
+  int size;
+  int max_requests;
+  pool_worker_t **workers;
+  pool_job_t *head;
+  pool_job_t *tail;
+  uv_timer_t *respawn;
+  bool closing;
+} pool;
+
+static void dispatch();
+static bool worker_spawn(int slot);
+
+bool pipepool_active() { return pool.size > 0; }
+
+static void timer_close_cb(uv_handle_t *handle) { free(handle); }
+
+static void handle_close_cb(uv_handle_t *handle) {
+  pool_worker_t *w = (pool_worker_t *)handle->data;
+  if (--w->open_handles > 0) return;
+  free(w->rbuf);
+  free(w);
+}
+
+static void worker_close(pool_worker_t *w) {
+  if (!uv_is_closing((uv_handle_t *)&w->in)) uv_close((uv_handle_t *)&w->in, handle_close_cb);
+  if (!uv_is_closing((uv_handle_t *)&w->out)) uv_close((uv_handle_t *)&w->out, handle_close_cb);
+  if (!uv_is_closing((uv_handle_t *)&w->process)) uv_close((uv_handle_t *)&w->process, handle_close_cb);
+}
+
+static int worker_slot(pool_worker_t *w) {
+  for (int i = 0; i < pool.size; i++)
+    if (pool.workers[i] == w) return i;
+  return -1;
+}
+
+// closing stdin is the signal to exit, the slot is refilled from exit_cb
+static void worker_retire(pool_worker_t *w) {
+  if (!uv_is_closing((uv_handle_t *)&w->in)) uv_close((uv_handle_t *)&w->in, handle_close_cb);
+}
+
+static bool worker_idle(pool_worker_t *w) {
+  return w != NULL && !w->exited && w->job == NULL && !uv_is_closing((uv_handle_t *)&w->in);
+}
+
+static void respawn_cb(uv_timer_t *timer) {
+  for (int i = 0; i < pool.size; i++)
+    if (pool.workers[i] == NULL) worker_spawn(i);
+  dispatch();
+}
+
+static void exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+  pool_worker_t *w = (pool_worker_t *)process->data;
+  w->exited = true;
+  cgroup_release(process->pid);
+  if (w->job != NULL) {
+    lwsl_warn("pipe worker %d died during a request, status: %d, signal: %d\n", process->pid, (int)exit_status,
+              term_signal);
+    if (w->job->pss != NULL) pipe_pool_failed(w->job->pss);
+    w->job->pss = NULL;
+    w->job = NULL;
+  }
+
+  int slot = worker_slot(w);
+  worker_close(w);
+  if (slot < 0 || pool.closing) return;
+  pool.workers[slot] = NULL;
+
+  // a command that fails right away must not turn into a fork loop
+  if (w->served == 0 && uv_now(pool.loop) - w->started < RESPAWN_DELAY_MS) {
+    if (!uv_is_active((uv_handle_t *)pool.respawn)) uv_timer_start(pool.respawn, respawn_cb, RESPAWN_DELAY_MS, 0);
+    return;
+  }
+  worker_spawn(slot);
+  dispatch();
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  pool_worker_t *w = (pool_worker_t *)handle->data;
+  if (w->rcap - w->rlen < suggested_size) {
+    w->rcap = w->rlen + suggested_size;
+    w->rbuf = xrealloc(w->rbuf, w->rcap);
+  }
+  buf->base = (char *)w->rbuf + w->rlen;
+  buf->len = w->rcap - w->rlen;
+}
+
+static size_t frame_len(const unsigned char *p) {
+  return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
+  pool_worker_t *w = (pool_worker_t *)stream->data;
+  if (n < 0) {
+    // stdout closed, exit_cb follows once the process is gone
+    uv_read_stop(stream);
+    return;
+  }
+  w->rlen += (size_t)n;
+
+  while (w->rlen >= 4) {
+    size_t len = frame_len(w->rbuf);
+    if (len > RESPONSE_MAX) {
+      lwsl_err("pipe worker %d sent an answer of %zu bytes, killing it\n", w->process.pid, len);
+      uv_process_kill(&w->process, SIGKILL);
+      uv_read_stop(stream);
+      return;
+    }
+    if (w->rlen < 4 + len) break;
+
+    pool_job_t *job = w->job;
+    w->job = NULL;
+    if (job == NULL) {
+      lwsl_warn("pipe worker %d answered without a request\n", w->process.pid);
+    } else {
+      // the worker may answer before it read all of the request, write_cb frees it
+      if (job->pss != NULL) pipe_pool_response(job->pss, w->rbuf + 4, len);
+      job->pss = NULL;
+      w->served++;
+    }
+    w->rlen -= 4 + len;
+    memmove(w->rbuf, w->rbuf + 4 + len, w->rlen);
+  }
+
+  if (w->job == NULL && pool.max_requests > 0 && w->served >= pool.max_requests) worker_retire(w);
+  dispatch();
+}
+
+static bool worker_spawn(int slot) {
+  pool_worker_t *w = xmalloc(sizeof(pool_worker_t));
+  memset(w, 0, sizeof(pool_worker_t));
+  uv_pipe_init(pool.loop, &w->in, 0);
+  uv_pipe_init(pool.loop, &w->out, 0);
+  w->in.data = w->out.data = w->process.data = w;
+  w->open_handles = 3;
+
+  uv_stdio_container_t stdio[3];
+  stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE;
+  stdio[0].data.stream = (uv_stream_t *)&w->in;
+  stdio[1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+  stdio[1].data.stream = (uv_stream_t *)&w->out;
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = 2;
+
+  uv_process_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.file = pool.argv[0];
+  options.args = (char **)pool.argv;
+  options.cwd = server->cwd;
+  options.exit_cb = exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+
+  int err = uv_spawn(pool.loop, &w->process, &options);
+  if (err != 0) {
+    lwsl_err("pipe worker spawn: %s (%s)\n", uv_err_name(err), uv_strerror(err));
+    worker_close(w);
+    if (!uv_is_active((uv_handle_t *)pool.respawn)) uv_timer_start(pool.respawn, respawn_cb, RESPAWN_DELAY_MS, 0);
+    return false;
+  }
+  w->started = uv_now(pool.loop);
+  // uv_spawn has no hook before exec, the worker moves right after it started, or does not run at all
+  if (!cgroup_attach(w->process.pid)) {
+    lwsl_err("pipe worker %d has no cgroup, killing it\n", w->process.pid);
+    uv_process_kill(&w->process, SIGKILL);
+  }
+  uv_read_start((uv_stream_t *)&w->out, alloc_cb, read_cb);
+  pool.workers[slot] = w;
+  lwsl_notice("started pipe worker, pid: %d\n", w->process.pid);
+  return true;
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  if (status < 0 && status != UV_ECANCELED) lwsl_warn("write to pipe worker: %s\n", uv_strerror(status));
+  free(req->data);
+  free(req);
+}
+
+static void dispatch() {
+  for (int i = 0; i < pool.size && pool.head != NULL; i++) {
+    pool_worker_t *w = pool.workers[i];
+    if (!worker_idle(w)) continue;
+
+    pool_job_t *job = pool.head;
+    pool.head = job->next;
+    if (pool.head == NULL) pool.tail = NULL;
+    job->next = NULL;
+
+    // libuv keeps the rest of a large request queued until the worker reads it
+    uv_write_t *req = xmalloc(sizeof(uv_write_t));
+    uv_buf_t b = uv_buf_init((char *)job->data, (unsigned int)job->len);
+    req->data = job;
+    if (uv_write(req, (uv_stream_t *)&w->in, &b, 1, write_cb) != 0) {
+      if (job->pss != NULL) pipe_pool_failed(job->pss);
+      free(job);
+      free(req);
+      uv_process_kill(&w->process, SIGKILL);
+      continue;
+    }
+    w->job = job;
+  }
+}
+
+void pipepool_submit(struct pss_raw *pss, const unsigned char *data, size_t len) {
+  pool_job_t *job = xmalloc(sizeof(pool_job_t) + 4 + len);
+  job->next = NULL;
+  job->pss = pss;
+  job->len = 4 + len;
+  job->data[0] = (unsigned char)(len >> 24);
+  job->data[1] = (unsigned char)(len >> 16);
+  job->data[2] = (unsigned char)(len >> 8);
+  job->data[3] = (unsigned char)len;
+  memcpy(job->data + 4, data, len);
+
+  if (pool.tail != NULL)
+    pool.tail->next = job;
+  else
+    pool.head = job;
+  pool.tail = job;
+  dispatch();
+}
+
+void pipepool_detach(struct pss_raw *pss) {
+  pool_job_t **link = &pool.head;
+  pool.tail = NULL;
+  while (*link != NULL) {
+    if ((*link)->pss == pss) {
+      pool_job_t *job = *link;
+      *link = job->next;
+      free(job);
+      continue;
+    }
+    pool.tail = *link;
+    link = &(*link)->next;
+  }
+  // the worker still answers, the answer is read and thrown away
+  for (int i = 0; i < pool.size; i++) {
+    pool_worker_t *w = pool.workers[i];
+    if (w != NULL && w->job != NULL && w->job->pss == pss) w->job->pss = NULL;
+  }
+}
+
+bool pipepool_init(uv_loop_t *loop, const char *const *argv, int size, int max_requests) {
+  pool.loop = loop;
+  pool.argv = argv;
+  pool.size = size;
+  pool.max_requests = max_requests;
+  pool.workers = xmalloc(size * sizeof(pool_worker_t *));
+  memset(pool.workers, 0, size * sizeof(pool_worker_t *));
+  pool.respawn = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, pool.respawn);
+
+  for (int i = 0; i < size; i++)
+    if (!worker_spawn(i)) return false;
+  return true;
+}
+
+void pipepool_close() {
+  if (pool.size == 0) return;
+  pool.closing = true;
+  while (pool.head != NULL) {
+    pool_job_t *job = pool.head;
+    pool.head = job->next;
+    free(job);
+  }
+  pool.tail = NULL;
+  for (int i = 0; i < pool.size; i++) {
+    pool_worker_t *w = pool.workers[i];
+    if (w == NULL) continue;
+    // closing its stdin cancels the write, write_cb frees the job
+    if (w->job != NULL) w->job->pss = NULL;
+    w->job = NULL;
+    uv_process_kill(&w->process, SIGTERM);
+    worker_close(w);
+  }
+  uv_timer_stop(pool.respawn);
+  uv_close((uv_handle_t *)pool.respawn, timer_close_cb);
+  free(pool.workers);
+  pool.workers = NULL;
+  pool.size = 0;
+}
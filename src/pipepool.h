@@ -0,0 +1,20 @@
+#ifndef TTYD_PIPEPOOL_H
+#define TTYD_PIPEPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <uv.h>
+
+struct pss_raw;
+
+// keep size long-lived copies of argv running, each serving requests framed as a 4 byte big-endian
+// length plus payload on stdin and answering the same way on stdout, recycled after max_requests (0: never)
+bool pipepool_init(uv_loop_t *loop, const char *const *argv, int size, int max_requests);
+bool pipepool_active();
+// queue one request of pss for the next idle worker, the answer comes back through pipe_pool_response()
+void pipepool_submit(struct pss_raw *pss, const unsigned char *data, size_t len);
+// the connection is gone, drop its queued request and discard the answer of a running one
+void pipepool_detach(struct pss_raw *pss);
+void pipepool_close();
+
+#endif  // TTYD_PIPEPOOL_H
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <signal.h>
 #if defined(__has_include)
 #  if __has_include(<json-c/json.h>)
 #    include <json-c/json.h>
@@ -16,10 +17,25 @@
 #include <unistd.h> /* gethostname */
 
 #include "pty.h"
+#include "remote.h"
 #include "server.h"
+#include "session.h"
+#include "ticket.h"
+#include "upgrade.h"
 #include "urlargs.h"
 #include "utils.h"
 
+// upper bound on processes spawned for pages whose websocket has not arrived yet
+#define PRESPAWN_MAX 32
+// how often sessions are checked against --idle-stop, --idle-kill and --resume-timeout
+#define IDLE_SWEEP_MS 10000
+// output of a pulled pty goes out in frames of at most this much, see --pty-pull
+#define PULL_FRAME_MAX 65536
+
+static int prespawn_count = 0;
+static pty_ctx_t *ctx_list = NULL;
+static uv_timer_t *idle_timer = NULL;
+
 // initial message list
 static char initial_cmds[] = {SET_WINDOW_TITLE, SET_PREFERENCES};
 
@@ -79,27 +95,200 @@ static bool check_host_origin(struct lws *wsi) {
   return len > 0 && strcasecmp(buf, host_buf) == 0;
 }
 
+static void idle_sweep_cb(uv_timer_t *timer);
+
 static pty_ctx_t *pty_ctx_init(struct pss_tty *pss) {
   pty_ctx_t *ctx = xmalloc(sizeof(pty_ctx_t));
+  memset(ctx, 0, sizeof(pty_ctx_t));
   ctx->pss = pss;
   ctx->ws_closed = false;
+  ctx->active_at = uv_now(server->loop);
+  ctx->next = ctx_list;
+  if (ctx_list != NULL) ctx_list->prev = ctx;
+  ctx_list = ctx;
+
+  if ((server->idle_stop > 0 || server->idle_kill > 0 || server->resume_timeout > 0) && idle_timer == NULL) {
+    idle_timer = xmalloc(sizeof(uv_timer_t));
+    uv_timer_init(server->loop, idle_timer);
+    uv_timer_start(idle_timer, idle_sweep_cb, IDLE_SWEEP_MS, IDLE_SWEEP_MS);
+    uv_unref((uv_handle_t *)idle_timer);
+  }
   return ctx;
 }
 
-static void pty_ctx_free(pty_ctx_t *ctx) { free(ctx); }
+static void pty_ctx_free(pty_ctx_t *ctx) {
+  if (ctx->prev != NULL) ctx->prev->next = ctx->next;
+  if (ctx->next != NULL) ctx->next->prev = ctx->prev;
+  if (ctx_list == ctx) ctx_list = ctx->next;
+  pty_buf_free(ctx->pty_buf);
+  free(ctx);
+}
+
+// the session belongs to pss from now on, it gets a resume id the first time
+static void pty_ctx_attach(pty_ctx_t *ctx, struct pss_tty *pss) {
+  ctx->pss = pss;
+  snprintf(ctx->user, sizeof(ctx->user), "%s", pss->user);
+  if (server->resume_timeout > 0 && ctx->id[0] == '\0' && !ticket_random_id(ctx->id, sizeof(ctx->id)))
+    lwsl_warn("no resume id for process, pid: %d\n", ctx->process->pid);
+}
+
+// input or output: the session is in use, thaw it if it was stopped for being idle
+static void pty_ctx_touch(pty_ctx_t *ctx) {
+  ctx->active_at = uv_now(server->loop);
+  if (!ctx->frozen) return;
+  ctx->frozen = false;
+  pty_freeze(ctx->process, false);
+  lwsl_notice("thawed process, pid: %d\n", ctx->process->pid);
+}
+
+static void idle_sweep_cb(uv_timer_t *timer) {
+  uint64_t now = uv_now(server->loop);
+  for (pty_ctx_t *ctx = ctx_list, *next; ctx != NULL; ctx = next) {
+    next = ctx->next;
+    // processes spawned ahead of their websocket expire with their ticket
+    if (ctx->ws_closed || ctx->process == NULL || (ctx->pss == NULL && !ctx->parked)) continue;
+    pty_process *process = ctx->process;
+    uint64_t idle = now - ctx->active_at;
+
+    bool expired = ctx->parked && now - ctx->parked_at >= (uint64_t)server->resume_timeout * 1000;
+    if (expired || (server->idle_kill > 0 && idle >= (uint64_t)server->idle_kill * 60000)) {
+      lwsl_notice("killing %s process, pid: %d\n", expired ? "unresumed" : "idle", process->pid);
+      if (ctx->parked) ctx->ws_closed = true;
+      pty_kill(process, server->sig_code);
+      // a stopped process would only get the signal once continued
+      if (ctx->frozen) pty_freeze(process, false);
+      ctx->frozen = false;
+      continue;
+    }
+
+    if (server->idle_stop > 0 && !ctx->frozen && idle >= (uint64_t)server->idle_stop * 60000) {
+      lwsl_notice("stopping idle process, pid: %d\n", process->pid);
+      pty_freeze(process, true);
+      ctx->frozen = true;
+    }
+  }
+}
+
+// the websocket went away while the process runs, keep it around for a reconnect with its resume id
+static void pty_ctx_park(pty_ctx_t *ctx, struct pss_tty *pss) {
+  if (ctx->process->remote != NULL) {
+    // the session daemon keeps it, so any frontend can resume it
+    lwsl_notice("detached process, pid: %d, resumable for %ds\n", ctx->process->pid, server->resume_timeout);
+    remote_detach(ctx->process, pss->pty_buf != NULL ? pss->pty_buf->len - pss->pty_off : 0);
+    pty_ctx_free(ctx);
+    return;
+  }
+  ctx->pss = NULL;
+  ctx->parked = true;
+  ctx->parked_at = uv_now(server->loop);
+  pty_pause(ctx->process);
+  if (pss->pty_buf != NULL && pss->pty_off < pss->pty_buf->len) {
+    ctx->pty_buf = pty_buf_init(pss->pty_buf->base + pss->pty_off, pss->pty_buf->len - pss->pty_off);
+  }
+  lwsl_notice("parked process, pid: %d, resumable for %ds\n", ctx->process->pid, server->resume_timeout);
+}
+
+static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof);
+static void process_exit_cb(pty_process *process);
+
+// a session the daemon keeps for this or another frontend, see --sessiond
+static bool attach_session(struct lws *wsi, struct pss_tty *pss, const char *id) {
+  char **envp = xmalloc(sizeof(char *));
+  envp[0] = NULL;
+  pty_ctx_t *ctx = pty_ctx_init(pss);
+  pty_process *process = process_init((void *)ctx, server->loop, NULL, envp);
+  if (remote_attach(process, server->sessiond, id, pss->user, process_read_cb, process_exit_cb) != 0) {
+    pty_ctx_free(ctx);
+    process_free(process);
+    free(process);
+    return false;
+  }
+  ctx->process = process;
+  snprintf(ctx->id, sizeof(ctx->id), "%s", id);
+  snprintf(ctx->user, sizeof(ctx->user), "%s", pss->user);
+  pss->process = process;
+  pss->sched.pid = process->pid;
+  pss->authenticated = true;
+  pss->resumed = true;
+  lwsl_notice("resumed process of the session daemon, pid: %d\n", process->pid);
+  lws_callback_on_writable(wsi);
+  return true;
+}
+
+// ?resume=<id> of a parked session of the same user takes it over, false if there is none
+static bool resume_session(struct lws *wsi, struct pss_tty *pss) {
+  char buf[TICKET_LEN + 8];
+  const char *id = lws_get_urlarg_by_name(wsi, "resume=", buf, sizeof(buf));
+  if (id == NULL) return false;
+  pty_ctx_t *ctx = ctx_list;
+  while (ctx != NULL && !(ctx->parked && !ctx->ws_closed && strcmp(ctx->id, id) == 0)) ctx = ctx->next;
+  if (ctx == NULL) return server->sessiond != NULL && attach_session(wsi, pss, id);
+  if (strcmp(ctx->user, pss->user) != 0) {
+    lwsl_warn("resume of process %d refused for %s\n", ctx->process->pid, pss->address);
+    return false;
+  }
+
+  ctx->parked = false;
+  ctx->pss = pss;
+  pty_ctx_touch(ctx);
+  pss->process = ctx->process;
+  pss->sched.pid = ctx->process->pid;
+  pss->pty_buf = ctx->pty_buf;
+  pss->pty_off = 0;
+  ctx->pty_buf = NULL;
+  pss->authenticated = true;
+  pss->resumed = true;
+  if (pss->pty_buf != NULL) {
+    ratelimit_consume(&pss->rate, pss->pty_buf->len);
+    sched_ready(&pss->sched, pss->pty_buf->len);
+  }
+  lwsl_notice("resumed process, pid: %d\n", ctx->process->pid);
+  lws_callback_on_writable(wsi);
+  return true;
+}
 
 static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
   pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
-  if (ctx->ws_closed) {
+  if (ctx->parked && buf != NULL && ctx->pty_buf == NULL) {
+    // a read that was under way when the client left
+    ctx->pty_buf = buf;
+    return;
+  }
+  if (ctx->ws_closed || ctx->pss == NULL) {
     pty_buf_free(buf);
     return;
   }
+  ctx->active_at = uv_now(server->loop);
 
-  if (eof && !process_running(process))
+  if (eof && !process_running(process)) {
     ctx->pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
-  else
-    ctx->pss->pty_buf = buf;
-  lws_callback_on_writable(ctx->pss->wsi);
+    lws_callback_on_writable(ctx->pss->wsi);
+    return;
+  }
+  if (buf == NULL && !eof) {
+    // --pty-pull: the writable callback reads it, a hangup has nothing pending but its eof to read
+    size_t n = pty_pending(process);
+    sched_ready(&ctx->pss->sched, n > 0 ? n : 1);
+    return;
+  }
+  ctx->pss->pty_buf = buf;
+  ctx->pss->pty_off = 0;
+  ratelimit_consume(&ctx->pss->rate, buf->len);
+  sched_ready(&ctx->pss->sched, buf->len);
+}
+
+static void sched_wake(void *data) { lws_callback_on_writable(((struct pss_tty *)data)->wsi); }
+
+static void rate_resume(void *data) {
+  struct pss_tty *pss = (struct pss_tty *)data;
+  if (pss->process != NULL && pss->process->pull) {
+    if (pss->sched.pending == 0)
+      pty_resume(pss->process);
+    else
+      lws_callback_on_writable(pss->wsi);
+  } else if (pss->pty_buf == NULL) {
+    pty_resume(pss->process);
+  }
 }
 
 static void process_exit_cb(pty_process *process) {
@@ -108,6 +297,17 @@ static void process_exit_cb(pty_process *process) {
     lwsl_notice("process killed with signal %d, pid: %d\n", process->exit_signal, process->pid);
     goto done;
   }
+  if (ctx->parked) {
+    lwsl_notice("parked process exited with code %d, pid: %d\n", process->exit_code, process->pid);
+    goto done;
+  }
+  if (ctx->pss == NULL) {
+    // spawned ahead of its websocket, a late claim of the ticket spawns a fresh one
+    lwsl_notice("unclaimed process exited with code %d, pid: %d\n", process->exit_code, process->pid);
+    ticket_detach(process);
+    prespawn_count--;
+    goto done;
+  }
 
   lwsl_notice("process exited with code %d, pid: %d\n", process->exit_code, process->pid);
   ctx->pss->process = NULL;
@@ -157,31 +357,142 @@ static char **build_env(struct pss_tty *pss) {
   return envp;
 }
 
+// the command runs in this process, or in the session daemon with --sessiond
+static int process_spawn(pty_process *process, const char *user) {
+  if (server->sessiond == NULL) {
+    int status = pty_spawn(process, process_read_cb, process_exit_cb);
+    if (status == 0 && server->pty_pull) pty_set_pull(process);
+    return status;
+  }
+  char id[TICKET_LEN];
+  int status = remote_spawn(process, server->sessiond, user, (uint32_t)server->resume_timeout, id, process_read_cb,
+                            process_exit_cb);
+  // the daemon's id resumes the session through any frontend
+  if (status == 0 && server->resume_timeout > 0) snprintf(((pty_ctx_t *)process->ctx)->id, TICKET_LEN, "%s", id);
+  return status;
+}
+
 static bool spawn_process(struct pss_tty *pss, uint16_t columns, uint16_t rows) {
   pty_process *process = process_init((void *)pty_ctx_init(pss), server->loop, build_args(pss), build_env(pss));
   if (server->cwd != NULL) process->cwd = strdup(server->cwd);
   if (columns > 0) process->columns = columns;
   if (rows > 0) process->rows = rows;
-  if (pty_spawn(process, process_read_cb, process_exit_cb) != 0) {
+  if (process_spawn(process, pss->user) != 0) {
     lwsl_err("pty_spawn: %d (%s)\n", errno, strerror(errno));
+    pty_ctx_free(process->ctx);
     process_free(process);
     return false;
   }
   lwsl_notice("started process, pid: %d\n", process->pid);
+  ((pty_ctx_t *)process->ctx)->process = process;
+  pty_ctx_attach(process->ctx, pss);
   pss->process = process;
+  pss->sched.pid = process->pid;
   lws_callback_on_writable(pss->wsi);
 
   return true;
 }
 
-static void wsi_output(struct lws *wsi, pty_buf_t *buf) {
-  if (buf == NULL) return;
-  char *message = xmalloc(LWS_PRE + 1 + buf->len);
+// spawn the command while the index page is still loading, the process stays paused until
+// the websocket claims the ticket the page carries, see --prespawn
+pty_process *process_prespawn(struct lws *wsi, const char *user) {
+  if (prespawn_count >= PRESPAWN_MAX) return NULL;
+
+  // the page opens its websocket with the same query string, so the url args are known already
+  struct pss_tty pss;
+  memset(&pss, 0, sizeof(pss));
+  snprintf(pss.user, sizeof(pss.user), "%s", user != NULL ? user : "");
+  if (server->url_arg) pss.args = ttyd_collect_url_args(wsi, &pss.argc);
+
+  pty_process *process = process_init((void *)pty_ctx_init(NULL), server->loop, build_args(&pss), build_env(&pss));
+  if (server->cwd != NULL) process->cwd = strdup(server->cwd);
+  int status = process_spawn(process, pss.user);
+  for (int i = 0; i < pss.argc; i++) free(pss.args[i]);
+  free(pss.args);
+  if (status != 0) {
+    lwsl_err("pty_spawn: %d (%s)\n", errno, strerror(errno));
+    pty_ctx_free(process->ctx);
+    process_free(process);
+    return NULL;
+  }
+  lwsl_notice("started process ahead of its client, pid: %d\n", process->pid);
+  ((pty_ctx_t *)process->ctx)->process = process;
+  prespawn_count++;
+  return process;
+}
+
+// ticket_release_cb for processes nobody claimed in time
+void process_release(void *data) {
+  pty_process *process = (pty_process *)data;
+  ((pty_ctx_t *)process->ctx)->ws_closed = true;
+  prespawn_count--;
+  lwsl_notice("killing unclaimed process, pid: %d\n", process->pid);
+  pty_kill(process, server->sig_code);
+}
+
+// the sessions an upgrade hands over, see upgrade.c
+pty_ctx_t *process_sessions() { return ctx_list; }
+
+// a session handed over by the ttyd being upgraded, parked until its client reconnects with its resume id
+bool process_adopt(int pty, const struct upgrade_session *session, pty_buf_t *pending) {
+  char **envp = xmalloc(sizeof(char *));
+  envp[0] = NULL;
+  pty_ctx_t *ctx = pty_ctx_init(NULL);
+  pty_process *process = process_init((void *)ctx, server->loop, NULL, envp);
+  process->pid = session->pid;
+  process->columns = session->columns;
+  process->rows = session->rows;
+  if (pty_adopt(process, pty, process_read_cb, process_exit_cb) != 0) {
+    lwsl_err("pty_adopt: %d (%s)\n", errno, strerror(errno));
+    close(pty);
+    pty_ctx_free(ctx);
+    process_free(process);
+    pty_buf_free(pending);
+    return false;
+  }
+  if (server->pty_pull) pty_set_pull(process);
+  ctx->process = process;
+  snprintf(ctx->id, sizeof(ctx->id), "%s", session->id);
+  snprintf(ctx->user, sizeof(ctx->user), "%s", session->user);
+  ctx->frozen = session->frozen != 0;
+  ctx->parked = true;
+  ctx->parked_at = uv_now(server->loop);
+  ctx->pty_buf = pending;
+  lwsl_notice("adopted process, pid: %d\n", process->pid);
+  return true;
+}
+
+// a session that can move to another ttyd: its client can come back to it there, unclaimed, dying or
+// unresumable sessions stay, so do those of the session daemon, whose clients attach again through it,
+// and those of an I/O thread, whose output may be in its ring and not in the pty
+bool process_movable(pty_ctx_t *ctx) {
+  if (ctx->process == NULL || ctx->ws_closed || ctx->id[0] == '\0' || ctx->process->remote != NULL) return false;
+  if (ctx->process->iothread != NULL) return false;
+  return ctx->pss != NULL || ctx->parked;
+}
+
+// another ttyd took over the sessions of pid (0: all of them): stop reading them and send their clients
+// there, to the same host on port unless it is 0
+void process_handoff(int pid, int port) {
+  for (pty_ctx_t *ctx = ctx_list; ctx != NULL; ctx = ctx->next) {
+    if (!process_movable(ctx) || (pid > 0 && ctx->process->pid != pid)) continue;
+    pty_pause(ctx->process);
+    ctx->ws_closed = true;
+    if (ctx->pss == NULL) continue;
+    ctx->pss->process = NULL;
+    ctx->pss->reconnect_port = port;
+    ctx->pss->lws_close_status = LWS_CLOSE_STATUS_GOINGAWAY;
+    lws_callback_on_writable(ctx->pss->wsi);
+  }
+}
+
+static void wsi_output(struct lws *wsi, const char *data, size_t len) {
+  char *message = xmalloc(LWS_PRE + 1 + len);
   char *ptr = message + LWS_PRE;
 
   *ptr = OUTPUT;
-  memcpy(ptr + 1, buf->base, buf->len);
-  size_t n = buf->len + 1;
+  memcpy(ptr + 1, data, len);
+  size_t n = len + 1;
 
   if (lws_write(wsi, (unsigned char *)ptr, n, LWS_WRITE_BINARY) < n) {
     lwsl_err("write OUTPUT to WS\n");
@@ -190,6 +501,83 @@ static void wsi_output(struct lws *wsi, pty_buf_t *buf) {
   free(message);
 }
 
+// --pty-pull: read the pty straight into the frame for as long as the socket takes it, the pty is
+// asked for more only once it is empty, so output stays in the kernel while the client is slow
+static int pull_output(struct lws *wsi, struct pss_tty *pss) {
+  static unsigned char frame[LWS_PRE + 1 + PULL_FRAME_MAX];
+  pty_process *process = pss->process;
+  bool pulled = false;
+  while (ratelimit_ready(&pss->rate)) {
+    // a bulk session sends its quantum and waits for the next round, see sched.c
+    size_t n = sched_grant(&pss->sched);
+    if (n == 0) {
+      if (pulled && pss->sched.pending == 0) pty_resume(process);
+      return 0;
+    }
+    if (n > PULL_FRAME_MAX) n = PULL_FRAME_MAX;
+    ssize_t r = pty_read(process, (char *)frame + LWS_PRE + 1, n);
+    if (r <= 0) {
+      sched_pulled(&pss->sched, 0, 0);
+      if (r == UV_EAGAIN) {
+        pty_resume(process);
+      } else if (!process_running(process)) {
+        pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
+        lws_callback_on_writable(wsi);
+      }
+      return 0;
+    }
+    ((pty_ctx_t *)process->ctx)->active_at = uv_now(server->loop);
+    frame[LWS_PRE] = OUTPUT;
+    if (lws_write(wsi, frame + LWS_PRE, (size_t)r + 1, LWS_WRITE_BINARY) < r + 1) {
+      lwsl_err("write OUTPUT to WS\n");
+      return -1;
+    }
+    ratelimit_consume(&pss->rate, (size_t)r);
+    sched_pulled(&pss->sched, (size_t)r, pty_pending(process));
+    pulled = true;
+    if (lws_send_pipe_choked(wsi)) {
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+  }
+  // over its rate the session stays unread, rate_resume() asks for the writable callback again
+  return 0;
+}
+
+static void viewer_wake(void *data) { lws_callback_on_writable(((struct pss_tty *)data)->wsi); }
+
+static bool watch_session(struct pss_tty *pss) {
+  pss->viewer = session_watch(viewer_wake, pss);
+  if (pss->viewer == NULL) return false;
+  lwsl_notice("watching the shared session from %s\n", pss->address);
+  lws_callback_on_writable(pss->wsi);
+  return true;
+}
+
+// frames of the shared session go out as they are, every viewer writes the OUTPUT byte and its
+// websocket header into the same headroom in front of the data, nothing is copied per viewer
+static int viewer_output(struct lws *wsi, struct pss_tty *pss) {
+  session_frame_t *frame;
+  while ((frame = session_next(pss->viewer)) != NULL) {
+    if (lws_send_pipe_choked(wsi)) {
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+    unsigned char *p = frame->data - 1;
+    *p = OUTPUT;
+    if (lws_write(wsi, p, frame->len + 1, LWS_WRITE_BINARY) < (int)frame->len + 1) {
+      lwsl_err("write OUTPUT to WS\n");
+      return -1;
+    }
+    session_sent(pss->viewer);
+  }
+  if (session_ended(pss->viewer)) {
+    lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+    return 1;
+  }
+  return 0;
+}
+
 static bool check_auth(struct lws *wsi, struct pss_tty *pss) {
   if (server->auth_header != NULL) {
     return lws_hdr_custom_copy(wsi, pss->user, sizeof(pss->user),
@@ -205,6 +593,48 @@ static bool check_auth(struct lws *wsi, struct pss_tty *pss) {
   return true;
 }
 
+// a ticket from the bootstrapped index.html stands in for the token handshake, the process
+// starts with the size the page measured, returns -1 if there is no ticket, 0 if it is rejected
+static int claim_ticket(struct lws *wsi, struct pss_tty *pss) {
+  char buf[64];
+  const char *value = lws_get_urlarg_by_name(wsi, "ticket=", buf, sizeof(buf));
+  if (value == NULL) return -1;
+  void *data = NULL;
+  if (!ticket_claim(value, pss->user, &data)) return 0;
+
+  if (pss->view) {
+    // a viewer only needed the ticket to authenticate
+    if (data != NULL) process_release(data);
+    if (!watch_session(pss)) return 0;
+    pss->authenticated = true;
+    pss->initialized = true;
+    return 1;
+  }
+
+  uint16_t columns = 0, rows = 0;
+  if ((value = lws_get_urlarg_by_name(wsi, "cols=", buf, sizeof(buf))) != NULL) columns = (uint16_t)atoi(value);
+  if ((value = lws_get_urlarg_by_name(wsi, "rows=", buf, sizeof(buf))) != NULL) rows = (uint16_t)atoi(value);
+  if (data != NULL) {
+    pty_process *process = (pty_process *)data;
+    prespawn_count--;
+    pty_ctx_attach(process->ctx, pss);
+    pss->process = process;
+    pss->sched.pid = process->pid;
+    if (columns > 0) process->columns = columns;
+    if (rows > 0) process->rows = rows;
+    pty_resize(process);
+    lwsl_notice("claimed process, pid: %d\n", process->pid);
+    lws_callback_on_writable(wsi);
+  } else if (!spawn_process(pss, columns, rows)) {
+    return 0;
+  }
+
+  pss->authenticated = true;
+  pss->initialized = true;
+  pty_resume(pss->process);
+  return 1;
+}
+
 int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
   struct pss_tty *pss = (struct pss_tty *)user;
   size_t n = 0;
@@ -243,6 +673,8 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       pss->authenticated = false;
       pss->wsi = wsi;
       pss->lws_close_status = LWS_CLOSE_STATUS_NOSTATUS;
+      sched_add(&pss->sched, pss->user, sched_wake, pss);
+      ratelimit_init(&pss->rate, pss->user, rate_resume, pss);
 
       /* ensure predictable initial state for -a handling */
       pss->argc = 0;
@@ -259,39 +691,98 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         }
       }
 
+      if (server->stream) {
+        char buf[8];
+        const char *value = lws_get_urlarg_by_name(wsi, "view=", buf, sizeof(buf));
+        pss->view = value != NULL && strcmp(value, "0") != 0;
+      }
+
       server->client_count++;
 
       lws_get_peer_simple(lws_get_network_wsi(wsi), pss->address, sizeof(pss->address));
       lwsl_notice("WS   %s - %s, clients: %d\n", pss->path, pss->address, server->client_count);
+
+      // a resumed session needs neither a ticket nor a token, its id is the secret
+      if (server->resume_timeout > 0 && !pss->view && resume_session(wsi, pss)) break;
+
+      if (server->bootstrap && claim_ticket(wsi, pss) == 0) {
+        lwsl_warn("WS ticket rejected from %s\n", pss->address);
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
+        return -1;
+      }
       break;
 
     case LWS_CALLBACK_SERVER_WRITEABLE:
       if (!pss->initialized) {
+        // both initial messages usually fit in one pass, no need to wait for another writable callback
+        while (pss->initial_cmd_index < (int)sizeof(initial_cmds) && !lws_send_pipe_choked(wsi)) {
+          if (send_initial_message(wsi, pss->initial_cmd_index) < 0) {
+            lwsl_err("failed to send initial message, index: %d\n", pss->initial_cmd_index);
+            lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
+            return -1;
+          }
+          pss->initial_cmd_index++;
+        }
         if (pss->initial_cmd_index == sizeof(initial_cmds)) {
           pss->initialized = true;
-          pty_resume(pss->process);
-          break;
-        }
-        if (send_initial_message(wsi, pss->initial_cmd_index) < 0) {
-          lwsl_err("failed to send initial message, index: %d\n", pss->initial_cmd_index);
-          lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
-          return -1;
+          // output a resumed session had pending goes first
+          if (pss->pty_buf != NULL)
+            lws_callback_on_writable(wsi);
+          else
+            pty_resume(pss->process);
+        } else {
+          lws_callback_on_writable(wsi);
         }
-        pss->initial_cmd_index++;
-        lws_callback_on_writable(wsi);
         break;
       }
 
       if (pss->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS) {
+        if (pss->reconnect_port > 0) {
+          // the client resumes its session at the ttyd it moved to
+          unsigned char message[LWS_PRE + 8];
+          unsigned char *p = &message[LWS_PRE];
+          int n = snprintf((char *)p, 8, "%c%d", RECONNECT, pss->reconnect_port);
+          lws_write(wsi, p, (size_t)n, LWS_WRITE_BINARY);
+        }
         lws_close_reason(wsi, pss->lws_close_status, NULL, 0);
         return 1;
       }
 
+      if (pss->viewer != NULL) return viewer_output(wsi, pss);
+
+      if (!pss->resume_sent && pss->process != NULL && ((pty_ctx_t *)pss->process->ctx)->id[0] != '\0') {
+        unsigned char message[LWS_PRE + 1 + TICKET_LEN];
+        unsigned char *p = &message[LWS_PRE];
+        int n = snprintf((char *)p, 1 + TICKET_LEN, "%c%s", SET_RESUME_ID, ((pty_ctx_t *)pss->process->ctx)->id);
+        if (lws_write(wsi, p, (size_t)n, LWS_WRITE_BINARY) < n) {
+          lwsl_err("failed to send the resume id\n");
+          return -1;
+        }
+        pss->resume_sent = true;
+        if (lws_send_pipe_choked(wsi)) {
+          lws_callback_on_writable(wsi);
+          break;
+        }
+      }
+
       if (pss->pty_buf != NULL) {
-        wsi_output(wsi, pss->pty_buf);
+        // a bulk session sends its quantum and waits for the next round, see sched.c
+        size_t n = sched_grant(&pss->sched);
+        if (n == 0) break;
+        if (n > pss->pty_buf->len - pss->pty_off) n = pss->pty_buf->len - pss->pty_off;
+        wsi_output(wsi, pss->pty_buf->base + pss->pty_off, n);
+        pss->pty_off += n;
+        sched_sent(&pss->sched, n);
+        if (pss->pty_off < pss->pty_buf->len) {
+          if (sched_grant(&pss->sched) > 0) lws_callback_on_writable(wsi);
+          break;
+        }
         pty_buf_free(pss->pty_buf);
         pss->pty_buf = NULL;
-        pty_resume(pss->process);
+        // over its rate the session stays unread, rate_resume() picks it up again
+        if (ratelimit_ready(&pss->rate)) pty_resume(pss->process);
+      } else if (pss->process != NULL && pss->process->pull) {
+        return pull_output(wsi, pss);
       }
       break;
 
@@ -322,7 +813,9 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
         switch (command) {
           case INPUT:
-            if (!server->writable) break;
+            if (!server->writable || pss->viewer != NULL || pss->process == NULL) break;
+            sched_input(&pss->sched);
+            pty_ctx_touch(pss->process->ctx);
             {
               int err = pty_write(pss->process, pty_buf_init(pss->buffer + 1, pss->len - 1));
               if (err) {
@@ -344,7 +837,14 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
             pty_resume(pss->process);
             break;
           case JSON_DATA:
-            if (pss->process != NULL) break;
+            if (pss->process != NULL && pss->resumed) {
+              // the session takes the size of the client that resumed it
+              json_object_put(
+                  parse_window_size(pss->buffer, pss->len, &pss->process->columns, &pss->process->rows));
+              pty_resize(pss->process);
+              break;
+            }
+            if (pss->process != NULL || pss->viewer != NULL) break;
             {
               uint16_t columns = 0;
               uint16_t rows = 0;
@@ -365,7 +865,11 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                 }
               }
               json_object_put(obj);
-              if (!spawn_process(pss, columns, rows)) return 1;
+              if (pss->view) {
+                if (!watch_session(pss)) return 1;
+              } else if (!spawn_process(pss, columns, rows)) {
+                return 1;
+              }
             }
             break;
           default:
@@ -386,7 +890,16 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       server->client_count--;
       lwsl_notice("WS closed from %s, clients: %d\n", pss->address, server->client_count);
       if (pss->buffer != NULL) free(pss->buffer);
+      if (pss->process != NULL && server->resume_timeout > 0 && ((pty_ctx_t *)pss->process->ctx)->id[0] != '\0' &&
+          process_running(pss->process)) {
+        pty_ctx_park(pss->process->ctx, pss);
+        pss->process = NULL;
+      }
       if (pss->pty_buf != NULL) pty_buf_free(pss->pty_buf);
+      sched_remove(&pss->sched);
+      ratelimit_free(&pss->rate);
+      session_unwatch(pss->viewer);
+      pss->viewer = NULL;
       for (int i = 0; i < pss->argc; i++) {
         free(pss->args[i]);
       }
@@ -402,6 +915,7 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
           pty_pause(pss->process);
           lwsl_notice("killing process, pid: %d\n", pss->process->pid);
           pty_kill(pss->process, server->sig_code);
+          if (((pty_ctx_t *)pss->process->ctx)->frozen) pty_freeze(pss->process, false);
         }
       }
 
@@ -7,7 +7,10 @@
 #include <unistd.h>
 
 #ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #if defined(__OpenBSD__) || defined(__APPLE__)
@@ -26,7 +29,11 @@ extern char **environ;
 #endif
 #endif
 
+#include "cgroup.h"
+#include "iothread.h"
 #include "pty.h"
+#include "remote.h"
+#include "uring.h"
 #include "utils.h"
 
 #ifdef _WIN32
@@ -35,10 +42,17 @@ HRESULT (WINAPI *pResizePseudoConsole)(HPCON, COORD);
 void (WINAPI *pClosePseudoConsole)(HPCON);
 #endif
 
+#ifndef _WIN32
+// output handed to read_cb at once, what a libuv read would take
+#define PTY_READ_MAX 65536
+#endif
+
+#ifdef _WIN32
 static void alloc_cb(uv_handle_t *unused, size_t suggested_size, uv_buf_t *buf) {
   buf->base = xmalloc(suggested_size);
   buf->len = suggested_size;
 }
+#endif
 
 static void close_cb(uv_handle_t *handle) { free(handle); }
 
@@ -60,6 +74,7 @@ void pty_buf_free(pty_buf_t *buf) {
   free(buf);
 }
 
+#ifdef _WIN32
 static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
   uv_read_stop(stream);
   pty_process *process = (pty_process *) stream->data;
@@ -79,6 +94,67 @@ static void write_cb(uv_write_t *req, int unused) {
   pty_buf_free(buf);
   free(req);
 }
+#else
+static void poll_cb(uv_poll_t *handle, int status, int events);
+
+// read while resumed, write while input is queued
+static void poll_update(pty_process *process) {
+  if (process->poll == NULL) return;
+  int events = (process->paused ? 0 : UV_READABLE) | (process->writes != NULL ? UV_WRITABLE : 0);
+  if (events == 0) {
+    uv_poll_stop(process->poll);
+  } else {
+    uv_poll_start(process->poll, events, poll_cb);
+  }
+}
+
+// write queued input until the pty takes no more, the rest waits for it to become writable
+static void flush_writes(pty_process *process) {
+  while (process->writes != NULL) {
+    pty_write_t *w = process->writes;
+    ssize_t n = write(process->pty, w->buf->base + w->off, w->buf->len - w->off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) break;
+    if (n > 0) w->off += (size_t) n;
+    // a failed write is dropped like libuv drops it, the pty is most likely gone
+    if (n > 0 && w->off < w->buf->len) continue;
+    process->writes = w->next;
+    pty_buf_free(w->buf);
+    free(w);
+  }
+}
+
+static void poll_cb(uv_poll_t *handle, int status, int events) {
+  pty_process *process = (pty_process *) handle->data;
+  if (status == 0 && (events & UV_WRITABLE)) flush_writes(process);
+  if (process->paused || (status == 0 && !(events & UV_READABLE))) {
+    poll_update(process);
+    return;
+  }
+  if (process->pull && status == 0) {
+    // nothing is read here, the reader pulls the output when its socket takes it
+    process->paused = true;
+    poll_update(process);
+    process->read_cb(process, NULL, false);
+    return;
+  }
+
+  static char buf[PTY_READ_MAX];
+  ssize_t n = status == 0 ? read(process->pty, buf, sizeof(buf)) : -1;
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    poll_update(process);
+    return;
+  }
+  // one chunk per pty_resume(), the callback may free the process
+  process->paused = true;
+  poll_update(process);
+  if (n <= 0) {
+    process->read_cb(process, NULL, true);
+    return;
+  }
+  process->read_cb(process, pty_buf_init(buf, (size_t) n), false);
+}
+#endif
 
 pty_process *process_init(void *ctx, uv_loop_t *loop, char *argv[], char *envp[]) {
   pty_process *process = xmalloc(sizeof(pty_process));
@@ -94,6 +170,7 @@ pty_process *process_init(void *ctx, uv_loop_t *loop, char *argv[], char *envp[]
 }
 
 bool process_running(pty_process *process) {
+  if (process != NULL && process->remote != NULL) return remote_running(process);
   return process != NULL && process->pid > 0 && uv_kill(process->pid, 0) == 0;
 }
 
@@ -106,12 +183,26 @@ void process_free(pty_process *process) {
   }
   if (process->pty != NULL) pClosePseudoConsole(process->pty);
   if (process->handle != NULL) CloseHandle(process->handle);
-#else
-  close(process->pty);
-  uv_thread_join(&process->tid);
-#endif
   if (process->in != NULL) uv_close((uv_handle_t *) process->in, close_cb);
   if (process->out != NULL) uv_close((uv_handle_t *) process->out, close_cb);
+#else
+  if (process->remote != NULL) remote_free(process);
+  if (process->uring != NULL) uring_free(process);
+  if (process->iothread != NULL) iothread_free(process);
+  // off the loop before the fd goes
+  if (process->poll != NULL) uv_close((uv_handle_t *) process->poll, close_cb);
+  while (process->writes != NULL) {
+    pty_write_t *w = process->writes;
+    process->writes = w->next;
+    pty_buf_free(w->buf);
+    free(w);
+  }
+  // zero until the pty is set up, a failed spawn has no thread to join
+  if (process->pty > 0) {
+    close(process->pty);
+    uv_thread_join(&process->tid);
+  }
+#endif
   if (process->argv != NULL) free(process->argv);
   if (process->cwd != NULL) free(process->cwd);
   char **p = process->envp;
@@ -121,15 +212,49 @@ void process_free(pty_process *process) {
 
 void pty_pause(pty_process *process) {
   if (process == NULL) return;
+  if (process->remote != NULL) {
+    remote_pause(process);
+    return;
+  }
+  if (process->uring != NULL) {
+    uring_pause(process);
+    return;
+  }
+  if (process->iothread != NULL) {
+    iothread_pause(process);
+    return;
+  }
+#ifdef _WIN32
   if (process->paused) return;
   uv_read_stop((uv_stream_t *) process->out);
+#else
+  process->paused = true;
+  poll_update(process);
+#endif
 }
 
 void pty_resume(pty_process *process) {
   if (process == NULL) return;
+  if (process->remote != NULL) {
+    remote_resume(process);
+    return;
+  }
+  if (process->uring != NULL) {
+    uring_resume(process);
+    return;
+  }
+  if (process->iothread != NULL) {
+    iothread_resume(process);
+    return;
+  }
   if (!process->paused) return;
+#ifdef _WIN32
   process->out->data = process;
   uv_read_start((uv_stream_t *) process->out, alloc_cb, read_cb);
+#else
+  process->paused = false;
+  poll_update(process);
+#endif
 }
 
 int pty_write(pty_process *process, pty_buf_t *buf) {
@@ -137,15 +262,36 @@ int pty_write(pty_process *process, pty_buf_t *buf) {
     pty_buf_free(buf);
     return UV_ESRCH;
   }
+  if (process->remote != NULL) return remote_write(process, buf);
+  if (process->uring != NULL) return uring_write(process, buf);
+  if (process->iothread != NULL) return iothread_write(process, buf);
+#ifdef _WIN32
   uv_buf_t b = uv_buf_init(buf->base, buf->len);
   uv_write_t *req = xmalloc(sizeof(uv_write_t));
   req->data = buf;
   return uv_write(req, (uv_stream_t *) process->in, &b, 1, write_cb);
+#else
+  pty_write_t *w = xmalloc(sizeof(pty_write_t));
+  w->buf = buf;
+  w->off = 0;
+  w->next = NULL;
+  if (process->writes == NULL) {
+    process->writes = w;
+  } else {
+    process->writes_last->next = w;
+  }
+  process->writes_last = w;
+  // like uv_write(), what the pty takes right away goes without waiting for the loop
+  flush_writes(process);
+  poll_update(process);
+  return 0;
+#endif
 }
 
 bool pty_resize(pty_process *process) {
   if (process == NULL) return false;
   if (process->columns <= 0 || process->rows <= 0) return false;
+  if (process->remote != NULL) return remote_resize(process);
 #ifdef _WIN32
   COORD size = {(int16_t) process->columns, (int16_t) process->rows};
   return pResizePseudoConsole(process->pty, size) == S_OK;
@@ -157,6 +303,7 @@ bool pty_resize(pty_process *process) {
 
 bool pty_kill(pty_process *process, int sig) {
   if (process == NULL) return false;
+  if (process->remote != NULL) return remote_kill(process, sig);
 #ifdef _WIN32
   return TerminateProcess(process->handle, 1) != 0;
 #else
@@ -164,6 +311,53 @@ bool pty_kill(pty_process *process, int sig) {
 #endif
 }
 
+bool pty_set_pull(pty_process *process) {
+#ifdef _WIN32
+  return false;
+#else
+  if (process == NULL || process->poll == NULL) return false;
+  process->pull = true;
+  return true;
+#endif
+}
+
+ssize_t pty_read(pty_process *process, char *buf, size_t len) {
+#ifdef _WIN32
+  return UV_ENOTSUP;
+#else
+  ssize_t n;
+  do
+    n = read(process->pty, buf, len);
+  while (n < 0 && errno == EINTR);
+  return n < 0 ? -errno : n;
+#endif
+}
+
+size_t pty_pending(pty_process *process) {
+#ifdef _WIN32
+  return 0;
+#else
+  int n = 0;
+  if (ioctl(process->pty, FIONREAD, &n) != 0 || n < 0) return 0;
+  return (size_t) n;
+#endif
+}
+
+bool pty_freeze(pty_process *process, bool freeze) {
+  if (process == NULL) return false;
+  int sig = freeze ? SIGSTOP : SIGCONT;
+  if (process->remote != NULL) return remote_kill(process, sig);
+#ifdef _WIN32
+  return false;
+#else
+  if (cgroup_freeze(process->pid, freeze)) return true;
+  bool ok = uv_kill(-process->pid, sig) == 0;
+  pid_t fg = process->pty > 0 ? tcgetpgrp(process->pty) : -1;
+  if (fg > 0 && fg != process->pid) ok = uv_kill(-fg, sig) == 0 && ok;
+  return ok;
+#endif
+}
+
 #ifdef _WIN32
 bool conpty_init() {
   uv_lib_t kernel;
@@ -376,15 +570,20 @@ static bool fd_set_cloexec(const int fd) {
   return (flags & FD_CLOEXEC) == 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) != -1;
 }
 
-static bool fd_duplicate(int fd, uv_pipe_t *pipe) {
-  int fd_dup = dup(fd);
-  if (fd_dup < 0) return false;
-
-  if (!fd_set_cloexec(fd_dup)) return false;
+// the pty master is read and written on an I/O thread, through io_uring, or on one uv_poll handle of the loop
+static int open_io(pty_process *process, int master) {
+  if (iothread_enabled()) return iothread_open(process, master);
+  if (uring_enabled()) return uring_open(process, master);
 
-  int status = uv_pipe_open(pipe, fd_dup);
-  if (status) close(fd_dup);
-  return status == 0;
+  process->poll = xmalloc(sizeof(uv_poll_t));
+  int status = uv_poll_init(process->loop, process->poll, master);
+  if (status != 0) {
+    free(process->poll);
+    process->poll = NULL;
+    return status;
+  }
+  process->poll->data = process;
+  return 0;
 }
 
 static void wait_cb(void *arg) {
@@ -408,8 +607,28 @@ static void wait_cb(void *arg) {
   uv_async_send(&process->async);
 }
 
+// waitpid() only works for children, an adopted process is watched with a pidfd, or polled without one
+static void adopt_wait_cb(void *arg) {
+  pty_process *process = (pty_process *) arg;
+
+#ifdef SYS_pidfd_open
+  int fd = (int) syscall(SYS_pidfd_open, process->pid, 0);
+  if (fd >= 0) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+      ;
+    close(fd);
+    uv_async_send(&process->async);
+    return;
+  }
+#endif
+  while (kill(process->pid, 0) == 0 || errno == EPERM) sleep(1);
+  uv_async_send(&process->async);
+}
+
 static void async_cb(uv_async_t *async) {
   pty_process *process = (pty_process *) async->data;
+  cgroup_release(process->pid);
   process->exit_cb(process);
 
   uv_close((uv_handle_t *) async, async_free_cb);
@@ -423,11 +642,19 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
 
   int master, pid;
   struct winsize size = {process->rows, process->columns, 0, 0};
+  struct cgroup *cg = cgroup_new();
+  // the command runs confined or not at all
+  if (cg == NULL && cgroup_enabled()) return UV_EPERM;
   pid = forkpty(&master, NULL, NULL, &size);
   if (pid < 0) {
     status = -errno;
+    cgroup_bind(cg, pid);
     return status;
   } else if (pid == 0) {
+    if (!cgroup_enter(cg)) {
+      perror("can not enter cgroup\n");
+      _exit(126);
+    }
     setsid();
     if (process->cwd != NULL) chdir(process->cwd);
     if (process->envp != NULL) {
@@ -441,6 +668,8 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
     }
   }
 
+  cgroup_bind(cg, pid);
+
   int flags = fcntl(master, F_GETFL);
   if (flags == -1) {
     status = -errno;
@@ -455,15 +684,8 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
     goto error;
   }
 
-  process->in = xmalloc(sizeof(uv_pipe_t));
-  process->out = xmalloc(sizeof(uv_pipe_t));
-  uv_pipe_init(process->loop, process->in, 0);
-  uv_pipe_init(process->loop, process->out, 0);
-
-  if (!fd_duplicate(master, process->in) || !fd_duplicate(master, process->out)) {
-    status = -errno;
-    goto error;
-  }
+  status = open_io(process, master);
+  if (status != 0) goto error;
 
   process->pty = master;
   process->pid = pid;
@@ -480,6 +702,27 @@ error:
   close(master);
   uv_kill(pid, SIGKILL);
   waitpid(pid, NULL, 0);
+  cgroup_release(pid);
   return status;
 }
+
+int pty_adopt(pty_process *process, int master, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+  int flags = fcntl(master, F_GETFL);
+  if (flags == -1 || fcntl(master, F_SETFL, flags | O_NONBLOCK) == -1 || !fd_set_cloexec(master)) return -errno;
+
+  int status = open_io(process, master);
+  if (status != 0) return status;
+
+  process->pty = master;
+  // the exit status went to the process that spawned it, report a clean exit
+  process->exit_code = 0;
+  process->paused = true;
+  process->read_cb = read_cb;
+  process->exit_cb = exit_cb;
+  process->async.data = process;
+  uv_async_init(process->loop, &process->async, async_cb);
+  uv_thread_create(&process->tid, adopt_wait_cb, process);
+
+  return 0;
+}
 #endif
@@ -22,7 +22,16 @@ typedef struct {
 } pty_buf_t;
 
 struct pty_process_;
+struct remote;
+struct uring_io;
+struct iothread_io;
 typedef struct pty_process_ pty_process;
+// input the pty did not take yet
+typedef struct pty_write_ {
+  pty_buf_t *buf;
+  size_t off;  // written so far
+  struct pty_write_ *next;
+} pty_write_t;
 typedef void (*pty_read_cb)(pty_process *, pty_buf_t *, bool);
 typedef void (*pty_exit_cb)(pty_process *);
 
@@ -34,9 +43,13 @@ struct pty_process_ {
   HPCON pty;
   HANDLE handle;
   HANDLE wait;
+  uv_pipe_t *in;
+  uv_pipe_t *out;
 #else
   pid_t pty;
   uv_thread_t tid;
+  uv_poll_t *poll;                    // the pty master, read and written with this one handle
+  pty_write_t *writes, *writes_last;  // in order
 #endif
   char **argv;
   char **envp;
@@ -44,13 +57,15 @@ struct pty_process_ {
 
   uv_loop_t *loop;
   uv_async_t async;
-  uv_pipe_t *in;
-  uv_pipe_t *out;
   bool paused;
+  bool pull;  // read_cb(process, NULL, false) only says there is output, the reader takes it with pty_read()
 
   pty_read_cb read_cb;
   pty_exit_cb exit_cb;
   void *ctx;
+  struct remote *remote;    // the process runs in the session daemon, see remote.c
+  struct uring_io *uring;   // its pty is read and written through io_uring, see uring.c
+  struct iothread_io *iothread;  // its pty is read and written on an I/O thread, see iothread.c
 };
 
 pty_buf_t *pty_buf_init(char *base, size_t len);
@@ -64,5 +79,20 @@ void pty_resume(pty_process *process);
 int pty_write(pty_process *process, pty_buf_t *buf);
 bool pty_resize(pty_process *process);
 bool pty_kill(pty_process *process, int sig);
+// stop or continue every process of the session: its cgroup, or the process group of the command and
+// the foreground job of the pty, which a job control shell puts into a group of its own
+bool pty_freeze(pty_process *process, bool freeze);
+// --pty-pull: leave the output in the pty until the reader can send it, false where the pty is not
+// read on the loop (session daemon, io_uring, windows)
+bool pty_set_pull(pty_process *process);
+// nonblocking read of a pulled pty: bytes read, 0 or a negative error at its end, UV_EAGAIN when empty
+ssize_t pty_read(pty_process *process, char *buf, size_t len);
+// bytes waiting in the pty
+size_t pty_pending(pty_process *process);
+#ifndef _WIN32
+// take over the pty master of a running process another ttyd spawned (process->pid must be set),
+// it is not our child: its exit is noticed but its exit status is lost
+int pty_adopt(pty_process *process, int master, pty_read_cb read_cb, pty_exit_cb exit_cb);
+#endif
 
 #endif  // TTYD_PTY_H
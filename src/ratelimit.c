@@ -0,0 +1,134 @@
+#include "ratelimit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+static uv_loop_t *rate_loop = NULL;
+static uint64_t session_rate = 0;
+static uint64_t user_rate = 0;
+static rate_bucket_t *users = NULL;
+
+void ratelimit_config(uv_loop_t *loop, uint64_t session, uint64_t user) {
+  rate_loop = loop;
+  session_rate = session;
+  user_rate = user;
+}
+
+static rate_bucket_t *bucket_new(uint64_t rate) {
+  rate_bucket_t *bucket = xmalloc(sizeof(rate_bucket_t));
+  memset(bucket, 0, sizeof(rate_bucket_t));
+  bucket->rate = (double)rate;
+  bucket->tokens = bucket->rate;
+  bucket->updated = uv_now(rate_loop);
+  bucket->refs = 1;
+  return bucket;
+}
+
+double ratelimit_tokens(rate_bucket_t *bucket) {
+  uint64_t now = uv_now(rate_loop);
+  bucket->tokens += bucket->rate * (double)(now - bucket->updated) / 1000;
+  if (bucket->tokens > bucket->rate) bucket->tokens = bucket->rate;
+  bucket->updated = now;
+  return bucket->tokens;
+}
+
+static rate_bucket_t *user_bucket(const char *user) {
+  for (rate_bucket_t *bucket = users; bucket != NULL; bucket = bucket->next) {
+    if (strcmp(bucket->user, user) == 0) {
+      bucket->refs++;
+      return bucket;
+    }
+  }
+  rate_bucket_t *bucket = bucket_new(user_rate);
+  snprintf(bucket->user, sizeof(bucket->user), "%s", user);
+  bucket->next = users;
+  users = bucket;
+  return bucket;
+}
+
+static void user_bucket_unref(rate_bucket_t *bucket) {
+  if (--bucket->refs > 0) return;
+  for (rate_bucket_t **link = &users; *link != NULL; link = &(*link)->next) {
+    if (*link == bucket) {
+      *link = bucket->next;
+      break;
+    }
+  }
+  free(bucket);
+}
+
+static void timer_close_cb(uv_handle_t *handle) { free(handle); }
+
+static void timer_cb(uv_timer_t *timer) {
+  rate_limit_t *limit = (rate_limit_t *)timer->data;
+  if (ratelimit_ready(limit)) limit->resume(limit->data);
+}
+
+void ratelimit_init(rate_limit_t *limit, const char *user, ratelimit_resume_cb resume, void *data) {
+  memset(limit, 0, sizeof(rate_limit_t));
+  if (rate_loop == NULL || (session_rate == 0 && user_rate == 0)) return;
+  if (session_rate > 0) limit->session = bucket_new(session_rate);
+  if (user_rate > 0) limit->user = user_bucket(user != NULL ? user : "");
+  limit->timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(rate_loop, limit->timer);
+  limit->timer->data = limit;
+  limit->resume = resume;
+  limit->data = data;
+}
+
+void ratelimit_free(rate_limit_t *limit) {
+  if (limit->timer != NULL) {
+    uv_timer_stop(limit->timer);
+    uv_close((uv_handle_t *)limit->timer, timer_close_cb);
+  }
+  free(limit->session);
+  if (limit->user != NULL) user_bucket_unref(limit->user);
+  memset(limit, 0, sizeof(rate_limit_t));
+}
+
+void ratelimit_consume(rate_limit_t *limit, size_t n) {
+  if (limit->session != NULL) {
+    ratelimit_tokens(limit->session);
+    limit->session->tokens -= (double)n;
+  }
+  if (limit->user != NULL) {
+    ratelimit_tokens(limit->user);
+    limit->user->tokens -= (double)n;
+  }
+}
+
+// time until the bucket is out of debt
+static uint64_t debt_ms(rate_bucket_t *bucket) {
+  if (bucket == NULL) return 0;
+  double tokens = ratelimit_tokens(bucket);
+  if (tokens >= 0) return 0;
+  return (uint64_t)(-tokens * 1000 / bucket->rate) + 1;
+}
+
+bool ratelimit_ready(rate_limit_t *limit) {
+  if (limit->timer == NULL) return true;
+  uint64_t wait = debt_ms(limit->session);
+  uint64_t user_wait = debt_ms(limit->user);
+  if (user_wait > wait) wait = user_wait;
+
+  uint64_t now = uv_now(rate_loop);
+  if (wait == 0) {
+    if (limit->paused_at > 0) {
+      limit->throttled_ms += now - limit->paused_at;
+      limit->paused_at = 0;
+    }
+    return true;
+  }
+  // the pty stays unread meanwhile, so the command blocks on a full pty instead of ttyd buffering for it
+  if (limit->paused_at == 0) {
+    limit->paused_at = now;
+    limit->throttled++;
+  }
+  uv_timer_start(limit->timer, timer_cb, wait, 0);
+  return false;
+}
+
+rate_bucket_t *ratelimit_users() { return users; }
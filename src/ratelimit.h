@@ -0,0 +1,47 @@
+#ifndef TTYD_RATELIMIT_H
+#define TTYD_RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// a token bucket over output bytes, tokens go negative when a read overdraws it
+typedef struct rate_bucket_ {
+  double tokens;
+  double rate;  // bytes per second, also the burst size
+  uint64_t updated;
+  char user[30];  // per user buckets only
+  int refs;
+  struct rate_bucket_ *next;
+} rate_bucket_t;
+
+typedef void (*ratelimit_resume_cb)(void *data);
+
+// output limits of one session, embedded in its connection
+typedef struct {
+  rate_bucket_t *session;  // NULL without --rate-limit
+  rate_bucket_t *user;     // shared by the sessions of a user, NULL without --user-rate-limit
+  uv_timer_t *timer;       // resumes reading once the debt is paid off
+  uint64_t throttled;      // times reads were paused
+  uint64_t throttled_ms;   // time spent paused
+  uint64_t paused_at;
+  ratelimit_resume_cb resume;
+  void *data;
+} rate_limit_t;
+
+// bytes per second for every session and for all sessions of a user together, 0: unlimited
+void ratelimit_config(uv_loop_t *loop, uint64_t session_rate, uint64_t user_rate);
+
+void ratelimit_init(rate_limit_t *limit, const char *user, ratelimit_resume_cb resume, void *data);
+void ratelimit_free(rate_limit_t *limit);
+// n bytes were read from the pty
+void ratelimit_consume(rate_limit_t *limit, size_t n);
+// true if the pty may be read again, otherwise resume is called once it may
+bool ratelimit_ready(rate_limit_t *limit);
+// tokens left in a bucket right now
+double ratelimit_tokens(rate_bucket_t *bucket);
+// the per user buckets, for metrics
+rate_bucket_t *ratelimit_users();
+
+#endif  // TTYD_RATELIMIT_H
@@ -0,0 +1,290 @@
+#include "remote.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sessiond.h"
+#include "ticket.h"
+#include "utils.h"
+
+// the daemon is local, it answers a spawn or attach right away; the loop waits at most this long
+#define REMOTE_TIMEOUT_S 5
+// output handed to read_cb at once, like a pty read
+#define REMOTE_READ_MAX 65536
+
+struct remote {
+  uv_pipe_t pipe;    // first, its close callback frees the struct
+  sessiond_reader_t reader;
+  uint64_t offset;   // session output offset of the next byte read
+  bool draining;     // killed: output goes nowhere until the exit arrives
+  bool eof;          // the daemon closed the connection, what it sent before may still be in reader
+  bool exited;
+};
+
+static void async_free_cb(uv_handle_t *handle) { free(handle->data); }
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static void write_cb(uv_write_t *req, int status) {
+  free(req->data);
+  free(req);
+}
+
+static int send_frame(struct remote *r, char type, const void *data, size_t len, const void *extra,
+                      size_t extra_len) {
+  uv_buf_t b = sessiond_frame(type, data, len, extra, extra_len);
+  uv_write_t *req = xmalloc(sizeof(uv_write_t));
+  req->data = b.base;
+  int err = uv_write(req, (uv_stream_t *)&r->pipe, &b, 1, write_cb);
+  if (err != 0) {
+    free(b.base);
+    free(req);
+  }
+  return err;
+}
+
+// connect, send the spawn or attach frame and wait for the reply, returns the connected fd or -1
+static int handshake(const char *path, char type, const char *payload, size_t len, int32_t *pid, uint64_t *offset,
+                     char *id) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  struct timeval tv = {REMOTE_TIMEOUT_S, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    lwsl_err("sessiond: connect %s: %d (%s)\n", path, errno, strerror(errno));
+    goto failed;
+  }
+
+  uv_buf_t b = sessiond_frame(type, payload, len, NULL, 0);
+  bool sent = send(fd, b.base, b.len, MSG_NOSIGNAL) == (ssize_t)b.len;
+  free(b.base);
+  if (!sent) goto failed;
+
+  char hdr[SESSIOND_HDR];
+  uint32_t n;
+  if (recv(fd, hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr)) goto failed;
+  memcpy(&n, hdr + 1, sizeof(n));
+  char reply[256];
+  if (n >= sizeof(reply) || recv(fd, reply, n, MSG_WAITALL) != (ssize_t)n) goto failed;
+  reply[n] = '\0';
+  if (hdr[0] != SESSIOND_SESSION || n < sizeof(int32_t) + sizeof(uint64_t)) {
+    lwsl_warn("sessiond: %s\n", hdr[0] == SESSIOND_ERROR ? reply : "unexpected reply");
+    goto failed;
+  }
+  memcpy(pid, reply, sizeof(int32_t));
+  memcpy(offset, reply + sizeof(int32_t), sizeof(uint64_t));
+  snprintf(id, TICKET_LEN, "%s", reply + sizeof(int32_t) + sizeof(uint64_t));
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) goto failed;
+  return fd;
+
+failed:
+  close(fd);
+  return -1;
+}
+
+static void deliver(pty_process *process);
+
+static void async_cb(uv_async_t *async) { deliver((pty_process *)async->data); }
+
+static void alloc_cb(uv_handle_t *unused, size_t suggested_size, uv_buf_t *buf) {
+  buf->base = xmalloc(suggested_size);
+  buf->len = suggested_size;
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
+  pty_process *process = (pty_process *)stream->data;
+  struct remote *r = process->remote;
+  if (n > 0) sessiond_feed(&r->reader, buf->base, (size_t)n);
+  free(buf->base);
+  if (n < 0) {
+    uv_read_stop(stream);
+    r->eof = true;
+  }
+  if (n != 0) deliver(process);
+}
+
+// the frames read so far: output goes to read_cb, the exit to exit_cb once the output before it was taken
+static void deliver(pty_process *process) {
+  struct remote *r = process->remote;
+  if (process->paused && !r->draining) return;
+
+  pty_buf_t *buf = NULL;
+  char type;
+  char *payload;
+  uint32_t len;
+  while (!r->exited && sessiond_next(&r->reader, &type, &payload, &len)) {
+    if (type == SESSIOND_OUTPUT) {
+      r->offset += len;
+      if (r->draining || len == 0) continue;
+      if (buf == NULL) {
+        buf = pty_buf_init(payload, len);
+      } else {
+        buf->base = xrealloc(buf->base, buf->len + len);
+        memcpy(buf->base + buf->len, payload, len);
+        buf->len += len;
+      }
+      if (buf->len >= REMOTE_READ_MAX) break;
+    } else if (type == SESSIOND_EXIT && len >= 2 * sizeof(int32_t)) {
+      int32_t status[2];
+      memcpy(status, payload, sizeof(status));
+      process->exit_code = status[0];
+      process->exit_signal = status[1];
+      r->exited = true;
+    }
+  }
+
+  if (buf != NULL) {
+    // like a pty read, the next one waits for pty_resume()
+    remote_pause(process);
+    process->read_cb(process, buf, false);
+    return;
+  }
+  if (!r->exited && !r->eof) return;
+  if (!r->exited) {
+    // every frame before the close was taken, none of them the exit
+    lwsl_warn("sessiond: lost session, pid: %d\n", process->pid);
+    r->exited = true;
+  }
+
+  uv_read_stop((uv_stream_t *)&r->pipe);
+  process->exit_cb(process);
+  uv_close((uv_handle_t *)&process->async, async_free_cb);
+  process_free(process);
+}
+
+static int remote_open(pty_process *process, int fd, int32_t pid, uint64_t offset, pty_read_cb read_cb,
+                       pty_exit_cb exit_cb) {
+  struct remote *r = xmalloc(sizeof(struct remote));
+  memset(r, 0, sizeof(struct remote));
+  uv_pipe_init(process->loop, &r->pipe, 0);
+  if (uv_pipe_open(&r->pipe, fd) != 0) {
+    close(fd);
+    uv_close((uv_handle_t *)&r->pipe, close_cb);
+    return -1;
+  }
+  r->pipe.data = process;
+  r->offset = offset;
+
+  process->remote = r;
+  process->pid = pid;
+  process->paused = true;
+  process->read_cb = read_cb;
+  process->exit_cb = exit_cb;
+  process->async.data = process;
+  uv_async_init(process->loop, &process->async, async_cb);
+  return 0;
+}
+
+int remote_spawn(pty_process *process, const char *path, const char *user, uint32_t linger, char *id,
+                 pty_read_cb read_cb, pty_exit_cb exit_cb) {
+  const char *cwd = process->cwd != NULL ? process->cwd : "";
+  size_t len = 8 + strlen(user) + 1 + strlen(cwd) + 1 + 1;
+  for (char **p = process->argv; *p != NULL; p++) len += strlen(*p) + 1;
+  for (char **p = process->envp; p != NULL && *p != NULL; p++) len += strlen(*p) + 1;
+
+  char *payload = xmalloc(len);
+  memcpy(payload, &process->columns, sizeof(uint16_t));
+  memcpy(payload + 2, &process->rows, sizeof(uint16_t));
+  memcpy(payload + 4, &linger, sizeof(uint32_t));
+  char *q = payload + 8;
+  q = stpcpy(q, user) + 1;
+  q = stpcpy(q, cwd) + 1;
+  for (char **p = process->argv; *p != NULL; p++) q = stpcpy(q, *p) + 1;
+  *q++ = '\0';
+  for (char **p = process->envp; p != NULL && *p != NULL; p++) q = stpcpy(q, *p) + 1;
+
+  int32_t pid;
+  uint64_t offset;
+  int fd = handshake(path, SESSIOND_SPAWN, payload, len, &pid, &offset, id);
+  free(payload);
+  if (fd < 0) return -1;
+  return remote_open(process, fd, pid, offset, read_cb, exit_cb);
+}
+
+int remote_attach(pty_process *process, const char *path, const char *id, const char *user, pty_read_cb read_cb,
+                  pty_exit_cb exit_cb) {
+  size_t len = 4 + strlen(id) + 1 + strlen(user) + 1;
+  char *payload = xmalloc(len);
+  memcpy(payload, &process->columns, sizeof(uint16_t));
+  memcpy(payload + 2, &process->rows, sizeof(uint16_t));
+  stpcpy(stpcpy(payload + 4, id) + 1, user);
+
+  int32_t pid;
+  uint64_t offset;
+  char reply_id[TICKET_LEN];
+  int fd = handshake(path, SESSIOND_ATTACH, payload, len, &pid, &offset, reply_id);
+  free(payload);
+  if (fd < 0) return -1;
+  return remote_open(process, fd, pid, offset, read_cb, exit_cb);
+}
+
+void remote_detach(pty_process *process, size_t unsent) {
+  struct remote *r = process->remote;
+  uint64_t offset = r->offset - (unsent < r->offset ? unsent : r->offset);
+  uv_buf_t b = sessiond_frame(SESSIOND_DETACH, &offset, sizeof(offset), NULL, 0);
+  // best effort, without it the daemon takes everything it sent as seen
+  uv_try_write((uv_stream_t *)&r->pipe, &b, 1);
+  free(b.base);
+  uv_close((uv_handle_t *)&process->async, async_free_cb);
+  process_free(process);
+}
+
+void remote_pause(pty_process *process) {
+  process->paused = true;
+  uv_read_stop((uv_stream_t *)&process->remote->pipe);
+}
+
+void remote_resume(pty_process *process) {
+  struct remote *r = process->remote;
+  process->paused = false;
+  if (!r->exited && !r->eof) uv_read_start((uv_stream_t *)&r->pipe, alloc_cb, read_cb);
+  // frames left over from the last read go out without waiting for more
+  uv_async_send(&process->async);
+}
+
+int remote_write(pty_process *process, pty_buf_t *buf) {
+  int err = send_frame(process->remote, SESSIOND_INPUT, buf->base, buf->len, NULL, 0);
+  pty_buf_free(buf);
+  return err;
+}
+
+bool remote_resize(pty_process *process) {
+  uint16_t size[2] = {process->columns, process->rows};
+  return send_frame(process->remote, SESSIOND_RESIZE, size, sizeof(size), NULL, 0) == 0;
+}
+
+bool remote_kill(pty_process *process, int sig) {
+  struct remote *r = process->remote;
+  int32_t s = sig;
+  bool ok = r->exited || r->eof || send_frame(r, SESSIOND_KILL, &s, sizeof(s), NULL, 0) == 0;
+  if (sig == SIGSTOP || sig == SIGCONT) return ok;
+  // nobody reads a killed session anymore, its exit must still come through
+  r->draining = true;
+  remote_resume(process);
+  return ok;
+}
+
+bool remote_running(pty_process *process) { return !process->remote->exited; }
+
+void remote_free(pty_process *process) {
+  struct remote *r = process->remote;
+  sessiond_reader_free(&r->reader);
+  uv_close((uv_handle_t *)&r->pipe, close_cb);
+  process->remote = NULL;
+}
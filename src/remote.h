@@ -0,0 +1,31 @@
+#ifndef TTYD_REMOTE_H
+#define TTYD_REMOTE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pty.h"
+
+// a process running in the session daemon (--sessiond), driven through the same pty_* functions
+
+// start process->argv in a new session of the daemon listening at path, the daemon keeps it for linger
+// seconds once detached; id (TICKET_LEN) gets the session id, returns 0 on success
+int remote_spawn(pty_process *process, const char *path, const char *user, uint32_t linger, char *id,
+                 pty_read_cb read_cb, pty_exit_cb exit_cb);
+// take over session id of the daemon, returns 0 if it exists and belongs to user
+int remote_attach(pty_process *process, const char *path, const char *id, const char *user, pty_read_cb read_cb,
+                  pty_exit_cb exit_cb);
+// let go of the session, the daemon keeps it for the next frontend that attaches, unsent is the output
+// read that the client did not get; frees process, its exit_cb never comes
+void remote_detach(pty_process *process, size_t unsent);
+
+void remote_pause(pty_process *process);
+void remote_resume(pty_process *process);
+int remote_write(pty_process *process, pty_buf_t *buf);
+bool remote_resize(pty_process *process);
+bool remote_kill(pty_process *process, int sig);
+bool remote_running(pty_process *process);
+void remote_free(pty_process *process);
+
+#endif  // TTYD_REMOTE_H
@@ -0,0 +1,633 @@
+#include "router.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libwebsockets.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "utils.h"
+
+// backends report this often, one that missed a few reports gets no connections
+#define ROUTER_REPORT_INTERVAL_MS 1000
+#define ROUTER_REPORT_TTL_MS 3000
+// a report is one datagram, sessions that do not fit are left out
+#define ROUTER_REPORT_MAX 60000
+// a client without a session goes back to the backend it was sent to, until it stayed away this long
+#define ROUTER_AFFINITY_MS 60000
+// the request head is read to route the connection, it has to fit
+#define ROUTER_HEAD_MAX 8192
+// bytes moved at once, what a pipe holds by default
+#define ROUTER_CHUNK 65536
+
+extern pty_ctx_t *process_sessions();
+
+struct backend {
+  char *name;  // as given to --router
+  struct sockaddr_in addr;
+  uint64_t reported_at;  // 0: never
+  bool down;             // a connect failed since its last report
+  int sessions;          // reported
+  int routed;            // new clients sent to it since
+  uint64_t *ids;         // hashes of the resume ids of its sessions, sorted
+  int id_count;
+  char **users;  // users with sessions on it
+  int user_count;
+};
+
+// where a user or client address went last, its next connections follow
+struct affinity {
+  char key[64];
+  struct backend *backend;
+  uint64_t expires_at;
+  struct affinity *next;
+};
+
+// one direction of a proxied connection: bytes move from `from` to `to` through a pipe with splice(2),
+// without coming to user space, or through buf where there is no splice
+struct flow {
+  int from, to;
+#ifdef __linux__
+  int pipe[2];
+#else
+  char *buf;
+  size_t off;
+#endif
+  size_t pending;  // bytes read from `from`, not yet written to `to`
+  bool eof;        // `from` sent all it had
+  bool shut;       // and `to` was told so
+};
+
+struct rconn {
+  int client, backend_fd;
+  uv_poll_t *client_poll, *backend_poll;
+  int handles;  // poll handles not closed yet, the connection is freed with the last one
+  bool closing;
+  enum { READING_HEAD, CONNECTING, PROXYING } state;
+  char head[ROUTER_HEAD_MAX];
+  size_t head_len;
+  char addr[INET6_ADDRSTRLEN];
+  char id[64];    // ?resume= of the request
+  char user[30];  // its auth header, as a ttyd would take it
+  struct backend *backend;
+  struct flow up, down;  // client to backend, backend to client
+};
+
+static struct {
+  uv_loop_t *loop;
+  struct backend *backends;
+  int count;
+  struct affinity *affinity;
+  char *auth_header;  // without the colon
+  int listen_fd;
+  uv_poll_t listen_poll;
+  uv_udp_t udp;
+} router = {.listen_fd = -1};
+
+static struct {
+  bool active;
+  int port;
+  struct sockaddr_in target;
+  uv_udp_t udp;
+  uv_timer_t timer;
+} report;
+
+// resume ids travel hashed, a report tells where a session is without handing out what resumes it
+static uint64_t id_hash(const char *id) {
+  uint64_t h = 14695981039346656037ULL;
+  for (const char *p = id; *p != '\0'; p++) h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+  return h;
+}
+
+static bool parse_addr(const char *s, struct sockaddr_in *addr) {
+  char host[INET_ADDRSTRLEN];
+  const char *colon = strrchr(s, ':');
+  if (colon == NULL || colon == s || (size_t)(colon - s) >= sizeof(host)) return false;
+  int port = atoi(colon + 1);
+  if (port <= 0 || port > 65535) return false;
+  memcpy(host, s, colon - s);
+  host[colon - s] = '\0';
+  return uv_ip4_addr(host, port, addr) == 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static bool backend_live(struct backend *b) {
+  return b->reported_at > 0 && !b->down && uv_now(router.loop) - b->reported_at < ROUTER_REPORT_TTL_MS;
+}
+
+static void backend_failed(struct backend *b) {
+  if (!b->down) lwsl_warn("router: backend %s is down\n", b->name);
+  b->down = true;
+}
+
+// a backend reporting: "ttyd-report 1", "port <port>", "sessions <count>", then "s <id hash|-> <user>" per session
+static void udp_recv_cb(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr,
+                        unsigned flags) {
+  if (nread <= 0 || addr == NULL || addr->sa_family != AF_INET) return;
+  char *data = buf->base;
+  data[nread] = '\0';
+  int version, port, sessions;
+  if (sscanf(data, "ttyd-report %d\nport %d\nsessions %d\n", &version, &port, &sessions) != 3 || version != 1) return;
+
+  const struct sockaddr_in *from = (const struct sockaddr_in *)addr;
+  struct backend *b = NULL;
+  for (int i = 0; i < router.count && b == NULL; i++) {
+    struct sockaddr_in *a = &router.backends[i].addr;
+    if (a->sin_addr.s_addr == from->sin_addr.s_addr && ntohs(a->sin_port) == port) b = &router.backends[i];
+  }
+  if (b == NULL) return;
+  if (!backend_live(b)) lwsl_notice("router: backend %s is up, sessions: %d\n", b->name, sessions);
+
+  free(b->ids);
+  for (int i = 0; i < b->user_count; i++) free(b->users[i]);
+  free(b->users);
+  b->ids = NULL;
+  b->users = NULL;
+  b->id_count = b->user_count = 0;
+
+  char *save = NULL;
+  for (char *line = strtok_r(data, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+    char hash[17];
+    int n = 0;
+    if (sscanf(line, "s %16s %n", hash, &n) != 1 || n == 0) continue;
+    if (hash[0] != '-') {
+      b->ids = xrealloc(b->ids, (b->id_count + 1) * sizeof(uint64_t));
+      b->ids[b->id_count++] = strtoull(hash, NULL, 16);
+    }
+    const char *user = line + n;
+    if (*user == '\0') continue;
+    bool known = false;
+    for (int i = 0; i < b->user_count && !known; i++) known = strcmp(b->users[i], user) == 0;
+    if (known) continue;
+    b->users = xrealloc(b->users, (b->user_count + 1) * sizeof(char *));
+    b->users[b->user_count++] = strdup(user);
+  }
+  if (b->id_count > 1) qsort(b->ids, b->id_count, sizeof(uint64_t), compare_ids);
+
+  b->sessions = sessions;
+  b->routed = 0;
+  b->down = false;
+  b->reported_at = uv_now(router.loop);
+}
+
+static void udp_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  static char data[ROUTER_REPORT_MAX + 1];
+  buf->base = data;
+  buf->len = ROUTER_REPORT_MAX;
+}
+
+static struct affinity *affinity_find(const char *key) {
+  uint64_t now = uv_now(router.loop);
+  struct affinity **p = &router.affinity;
+  while (*p != NULL) {
+    struct affinity *a = *p;
+    if (a->expires_at <= now) {
+      *p = a->next;
+      free(a);
+      continue;
+    }
+    if (strcmp(a->key, key) == 0) return a;
+    p = &a->next;
+  }
+  return NULL;
+}
+
+static void affinity_set(const char *key, struct backend *b) {
+  struct affinity *a = affinity_find(key);
+  if (a == NULL) {
+    a = xmalloc(sizeof(struct affinity));
+    snprintf(a->key, sizeof(a->key), "%s", key);
+    a->next = router.affinity;
+    router.affinity = a;
+  }
+  a->backend = b;
+  a->expires_at = uv_now(router.loop) + ROUTER_AFFINITY_MS;
+}
+
+// the backend with the session the client resumes, else the one with the user's sessions, else the one
+// the client went to last, else the least loaded
+static struct backend *route(struct rconn *c) {
+  if (c->id[0] != '\0') {
+    uint64_t h = id_hash(c->id);
+    for (int i = 0; i < router.count; i++) {
+      struct backend *b = &router.backends[i];
+      if (backend_live(b) && bsearch(&h, b->ids, b->id_count, sizeof(uint64_t), compare_ids) != NULL) return b;
+    }
+  }
+
+  char key[64];
+  if (c->user[0] != '\0') {
+    snprintf(key, sizeof(key), "user %s", c->user);
+  } else {
+    snprintf(key, sizeof(key), "addr %s", c->addr);
+  }
+  struct backend *b = NULL;
+  for (int i = 0; i < router.count && b == NULL && c->user[0] != '\0'; i++) {
+    struct backend *candidate = &router.backends[i];
+    if (!backend_live(candidate)) continue;
+    for (int j = 0; j < candidate->user_count && b == NULL; j++) {
+      if (strcmp(candidate->users[j], c->user) == 0) b = candidate;
+    }
+  }
+  if (b == NULL) {
+    struct affinity *a = affinity_find(key);
+    if (a != NULL && backend_live(a->backend)) b = a->backend;
+  }
+  if (b == NULL) {
+    for (int i = 0; i < router.count; i++) {
+      struct backend *candidate = &router.backends[i];
+      if (!backend_live(candidate)) continue;
+      if (b == NULL || candidate->sessions + candidate->routed < b->sessions + b->routed) b = candidate;
+    }
+    // counts until its next report says how many sessions it really got
+    if (b != NULL) b->routed++;
+  }
+  if (b != NULL) affinity_set(key, b);
+  return b;
+}
+
+// the resume id and the user of the request, the connection is routed by them
+static void parse_head(struct rconn *c) {
+  char *eol = strstr(c->head, "\r\n");
+  for (char *q = memchr(c->head, '?', eol - c->head); q != NULL && q < eol; q = strpbrk(q, "& ")) {
+    if (*q == ' ') break;
+    q++;
+    if (strncmp(q, "resume=", 7) != 0) continue;
+    size_t n = strcspn(q + 7, "& \r");
+    if (n < sizeof(c->id)) {
+      memcpy(c->id, q + 7, n);
+      c->id[n] = '\0';
+    }
+    break;
+  }
+
+  if (router.auth_header == NULL) return;
+  size_t name_len = strlen(router.auth_header);
+  for (char *line = eol + 2; strncmp(line, "\r\n", 2) != 0; line = strstr(line, "\r\n") + 2) {
+    if (strncasecmp(line, router.auth_header, name_len) != 0 || line[name_len] != ':') continue;
+    char *value = line + name_len + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    size_t n = strcspn(value, "\r");
+    if (n >= sizeof(c->user)) n = sizeof(c->user) - 1;
+    memcpy(c->user, value, n);
+    c->user[n] = '\0';
+    break;
+  }
+}
+
+static void poll_close_cb(uv_handle_t *handle) {
+  struct rconn *c = (struct rconn *)handle->data;
+  free(handle);
+  if (--c->handles == 0 && c->closing) free(c);
+}
+
+static void flow_free(struct flow *f) {
+#ifdef __linux__
+  if (f->pipe[0] >= 0) close(f->pipe[0]);
+  if (f->pipe[1] >= 0) close(f->pipe[1]);
+#else
+  free(f->buf);
+#endif
+}
+
+static void conn_close(struct rconn *c) {
+  if (c->closing) return;
+  c->closing = true;
+  uv_close((uv_handle_t *)c->client_poll, poll_close_cb);
+  close(c->client);
+  if (c->backend_poll != NULL) {
+    uv_close((uv_handle_t *)c->backend_poll, poll_close_cb);
+    close(c->backend_fd);
+  }
+  flow_free(&c->up);
+  flow_free(&c->down);
+}
+
+static void reply_close(struct rconn *c, const char *status) {
+  char buf[128];
+  int n = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+  send(c->client, buf, n, MSG_NOSIGNAL);
+  conn_close(c);
+}
+
+static bool flow_init(struct flow *f, int from, int to) {
+  f->from = from;
+  f->to = to;
+#ifdef __linux__
+  return pipe2(f->pipe, O_CLOEXEC | O_NONBLOCK) == 0;
+#else
+  f->buf = xmalloc(ROUTER_CHUNK);
+  return true;
+#endif
+}
+
+// read what `from` has, false on an error
+static bool flow_fill(struct flow *f) {
+  if (f->pending > 0 || f->eof) return true;
+#ifdef __linux__
+  ssize_t n = splice(f->from, NULL, f->pipe[1], NULL, ROUTER_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+  ssize_t n = recv(f->from, f->buf, ROUTER_CHUNK, 0);
+  f->off = 0;
+#endif
+  if (n < 0) return errno == EAGAIN || errno == EINTR;
+  if (n == 0) f->eof = true;
+  f->pending += (size_t)n;
+  return true;
+}
+
+// write what was read to `to` as far as it takes it, false on an error
+static bool flow_drain(struct flow *f) {
+  while (f->pending > 0) {
+#ifdef __linux__
+    ssize_t n = splice(f->pipe[0], NULL, f->to, NULL, f->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    ssize_t n = send(f->to, f->buf + f->off, f->pending, 0);
+#endif
+    if (n < 0) return errno == EAGAIN || errno == EINTR;
+    f->pending -= (size_t)n;
+#ifndef __linux__
+    f->off += (size_t)n;
+#endif
+  }
+  if (f->eof && !f->shut) {
+    shutdown(f->to, SHUT_WR);
+    f->shut = true;
+  }
+  return true;
+}
+
+static void client_cb(uv_poll_t *handle, int status, int events);
+static void backend_cb(uv_poll_t *handle, int status, int events);
+
+static void poll_set(uv_poll_t *handle, int events, uv_poll_cb cb) {
+  if (events == 0) {
+    uv_poll_stop(handle);
+  } else {
+    uv_poll_start(handle, events, cb);
+  }
+}
+
+// each side is read while its flow is empty and written while the other flow has bytes for it
+static void proxy_update(struct rconn *c) {
+  if (c->up.shut && c->down.shut) {
+    conn_close(c);
+    return;
+  }
+  int client_events = 0, backend_events = 0;
+  if (c->up.pending == 0 && !c->up.eof) client_events |= UV_READABLE;
+  if (c->down.pending > 0) client_events |= UV_WRITABLE;
+  if (c->down.pending == 0 && !c->down.eof) backend_events |= UV_READABLE;
+  if (c->up.pending > 0) backend_events |= UV_WRITABLE;
+  poll_set(c->client_poll, client_events, client_cb);
+  poll_set(c->backend_poll, backend_events, backend_cb);
+}
+
+static void proxy_io(struct rconn *c, struct flow *in, struct flow *out, int events) {
+  bool ok = true;
+  if (events & UV_READABLE) ok = flow_fill(in) && flow_drain(in);
+  if (ok && (events & UV_WRITABLE)) ok = flow_drain(out);
+  if (!ok) {
+    conn_close(c);
+    return;
+  }
+  proxy_update(c);
+}
+
+static void start_proxy(struct rconn *c) {
+  if (!flow_init(&c->up, c->client, c->backend_fd) || !flow_init(&c->down, c->backend_fd, c->client)) {
+    conn_close(c);
+    return;
+  }
+  // the head read to route the connection goes first
+#ifdef __linux__
+  ssize_t n = write(c->up.pipe[1], c->head, c->head_len);
+  if (n != (ssize_t)c->head_len) {
+    conn_close(c);
+    return;
+  }
+#else
+  memcpy(c->up.buf, c->head, c->head_len);
+#endif
+  c->up.pending = c->head_len;
+  c->state = PROXYING;
+  lwsl_info("router: %s -> %s\n", c->addr, c->backend->name);
+  proxy_update(c);
+}
+
+static void connect_backend(struct rconn *c) {
+  for (;;) {
+    struct backend *b = route(c);
+    if (b == NULL) {
+      reply_close(c, "502 Bad Gateway");
+      return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+      reply_close(c, "502 Bad Gateway");
+      return;
+    }
+    if (connect(fd, (struct sockaddr *)&b->addr, sizeof(b->addr)) != 0 && errno != EINPROGRESS) {
+      close(fd);
+      backend_failed(b);
+      continue;
+    }
+    c->backend = b;
+    c->backend_fd = fd;
+    c->backend_poll = xmalloc(sizeof(uv_poll_t));
+    uv_poll_init(router.loop, c->backend_poll, fd);
+    c->backend_poll->data = c;
+    c->handles++;
+    c->state = CONNECTING;
+    uv_poll_start(c->backend_poll, UV_WRITABLE, backend_cb);
+    return;
+  }
+}
+
+static void read_head(struct rconn *c) {
+  ssize_t n = recv(c->client, c->head + c->head_len, ROUTER_HEAD_MAX - 1 - c->head_len, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+  if (n <= 0) {
+    conn_close(c);
+    return;
+  }
+  c->head_len += (size_t)n;
+  c->head[c->head_len] = '\0';
+  if (strstr(c->head, "\r\n\r\n") == NULL) {
+    if (c->head_len == ROUTER_HEAD_MAX - 1) reply_close(c, "431 Request Header Fields Too Large");
+    return;
+  }
+  parse_head(c);
+  uv_poll_stop(c->client_poll);
+  connect_backend(c);
+}
+
+static void client_cb(uv_poll_t *handle, int status, int events) {
+  struct rconn *c = (struct rconn *)handle->data;
+  if (status < 0) {
+    conn_close(c);
+    return;
+  }
+  if (c->state == READING_HEAD) {
+    read_head(c);
+    return;
+  }
+  proxy_io(c, &c->up, &c->down, events);
+}
+
+static void backend_cb(uv_poll_t *handle, int status, int events) {
+  struct rconn *c = (struct rconn *)handle->data;
+  if (c->state == CONNECTING) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (status >= 0 && getsockopt(c->backend_fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+      start_proxy(c);
+      return;
+    }
+    // try the next one, this one is left out until it reports again
+    backend_failed(c->backend);
+    uv_close((uv_handle_t *)c->backend_poll, poll_close_cb);
+    close(c->backend_fd);
+    c->backend_poll = NULL;
+    c->backend_fd = -1;
+    connect_backend(c);
+    return;
+  }
+  if (status < 0) {
+    conn_close(c);
+    return;
+  }
+  proxy_io(c, &c->down, &c->up, events);
+}
+
+static void accept_cb(uv_poll_t *handle, int status, int events) {
+  if (status < 0) return;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = accept4(router.listen_fd, (struct sockaddr *)&addr, &len, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0) return;
+
+  struct rconn *c = xmalloc(sizeof(struct rconn));
+  memset(c, 0, sizeof(struct rconn));
+  c->client = fd;
+  c->backend_fd = -1;
+#ifdef __linux__
+  c->up.pipe[0] = c->up.pipe[1] = c->down.pipe[0] = c->down.pipe[1] = -1;
+#endif
+  uv_ip4_name(&addr, c->addr, sizeof(c->addr));
+  c->client_poll = xmalloc(sizeof(uv_poll_t));
+  uv_poll_init(router.loop, c->client_poll, fd);
+  c->client_poll->data = c;
+  c->handles = 1;
+  uv_poll_start(c->client_poll, UV_READABLE, client_cb);
+}
+
+int router_run(uv_loop_t *loop, int port, const char *backends, const char *auth_header) {
+  router.loop = loop;
+  char *list = strdup(backends);
+  char *save = NULL;
+  for (char *name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+    router.backends = xrealloc(router.backends, (router.count + 1) * sizeof(struct backend));
+    struct backend *b = &router.backends[router.count++];
+    memset(b, 0, sizeof(struct backend));
+    b->name = strdup(name);
+    if (!parse_addr(name, &b->addr)) {
+      lwsl_err("router: invalid backend: %s, format: <ipv4>:<port>\n", name);
+      return 1;
+    }
+  }
+  free(list);
+  if (router.count == 0) {
+    lwsl_err("router: no backends\n");
+    return 1;
+  }
+  if (auth_header != NULL) {
+    router.auth_header = strdup(auth_header);
+    size_t n = strlen(router.auth_header);
+    if (n > 0 && router.auth_header[n - 1] == ':') router.auth_header[n - 1] = '\0';
+  }
+  // a client or backend going away mid-splice must not take the router with it
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_in addr;
+  uv_ip4_addr("0.0.0.0", port, &addr);
+  int on = 1;
+  router.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (router.listen_fd < 0 || setsockopt(router.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(router.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(router.listen_fd, 511) != 0) {
+    lwsl_err("router: can not listen on port %d: %s\n", port, strerror(errno));
+    return 1;
+  }
+  uv_poll_init(loop, &router.listen_poll, router.listen_fd);
+  uv_poll_start(&router.listen_poll, UV_READABLE, accept_cb);
+
+  // the reports of the backends come in on the same port
+  uv_udp_init(loop, &router.udp);
+  int err = uv_udp_bind(&router.udp, (const struct sockaddr *)&addr, 0);
+  if (err == 0) err = uv_udp_recv_start(&router.udp, udp_alloc_cb, udp_recv_cb);
+  if (err != 0) {
+    lwsl_err("router: can not receive reports on port %d: %s\n", port, uv_strerror(err));
+    return 1;
+  }
+
+  lwsl_notice("ttyd router listening on port %d, backends: %s\n", port, backends);
+  uv_run(loop, UV_RUN_DEFAULT);
+  return 0;
+}
+
+static void report_cb(uv_timer_t *timer) {
+  static char data[ROUTER_REPORT_MAX];
+  int sessions = 0;
+  for (pty_ctx_t *ctx = process_sessions(); ctx != NULL; ctx = ctx->next) {
+    if (ctx->process != NULL && !ctx->ws_closed) sessions++;
+  }
+  size_t len = (size_t)snprintf(data, sizeof(data), "ttyd-report 1\nport %d\nsessions %d\n", report.port, sessions);
+  for (pty_ctx_t *ctx = process_sessions(); ctx != NULL; ctx = ctx->next) {
+    if (ctx->process == NULL || ctx->ws_closed || (ctx->id[0] == '\0' && ctx->user[0] == '\0')) continue;
+    char line[64];
+    int n = ctx->id[0] != '\0' ? snprintf(line, sizeof(line), "s %016" PRIx64 " %s\n", id_hash(ctx->id), ctx->user)
+                               : snprintf(line, sizeof(line), "s - %s\n", ctx->user);
+    if (len + (size_t)n >= sizeof(data)) break;
+    memcpy(data + len, line, (size_t)n);
+    len += (size_t)n;
+  }
+  uv_buf_t buf = uv_buf_init(data, (unsigned int)len);
+  uv_udp_try_send(&report.udp, &buf, 1, (const struct sockaddr *)&report.target);
+}
+
+bool router_report_init(uv_loop_t *loop, const char *target, int port) {
+  if (!parse_addr(target, &report.target)) {
+    lwsl_err("invalid router address: %s, format: <ipv4>:<port>\n", target);
+    return false;
+  }
+  if (port <= 0) {
+    lwsl_err("the router can only pass connections to a tcp port\n");
+    return false;
+  }
+  report.port = port;
+  uv_udp_init(loop, &report.udp);
+  uv_timer_init(loop, &report.timer);
+  uv_timer_start(&report.timer, report_cb, 0, ROUTER_REPORT_INTERVAL_MS);
+  report.active = true;
+  return true;
+}
+
+void router_report_close() {
+  if (!report.active) return;
+  uv_timer_stop(&report.timer);
+  uv_close((uv_handle_t *)&report.timer, NULL);
+  uv_close((uv_handle_t *)&report.udp, NULL);
+  report.active = false;
+}
@@ -0,0 +1,17 @@
+#ifndef TTYD_ROUTER_H
+#define TTYD_ROUTER_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+// --router: route http and websocket connections on port to the backend ttyds in backends
+// ("host:port,..."), by the resume id of a session, the user (auth_header, the --auth-header name
+// or NULL), or the client address, new clients go to the least loaded backend; runs until killed
+int router_run(uv_loop_t *loop, int port, const char *backends, const char *auth_header);
+
+// --router-report: tell the router at target ("host:port") every second how loaded this ttyd
+// listening on port is, and which sessions and users it has
+bool router_report_init(uv_loop_t *loop, const char *target, int port);
+void router_report_close();
+
+#endif  // TTYD_ROUTER_H
@@ -0,0 +1,188 @@
+#include "sched.h"
+
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// output this small is an echo or a prompt, it never waits for the round
+#define SCHED_SMALL 512
+// output this soon after input is its echo, it goes ahead of the round, but only for one quantum
+#define SCHED_INTERACTIVE_MS 100
+#define SCHED_QUANTUM 16384
+#define SCHED_WEIGHT_MAX 64
+
+typedef struct sched_weight_ {
+  char user[30];
+  int weight;
+  struct sched_weight_ *next;
+} sched_weight_t;
+
+static uv_loop_t *sched_loop = NULL;
+static uv_idle_t *round_idle = NULL;
+static size_t quantum = SCHED_QUANTUM;
+static sched_weight_t *weights = NULL;
+static sched_entry_t *entries = NULL;
+static sched_entry_t *run_head = NULL;
+static sched_entry_t *run_tail = NULL;
+
+static void entry_wake(sched_entry_t *entry, size_t credit) {
+  entry->credit = credit;
+  entry->granted = true;
+  entry->wake(entry->data);
+}
+
+// one round: every session that was waiting gets its quantums, the ones that use them up
+// queue again behind the others and go on in the next loop iteration
+static void round_cb(uv_idle_t *handle) {
+  sched_entry_t *entry = run_head;
+  run_head = run_tail = NULL;
+  uv_idle_stop(handle);
+  while (entry != NULL) {
+    sched_entry_t *next = entry->run_next;
+    entry->run_next = NULL;
+    entry->queued = false;
+    entry_wake(entry, quantum * (size_t)entry->weight);
+    entry = next;
+  }
+}
+
+static void run_push(sched_entry_t *entry) {
+  entry->run_next = NULL;
+  entry->queued = true;
+  if (run_tail != NULL)
+    run_tail->run_next = entry;
+  else
+    run_head = entry;
+  run_tail = entry;
+  // an idle handle keeps the loop from blocking in poll while sessions wait for their turn
+  if (round_idle != NULL && !uv_is_active((uv_handle_t *)round_idle)) uv_idle_start(round_idle, round_cb);
+}
+
+static void run_remove(sched_entry_t *entry) {
+  sched_entry_t **link = &run_head, *prev = NULL;
+  while (*link != NULL && *link != entry) {
+    prev = *link;
+    link = &(*link)->run_next;
+  }
+  if (*link == NULL) return;
+  *link = entry->run_next;
+  if (run_tail == entry) run_tail = prev;
+  entry->run_next = NULL;
+  entry->queued = false;
+}
+
+void sched_init(uv_loop_t *loop) {
+  sched_loop = loop;
+  round_idle = xmalloc(sizeof(uv_idle_t));
+  uv_idle_init(loop, round_idle);
+}
+
+void sched_set_quantum(size_t size) { quantum = size; }
+
+bool sched_set_weight(const char *spec) {
+  const char *eq = strrchr(spec, '=');
+  if (eq == NULL || eq == spec || (size_t)(eq - spec) >= sizeof(weights->user)) return false;
+  char *end;
+  long weight = strtol(eq + 1, &end, 10);
+  if (*end != '\0' || weight < 1 || weight > SCHED_WEIGHT_MAX) return false;
+
+  sched_weight_t *w = xmalloc(sizeof(sched_weight_t));
+  memset(w, 0, sizeof(sched_weight_t));
+  memcpy(w->user, spec, (size_t)(eq - spec));
+  w->weight = (int)weight;
+  w->next = weights;
+  weights = w;
+  return true;
+}
+
+static void free_cb(uv_handle_t *handle) { free(handle); }
+
+void sched_close() {
+  if (round_idle != NULL) {
+    uv_idle_stop(round_idle);
+    uv_close((uv_handle_t *)round_idle, free_cb);
+    round_idle = NULL;
+  }
+  while (weights != NULL) {
+    sched_weight_t *next = weights->next;
+    free(weights);
+    weights = next;
+  }
+}
+
+void sched_add(sched_entry_t *entry, const char *user, sched_wake_cb wake, void *data) {
+  memset(entry, 0, sizeof(sched_entry_t));
+  entry->weight = 1;
+  snprintf(entry->user, sizeof(entry->user), "%s", user != NULL ? user : "");
+  for (sched_weight_t *w = weights; w != NULL; w = w->next) {
+    if (strcmp(w->user, entry->user) == 0) {
+      entry->weight = w->weight;
+      break;
+    }
+  }
+  entry->wake = wake;
+  entry->data = data;
+
+  entry->next = entries;
+  if (entries != NULL) entries->prev = entry;
+  entries = entry;
+}
+
+void sched_remove(sched_entry_t *entry) {
+  if (entry->wake == NULL) return;
+  if (entry->queued) run_remove(entry);
+  if (entry->prev != NULL) entry->prev->next = entry->next;
+  if (entry->next != NULL) entry->next->prev = entry->prev;
+  if (entries == entry) entries = entry->next;
+  entry->prev = entry->next = NULL;
+  entry->wake = NULL;
+}
+
+void sched_ready(sched_entry_t *entry, size_t len) {
+  entry->pending += len;
+  if (entry->queued || entry->granted) return;
+  bool interactive = sched_loop != NULL && uv_now(sched_loop) - entry->last_input < SCHED_INTERACTIVE_MS;
+  if (quantum == 0 || entry->pending <= SCHED_SMALL) {
+    entry_wake(entry, entry->pending);
+    return;
+  }
+  // a bulk session that keeps getting input must not bypass the round: what is left after its
+  // quantum queues again in sched_sent() like any other backlog
+  if (interactive) {
+    size_t credit = quantum * (size_t)entry->weight;
+    entry_wake(entry, entry->pending < credit ? entry->pending : credit);
+    return;
+  }
+  run_push(entry);
+}
+
+size_t sched_grant(sched_entry_t *entry) { return entry->granted ? entry->credit : 0; }
+
+void sched_sent(sched_entry_t *entry, size_t n) {
+  entry->sent += n;
+  entry->pending -= n < entry->pending ? n : entry->pending;
+  entry->credit -= n < entry->credit ? n : entry->credit;
+  if (entry->pending == 0) {
+    entry->granted = false;
+    entry->credit = 0;
+  } else if (entry->credit == 0) {
+    entry->granted = false;
+    run_push(entry);
+  }
+}
+
+void sched_pulled(sched_entry_t *entry, size_t n, size_t left) {
+  // the pty is the queue, what it holds now is all that is pending
+  entry->pending = n + left;
+  if (quantum == 0) entry->credit = entry->pending;
+  sched_sent(entry, n);
+}
+
+void sched_input(sched_entry_t *entry) {
+  if (sched_loop != NULL) entry->last_input = uv_now(sched_loop);
+}
+
+sched_entry_t *sched_entries() { return entries; }
@@ -0,0 +1,51 @@
+#ifndef TTYD_SCHED_H
+#define TTYD_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// called when the session may send output, from a writable callback it asked for
+typedef void (*sched_wake_cb)(void *data);
+
+// output scheduling state of one terminal session, embedded in its connection
+typedef struct sched_entry_ {
+  struct sched_entry_ *prev, *next;  // every session, for metrics
+  struct sched_entry_ *run_next;     // queue of sessions waiting for their turn
+  bool queued;
+  bool granted;         // woken with credit, waiting for the writable callback
+  int weight;           // quantums per turn
+  size_t credit;        // bytes it may send in the current turn
+  size_t pending;       // output read from the pty and not sent yet
+  uint64_t sent;        // bytes sent in total
+  uint64_t last_input;  // loop time of the last input, in ms
+  int pid;
+  char user[30];
+  sched_wake_cb wake;
+  void *data;
+} sched_entry_t;
+
+void sched_init(uv_loop_t *loop);
+// bytes every session may send per loop iteration and weight, 0 sends without limits
+void sched_set_quantum(size_t quantum);
+// parse USER=WEIGHT, sessions of user get weight turns per round instead of one
+bool sched_set_weight(const char *spec);
+void sched_close();
+
+void sched_add(sched_entry_t *entry, const char *user, sched_wake_cb wake, void *data);
+void sched_remove(sched_entry_t *entry);
+// output of len bytes is pending, the session is woken when it is its turn; small output
+// and output right after input go first, without waiting for the round
+void sched_ready(sched_entry_t *entry, size_t len);
+// in the writable callback: bytes that may be sent now, 0 if it is not the session's turn
+size_t sched_grant(sched_entry_t *entry);
+// n bytes went out, the rest waits for the next round
+void sched_sent(sched_entry_t *entry, size_t n);
+// --pty-pull: n bytes went out and left more wait in the pty, the turn goes on while its credit lasts
+void sched_pulled(sched_entry_t *entry, size_t n, size_t left);
+void sched_input(sched_entry_t *entry);
+// every registered session, for metrics
+sched_entry_t *sched_entries();
+
+#endif  // TTYD_SCHED_H
@@ -3,7 +3,17 @@
 #include <errno.h>
 #include <getopt.h>
 
+#include "cache.h"
+#include "cgroup.h"
+#include "iothread.h"
+#include "migrate.h"
+#include "pipepool.h"
+#include "router.h"
 #include "runcmd.h"
+#include "sessiond.h"
+#include "ticket.h"
+#include "upgrade.h"
+#include "uring.h"
 #include "wspipe.h"
 
 #if defined(__has_include)
@@ -34,7 +44,7 @@
 volatile bool force_exit = false;
 struct lws_context *context;
 struct server *server;
-struct endpoints endpoints = {"/ws", "/", "/token", ""};
+struct endpoints endpoints = {"/ws", "/", "/token", "", "/assets/", "/exec", "/stream", "/metrics"};
 
 extern int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 extern int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
@@ -65,6 +75,41 @@ static lws_retry_bo_t retry = {
 };
 #endif
 
+// long-only options, outside the range of short option characters
+enum {
+  OPT_ASSETS_DIR = 256,
+  OPT_BOOTSTRAP,
+  OPT_PRESPAWN,
+  OPT_PIPE_MUX,
+  OPT_PIPE_RECORDS,
+  OPT_PIPE_BATCH_SIZE,
+  OPT_PIPE_BATCH_DELAY,
+  OPT_PIPE_WORKERS,
+  OPT_PIPE_WORKER_REQUESTS,
+  OPT_HTTP_EXEC,
+  OPT_STREAM,
+  OPT_SCHED_QUANTUM,
+  OPT_SCHED_WEIGHT,
+  OPT_METRICS,
+  OPT_RATE_LIMIT,
+  OPT_USER_RATE_LIMIT,
+  OPT_CGROUP,
+  OPT_CGROUP_CPU_MAX,
+  OPT_CGROUP_MEMORY_MAX,
+  OPT_CGROUP_PIDS_MAX,
+  OPT_RESUME_TIMEOUT,
+  OPT_IDLE_STOP,
+  OPT_IDLE_KILL,
+  OPT_SESSIOND,
+  OPT_SESSIOND_LISTEN,
+  OPT_ADMIN_SOCKET,
+  OPT_ROUTER,
+  OPT_ROUTER_REPORT,
+  OPT_IO_URING,
+  OPT_PTY_PULL,
+  OPT_PTY_THREADS,
+};
+
 // command line options
 static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"interface", required_argument, NULL, 'i'},
@@ -99,6 +144,37 @@ static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"version", no_argument, NULL, 'v'},
                                         {"help", no_argument, NULL, 'h'},
                                         {"log-stderr", no_argument, NULL, 'l'},
+                                        {"pipe-mux", no_argument, NULL, OPT_PIPE_MUX},
+                                        {"pipe-records", required_argument, NULL, OPT_PIPE_RECORDS},
+                                        {"pipe-batch-size", required_argument, NULL, OPT_PIPE_BATCH_SIZE},
+                                        {"pipe-batch-delay", required_argument, NULL, OPT_PIPE_BATCH_DELAY},
+                                        {"pipe-workers", required_argument, NULL, OPT_PIPE_WORKERS},
+                                        {"pipe-worker-requests", required_argument, NULL, OPT_PIPE_WORKER_REQUESTS},
+                                        {"http-exec", no_argument, NULL, OPT_HTTP_EXEC},
+                                        {"stream", no_argument, NULL, OPT_STREAM},
+                                        {"sched-quantum", required_argument, NULL, OPT_SCHED_QUANTUM},
+                                        {"sched-weight", required_argument, NULL, OPT_SCHED_WEIGHT},
+                                        {"metrics", no_argument, NULL, OPT_METRICS},
+                                        {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+                                        {"user-rate-limit", required_argument, NULL, OPT_USER_RATE_LIMIT},
+                                        {"cgroup", required_argument, NULL, OPT_CGROUP},
+                                        {"cgroup-cpu-max", required_argument, NULL, OPT_CGROUP_CPU_MAX},
+                                        {"cgroup-memory-max", required_argument, NULL, OPT_CGROUP_MEMORY_MAX},
+                                        {"cgroup-pids-max", required_argument, NULL, OPT_CGROUP_PIDS_MAX},
+                                        {"resume-timeout", required_argument, NULL, OPT_RESUME_TIMEOUT},
+                                        {"idle-stop", required_argument, NULL, OPT_IDLE_STOP},
+                                        {"idle-kill", required_argument, NULL, OPT_IDLE_KILL},
+                                        {"sessiond", required_argument, NULL, OPT_SESSIOND},
+                                        {"sessiond-listen", required_argument, NULL, OPT_SESSIOND_LISTEN},
+                                        {"admin-socket", required_argument, NULL, OPT_ADMIN_SOCKET},
+                                        {"router", required_argument, NULL, OPT_ROUTER},
+                                        {"router-report", required_argument, NULL, OPT_ROUTER_REPORT},
+                                        {"io-uring", no_argument, NULL, OPT_IO_URING},
+                                        {"pty-pull", no_argument, NULL, OPT_PTY_PULL},
+                                        {"pty-threads", required_argument, NULL, OPT_PTY_THREADS},
+                                        {"assets-dir", required_argument, NULL, OPT_ASSETS_DIR},
+                                        {"inline-bootstrap", no_argument, NULL, OPT_BOOTSTRAP},
+                                        {"prespawn", no_argument, NULL, OPT_PRESPAWN},
                                         {NULL, 0, 0, 0}};
 static const char *opt_string = "lp:i:U:c:H:u:g:s:w:I:b:P:f:6aSC:K:A:Wt:T:Om:oqBd:vh";
 
@@ -125,11 +201,42 @@ static void print_help() {
           "    -T, --terminal-type     Terminal type to report, default: xterm-256color\n"
           "    -O, --check-origin      Do not allow websocket connection from different origin\n"
           "    -l, --log-stderr        Send child’s stderr to ttyd’s stderr (line-buffered, prefix \"[child:<pid>] \")\n"
+          "        --pipe-mux          Tag pipe protocol messages with their channel: '1' stdout, '2' stderr, 'x' exit code, 's' signal\n"
+          "        --pipe-records      Send pipe protocol stdout as whole records: newline, nul or length (4 byte big-endian prefix)\n"
+          "        --pipe-batch-size   Maximum bytes of records packed into one message (default: 65536)\n"
+          "        --pipe-batch-delay  Milliseconds to wait for a batch to fill up before sending it (default: 0)\n"
+          "        --pipe-workers      Serve each pipe protocol message as a request to one of this many persistent workers (length-prefixed on stdin/stdout)\n"
+          "        --pipe-worker-requests  Replace a worker after this many requests (default: 0, never)\n"
+          "        --http-exec         Run the command for POST <base-path>/exec, the body is its stdin and its stdout the streamed response\n"
+          "        --stream            Run one shared instance of the command and stream its output read-only at <base-path>/stream\n"
+          "        --sched-quantum     Output bytes a busy session may send per turn, before the others get theirs (default: 16384, 0: no limit)\n"
+          "        --sched-weight      Give sessions of a user more turns per round, eg: --sched-weight admin=4 (can be passed multiple times)\n"
+          "        --metrics           Serve counters in prometheus text format at <base-path>/metrics\n"
+          "        --rate-limit        Output bytes per second a session may produce, its pty is not read while over it (default: 0, no limit)\n"
+          "        --user-rate-limit   Output bytes per second all sessions of a user may produce together (default: 0, no limit)\n"
+          "        --cgroup            Run each command in its own child of this delegated cgroup v2 directory\n"
+          "        --cgroup-cpu-max    cpu.max of each command's cgroup, eg: \"50000 100000\" for half a cpu\n"
+          "        --cgroup-memory-max memory.max of each command's cgroup, eg: 512M\n"
+          "        --cgroup-pids-max   pids.max of each command's cgroup, eg: 256\n"
+          "        --resume-timeout    Seconds a session outlives its websocket, so the client can reconnect to it (default: 0, killed right away)\n"
+          "        --idle-stop         Stop (SIGSTOP) a session after this many minutes without input or output, it continues on input or resume\n"
+          "        --idle-kill         Kill a session with the --signal after this many minutes without input or output\n"
+          "        --sessiond          Run terminal sessions in the session daemon listening on this unix socket\n"
+          "        --sessiond-listen   Run as the session daemon on this unix socket, instead of serving http\n"
+          "        --admin-socket      Unix socket to list sessions on and migrate them to another ttyd's admin socket\n"
+          "        --router            Route connections on --port to these backend ttyds (eg: 127.0.0.1:7682,127.0.0.1:7683)\n"
+          "        --router-report     Report sessions and load every second to the router at this address (eg: 127.0.0.1:7681)\n"
+          "        --io-uring          Read and write the ptys through io_uring on Linux, falls back to libuv where it is unavailable\n"
+          "        --pty-pull          Read the ptys only when the websocket can take their output, straight into the frame\n"
+          "        --pty-threads       Read and write the ptys on this many I/O threads, off the websocket loop (1-64)\n"
           "    -m, --max-clients       Maximum clients to support (default: 0, no limit)\n"
           "    -o, --once              Accept only one client and exit on disconnection\n"
           "    -q, --exit-no-conn      Exit on all clients disconnection\n"
           "    -B, --browser           Open terminal with the default system browser\n"
-          "    -I, --index             Custom index.html path\n"
+          "    -I, --index             Custom index.html path (cached in memory, reloaded when the file changes)\n"
+          "        --assets-dir        Serve the frontend bundle from this dir (eg: html/dist) as content-hashed assets under <base-path>/assets/\n"
+          "        --inline-bootstrap  Render title, client options and a one-time websocket ticket into index.html, saving the token and handshake round trips\n"
+          "        --prespawn          Start the command when index.html is served and hand it to the websocket carrying its ticket, implies --inline-bootstrap\n"
           "    -b, --base-path         Expected base path for requests coming from a reverse proxy (eg: /mounted/here, max length: 128)\n"
 #if LWS_LIBRARY_VERSION_NUMBER >= 4000000
           "    -P, --ping-interval     Websocket ping interval(sec) (default: 5)\n"
@@ -165,6 +272,10 @@ static void print_config() {
     lwsl_notice("  index    : %s\n", endpoints.index);
     lwsl_notice("  token    : %s\n", endpoints.token);
     lwsl_notice("  websocket: %s\n", endpoints.ws);
+    if (server->assets_dir != NULL) lwsl_notice("  assets   : %s\n", endpoints.assets);
+    if (server->http_exec) lwsl_notice("  exec     : %s\n", endpoints.exec);
+    if (server->stream) lwsl_notice("  stream   : %s\n", endpoints.stream);
+    if (server->metrics) lwsl_notice("  metrics  : %s\n", endpoints.metrics);
   }
   if (server->auth_header != NULL) lwsl_notice("  auth header: %s\n", server->auth_header);
   if (server->check_origin) lwsl_notice("  check origin: true\n");
@@ -173,6 +284,19 @@ static void print_config() {
   if (server->once) lwsl_notice("  once: true\n");
   if (server->exit_no_conn) lwsl_notice("  exit_no_conn: true\n");
   if (server->index != NULL) lwsl_notice("  custom index.html: %s\n", server->index);
+  if (server->assets_dir != NULL) lwsl_notice("  assets dir: %s\n", server->assets_dir);
+  if (server->bootstrap) lwsl_notice("  inline bootstrap: true\n");
+  if (server->prespawn) lwsl_notice("  prespawn: true\n");
+  if (server->http_exec) lwsl_notice("  http exec: true\n");
+  if (server->stream) lwsl_notice("  stream: true\n");
+  if (server->metrics) lwsl_notice("  metrics: true\n");
+  if (server->resume_timeout > 0) lwsl_notice("  resume timeout: %ds\n", server->resume_timeout);
+  if (server->idle_stop > 0) lwsl_notice("  idle stop: %dm\n", server->idle_stop);
+  if (server->idle_kill > 0) lwsl_notice("  idle kill: %dm\n", server->idle_kill);
+  if (server->sessiond != NULL) lwsl_notice("  session daemon: %s\n", server->sessiond);
+  if (uring_enabled()) lwsl_notice("  pty io: io_uring\n");
+  if (server->pty_pull) lwsl_notice("  pty pull: true\n");
+  if (iothread_enabled()) lwsl_notice("  pty io: %d thread(s)\n", iothread_count());
   if (server->cwd != NULL) lwsl_notice("  working directory: %s\n", server->cwd);
   if (!server->writable) lwsl_warn("The --writable option is not set, will start in readonly mode\n");
 }
@@ -229,7 +353,9 @@ static void server_free(struct server *ts) {
   if (ts->credential != NULL) free(ts->credential);
   if (ts->auth_header != NULL) free(ts->auth_header);
   if (ts->index != NULL) free(ts->index);
+  if (ts->assets_dir != NULL) free(ts->assets_dir);
   if (ts->cwd != NULL) free(ts->cwd);
+  if (ts->sessiond != NULL) free(ts->sessiond);
   free(ts->command);
   free(ts->prefs_json);
 
@@ -254,6 +380,12 @@ static void signal_cb(uv_signal_t *watcher, int signum) {
   char sig_name[20];
 
   switch (watcher->signum) {
+#ifndef _WIN32
+    case SIGUSR2:
+      lwsl_notice("received signal: SIGUSR2 (%d), upgrading...\n", watcher->signum);
+      upgrade_start();
+      return;
+#endif
     case SIGINT:
     case SIGTERM:
       get_sig_name(watcher->signum, sig_name, sizeof(sig_name));
@@ -335,6 +467,7 @@ int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
   int start = calc_command_start(argc, argv);
   server = server_new(argc, argv, start);
+  upgrade_init(server->loop, argc, argv);
 
   struct lws_context_creation_info info;
   memset(&info, 0, sizeof(info));
@@ -359,6 +492,20 @@ int main(int argc, char **argv) {
   char key_path[1024] = "";
   char ca_path[1024] = "";
 
+  int pipe_batch_size = 0;
+  int pipe_batch_delay = 0;
+  int pipe_workers = 0;
+  int pipe_worker_requests = 0;
+  int rate_limit = 0;
+  int user_rate_limit = 0;
+  char *cgroup_dir = NULL;
+  char *sessiond_listen = NULL;
+  char *admin_socket = NULL;
+  char *router_backends = NULL;
+  char *router_report = NULL;
+  bool io_uring = false;
+  int pty_threads = 0;
+
   struct json_object *client_prefs = json_object_new_object();
 
 #ifdef _WIN32
@@ -488,7 +635,7 @@ int main(int argc, char **argv) {
 #define sc(f)                                  \
   strncpy(path + len, endpoints.f, 128 - len); \
   endpoints.f = strdup(path);
-        sc(ws) sc(index) sc(token) sc(parent)
+        sc(ws) sc(index) sc(token) sc(parent) sc(assets) sc(exec) sc(stream) sc(metrics)
 #undef sc
       } break;
 #if LWS_LIBRARY_VERSION_NUMBER >= 4000000
@@ -557,20 +704,224 @@ int main(int argc, char **argv) {
       case 'l':
         set_errlog(1);
         break;
+      case OPT_ASSETS_DIR: {
+        server->assets_dir = strdup(optarg);
+        size_t len = strlen(server->assets_dir);
+        while (len > 1 && server->assets_dir[len - 1] == '/') server->assets_dir[--len] = '\0';
+      } break;
+      case OPT_BOOTSTRAP:
+        server->bootstrap = true;
+        break;
+      case OPT_PIPE_MUX:
+        set_pipe_mux(1);
+        break;
+      case OPT_PIPE_RECORDS:
+        if (set_pipe_records(optarg) < 0) {
+          fprintf(stderr, "ttyd: invalid pipe-records: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_PIPE_BATCH_SIZE:
+        pipe_batch_size = parse_int("pipe-batch-size", optarg);
+        if (pipe_batch_size <= 0) {
+          fprintf(stderr, "ttyd: invalid pipe-batch-size: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_HTTP_EXEC:
+        server->http_exec = true;
+        break;
+      case OPT_STREAM:
+        server->stream = true;
+        break;
+      case OPT_SCHED_QUANTUM: {
+        int quantum = parse_int("sched-quantum", optarg);
+        if (quantum < 0) {
+          fprintf(stderr, "ttyd: invalid sched-quantum: %s\n", optarg);
+          return -1;
+        }
+        sched_set_quantum((size_t)quantum);
+      } break;
+      case OPT_SCHED_WEIGHT:
+        if (!sched_set_weight(optarg)) {
+          fprintf(stderr, "ttyd: invalid sched-weight: %s, expected USER=WEIGHT (1-64)\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_METRICS:
+        server->metrics = true;
+        break;
+      case OPT_CGROUP:
+        cgroup_dir = optarg;
+        break;
+      case OPT_CGROUP_CPU_MAX:
+        cgroup_set_limit("cpu.max", optarg);
+        break;
+      case OPT_CGROUP_MEMORY_MAX:
+        cgroup_set_limit("memory.max", optarg);
+        break;
+      case OPT_CGROUP_PIDS_MAX:
+        cgroup_set_limit("pids.max", optarg);
+        break;
+      case OPT_RESUME_TIMEOUT:
+        server->resume_timeout = parse_int("resume-timeout", optarg);
+        if (server->resume_timeout < 0) {
+          fprintf(stderr, "ttyd: invalid resume-timeout: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_IDLE_STOP:
+        server->idle_stop = parse_int("idle-stop", optarg);
+        if (server->idle_stop < 0) {
+          fprintf(stderr, "ttyd: invalid idle-stop: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_IDLE_KILL:
+        server->idle_kill = parse_int("idle-kill", optarg);
+        if (server->idle_kill < 0) {
+          fprintf(stderr, "ttyd: invalid idle-kill: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_SESSIOND:
+        server->sessiond = strdup(optarg);
+        break;
+      case OPT_SESSIOND_LISTEN:
+        sessiond_listen = optarg;
+        break;
+      case OPT_ADMIN_SOCKET:
+        admin_socket = optarg;
+        break;
+      case OPT_ROUTER:
+        router_backends = optarg;
+        break;
+      case OPT_ROUTER_REPORT:
+        router_report = optarg;
+        break;
+      case OPT_IO_URING:
+        io_uring = true;
+        break;
+      case OPT_PTY_PULL:
+        server->pty_pull = true;
+        break;
+      case OPT_PTY_THREADS:
+        pty_threads = parse_int("pty-threads", optarg);
+        if (pty_threads < 1 || pty_threads > 64) {
+          fprintf(stderr, "ttyd: invalid pty-threads: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_RATE_LIMIT:
+        rate_limit = parse_int("rate-limit", optarg);
+        if (rate_limit < 0) {
+          fprintf(stderr, "ttyd: invalid rate-limit: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_USER_RATE_LIMIT:
+        user_rate_limit = parse_int("user-rate-limit", optarg);
+        if (user_rate_limit < 0) {
+          fprintf(stderr, "ttyd: invalid user-rate-limit: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_PIPE_WORKERS:
+        pipe_workers = parse_int("pipe-workers", optarg);
+        if (pipe_workers < 0) {
+          fprintf(stderr, "ttyd: invalid pipe-workers: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_PIPE_WORKER_REQUESTS:
+        pipe_worker_requests = parse_int("pipe-worker-requests", optarg);
+        if (pipe_worker_requests < 0) {
+          fprintf(stderr, "ttyd: invalid pipe-worker-requests: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_PIPE_BATCH_DELAY:
+        pipe_batch_delay = parse_int("pipe-batch-delay", optarg);
+        if (pipe_batch_delay < 0) {
+          fprintf(stderr, "ttyd: invalid pipe-batch-delay: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_PRESPAWN:
+        server->bootstrap = true;
+        server->prespawn = true;
+        break;
       default:
         print_help();
         return -1;
     }
   }
+  set_pipe_batch((size_t)pipe_batch_size, (unsigned int)pipe_batch_delay);
   server->prefs_json = strdup(json_object_to_json_string(client_prefs));
   json_object_put(client_prefs);
 
+  if (sessiond_listen != NULL) {
+    // the daemon runs the commands ttyd frontends send it, it has no command of its own
+    lws_set_log_level(debug_level, NULL);
+    if (cgroup_dir != NULL && !cgroup_init(server->loop, cgroup_dir)) {
+      fprintf(stderr, "ttyd: can not use cgroup: %s\n", cgroup_dir);
+      return -1;
+    }
+    return sessiond_run(server->loop, sessiond_listen);
+  }
+
+  if (router_backends != NULL) {
+    // the router only passes connections on, the backends serve them
+    lws_set_log_level(debug_level, NULL);
+    return router_run(server->loop, info.port, router_backends, server->auth_header);
+  }
+
   if (server->command == NULL || strlen(server->command) == 0) {
     fprintf(stderr, "ttyd: missing start command\n");
     return -1;
   }
 
+  if (server->assets_dir != NULL) {
+    if (!assets_init(server->loop, server->assets_dir)) {
+      fprintf(stderr, "ttyd: can not read assets dir: %s\n", server->assets_dir);
+      return -1;
+    }
+    // the small html shell referencing the bundle becomes the index, unless --index is given
+    if (server->index == NULL) {
+      size_t len = strlen(server->assets_dir) + sizeof("/shell.html");
+      server->index = xmalloc(len);
+      snprintf(server->index, len, "%s/shell.html", server->assets_dir);
+    }
+  }
+
+  if (server->index != NULL && !index_cache_init(server->loop, server->index)) {
+    fprintf(stderr, "ttyd: can not load index.html: %s\n", server->index);
+    return -1;
+  }
+
+  if (cgroup_dir != NULL && !cgroup_init(server->loop, cgroup_dir)) {
+    fprintf(stderr, "ttyd: can not use cgroup: %s\n", cgroup_dir);
+    return -1;
+  }
+
+  if (pipe_workers > 0 && !pipepool_init(server->loop, ttyd_runcmd(), pipe_workers, pipe_worker_requests)) {
+    fprintf(stderr, "ttyd: can not start pipe workers: %s\n", server->command);
+    return -1;
+  }
+
+  sched_init(server->loop);
+  ratelimit_config(server->loop, (uint64_t)rate_limit, (uint64_t)user_rate_limit);
+
   lws_set_log_level(debug_level, NULL);
+  if (pty_threads > 0) {
+    if (io_uring) lwsl_warn("--io-uring has no effect with --pty-threads\n");
+    if (!iothread_init(server->loop, pty_threads)) {
+      lwsl_err("can not start %d pty thread(s)\n", pty_threads);
+      return -1;
+    }
+  } else if (io_uring && !uring_init(server->loop)) {
+    lwsl_warn("io_uring is not available, the ptys use libuv\n");
+  }
 
   char server_hdr[128] = "";
   sprintf(server_hdr, "ttyd/%s (libwebsockets/%s)", TTYD_VERSION, LWS_LIBRARY_VERSION);
@@ -630,6 +981,12 @@ int main(int argc, char **argv) {
   info.foreign_loops = foreign_loops;
   info.options |= LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
 
+  // started by the SIGUSR2 of a running ttyd: listen on its socket and adopt its sessions
+  int listen_fd = upgrade_receive();
+#if LWS_LIBRARY_VERSION_NUMBER >= 4002000
+  if (listen_fd >= 0) info.vh_listen_sockfd = listen_fd;
+#endif
+
   context = lws_create_context(&info);
   if (context == NULL) {
     lwsl_err("libwebsockets context creation failed\n");
@@ -643,6 +1000,15 @@ int main(int argc, char **argv) {
   }
   int port = lws_get_vhost_listen_port(vhost);
   lwsl_notice(" Listening on port: %d\n", port);
+  upgrade_done();
+  if (admin_socket != NULL) {
+    if (!migrate_init(server->loop, admin_socket, port)) return 1;
+    lwsl_notice("  admin socket: %s\n", admin_socket);
+  }
+  if (router_report != NULL) {
+    if (!router_report_init(server->loop, router_report, port)) return 1;
+    lwsl_notice("  reporting to router: %s\n", router_report);
+  }
 
   if (browser) {
     char url[30];
@@ -650,8 +1016,13 @@ int main(int argc, char **argv) {
     open_uri(url);
   }
 
+#ifndef _WIN32
+#define sig_count 3
+  int sig_nums[] = {SIGINT, SIGTERM, SIGUSR2};
+#else
 #define sig_count 2
   int sig_nums[] = {SIGINT, SIGTERM};
+#endif
   uv_signal_t signals[sig_count];
   for (int i = 0; i < sig_count; i++) {
     uv_signal_init(server->loop, &signals[i]);
@@ -664,6 +1035,16 @@ int main(int argc, char **argv) {
     uv_signal_stop(&signals[i]);
   }
 #undef sig_count
+  index_cache_close();
+  assets_close();
+  ticket_close();
+  pipepool_close();
+  sched_close();
+  cgroup_close();
+  migrate_close();
+  router_report_close();
+  uring_close();
+  iothread_close();
 
   lws_context_destroy(context);
 
@@ -2,7 +2,11 @@
 #include <stdbool.h>
 #include <uv.h>
 
+#include "cache.h"
 #include "pty.h"
+#include "ratelimit.h"
+#include "sched.h"
+#include "ticket.h"
 
 // client message
 #define INPUT '0'
@@ -15,6 +19,8 @@
 #define OUTPUT '0'
 #define SET_WINDOW_TITLE '1'
 #define SET_PREFERENCES '2'
+#define SET_RESUME_ID '3'
+#define RECONNECT '4'
 
 // url paths
 struct endpoints {
@@ -22,6 +28,10 @@ struct endpoints {
   char *index;
   char *token;
   char *parent;
+  char *assets;
+  char *exec;
+  char *stream;
+  char *metrics;
 };
 
 extern volatile bool force_exit;
@@ -29,11 +39,25 @@ extern struct lws_context *context;
 extern struct server *server;
 extern struct endpoints endpoints;
 
+#define HTTP_BODY_PARTS 5
+
 struct pss_http {
   char path[128];
-  char *buffer;
-  char *ptr;
-  size_t len;
+  char *buffer;          // heap memory owned by the response
+  struct {
+    const char *base;
+    size_t len;
+  } body[HTTP_BODY_PARTS];  // response body, written part after part
+  int body_count;
+  int body_index;
+  size_t body_offset;
+  unsigned char trailer[8];  // gzip trailer of a spliced body
+
+  struct http_exec *exec;  // command streaming its output as the body
+  struct http_stream *stream;  // viewer of the shared session
+  cache_entry_t *entry;  // cached file backing the body, if any
+  unsigned char *chunk;  // LWS_PRE headroom copy for h2 streams
+  size_t chunk_size;     // bytes per write, sized to the socket send buffer
 };
 
 struct pss_tty {
@@ -52,13 +76,30 @@ struct pss_tty {
 
   pty_process *process;
   pty_buf_t *pty_buf;
+  size_t pty_off;       // bytes of pty_buf already sent
+  sched_entry_t sched;  // its turn to send pty_buf
+  rate_limit_t rate;    // when the pty may be read again
+  bool resumed;        // took over a parked session, see --resume-timeout
+  bool resume_sent;    // the client knows the resume id of its session
+  int reconnect_port;  // its session moved to the ttyd on this port, see migrate.c
+  bool view;                      // asked to watch the shared session (?view=1 with --stream)
+  struct session_viewer *viewer;  // watching it, instead of running a process of its own
 
   int lws_close_status;
 };
 
-typedef struct {
+typedef struct pty_ctx_ {
   struct pss_tty *pss;
   bool ws_closed;
+  pty_process *process;
+  char id[TICKET_LEN];  // to resume the session with, empty without --resume-timeout
+  char user[30];
+  bool parked;          // its client went away, it waits for a reconnect
+  uint64_t parked_at;
+  pty_buf_t *pty_buf;   // output the client did not get before it went away
+  uint64_t active_at;   // last input or output
+  bool frozen;          // stopped with SIGSTOP for being idle
+  struct pty_ctx_ *prev, *next;
 } pty_ctx_t;
 
 struct server {
@@ -67,6 +108,7 @@ struct server {
   char *credential;        // encoded basic auth credential
   char *auth_header;       // header name used for auth proxy
   char *index;             // custom index.html
+  char *assets_dir;        // webpack bundle served under <base-path>/assets/
   char *command;           // full command line
   char **argv;             // command with arguments
   int argc;                // command + arguments count
@@ -81,6 +123,16 @@ struct server {
   bool exit_no_conn;       // whether exit on all clients disconnection
   char socket_path[255];   // UNIX domain socket path
   char terminal_type[30];  // terminal type to report
+  bool bootstrap;          // render title, prefs and a ws ticket into index.html
+  bool prespawn;           // spawn the command when the index is served, bound to its ticket
+  bool http_exec;          // run the command for POST <base-path>/exec
+  bool stream;             // share one session read-only at <base-path>/stream
+  bool metrics;            // serve counters at <base-path>/metrics
+  int resume_timeout;      // seconds a session outlives its websocket, waiting to be resumed
+  int idle_stop;           // minutes without input or output before a session is stopped
+  int idle_kill;           // minutes without input or output before a session is killed
+  char *sessiond;          // unix socket of the session daemon running the terminal sessions
+  bool pty_pull;           // the writable callback reads the pty, output waits in the kernel until then
 
   uv_loop_t *loop;         // the libuv event loop
 };
@@ -0,0 +1,250 @@
+#include "session.h"
+
+#include <errno.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pty.h"
+#include "server.h"
+#include "utils.h"
+
+// output kept to redraw the screen for viewers that join late or fall behind
+#define SESSION_SCREEN 16384
+// a viewer this far behind the command skips ahead to the latest screen
+#define SESSION_LAG_MAX (256 * 1024)
+
+typedef struct {
+  pty_process *process;
+  bool exited;
+  session_frame_t *tail;      // newest frame, the chain before it lives as long as a viewer needs it
+  uint64_t end;               // bytes of output so far
+  char screen[SESSION_SCREEN];  // ring of the latest output
+  session_frame_t *snapshot;  // reset frame for the current end, shared by viewers skipping at once
+  struct session_viewer *viewers;
+  int viewer_count;
+} session_t;
+
+struct session_viewer {
+  session_t *session;
+  struct session_viewer *prev, *next;
+  session_frame_t *last;   // newest frame sent, its next one goes out after the pending reset
+  session_frame_t *reset;  // screen snapshot to send first, if any
+  session_wake_cb wake;
+  void *data;
+};
+
+// the session --stream viewers watch, NULL until the first one arrives or after the command exited
+static session_t *shared = NULL;
+
+session_frame_t *session_frame_new(const void *data, size_t len) {
+  session_frame_t *frame =
+      xmalloc(sizeof(session_frame_t) + LWS_PRE + SESSION_FRAME_HDR + len + SESSION_FRAME_TAIL);
+  memset(frame, 0, sizeof(session_frame_t));
+  frame->refs = 1;
+  frame->data = (unsigned char *)(frame + 1) + LWS_PRE + SESSION_FRAME_HDR;
+  frame->len = len;
+  if (data != NULL && len > 0) memcpy(frame->data, data, len);
+  return frame;
+}
+
+static session_frame_t *frame_ref(session_frame_t *frame) {
+  frame->refs++;
+  return frame;
+}
+
+void session_frame_unref(session_frame_t *frame) {
+  // dropping the oldest frame may release a long chain, walk it instead of recursing
+  while (frame != NULL && --frame->refs == 0) {
+    session_frame_t *next = frame->next;
+    session_frame_unref(frame->sse);
+    free(frame);
+    frame = next;
+  }
+}
+
+static void screen_append(session_t *session, const char *data, size_t len) {
+  uint64_t at = session->end;
+  if (len > SESSION_SCREEN) {
+    at += len - SESSION_SCREEN;
+    data += len - SESSION_SCREEN;
+    len = SESSION_SCREEN;
+  }
+  size_t pos = (size_t)(at % SESSION_SCREEN);
+  size_t first = len < SESSION_SCREEN - pos ? len : SESSION_SCREEN - pos;
+  memcpy(session->screen + pos, data, first);
+  memcpy(session->screen, data + first, len - first);
+}
+
+// the latest output after a terminal reset, NULL if there is no output yet
+static session_frame_t *screen_snapshot(session_t *session) {
+  if (session->end == 0) return NULL;
+  if (session->snapshot != NULL && session->snapshot->end == session->end) return frame_ref(session->snapshot);
+
+  size_t len = session->end < SESSION_SCREEN ? (size_t)session->end : SESSION_SCREEN;
+  size_t start = (size_t)((session->end - len) % SESSION_SCREEN);
+  size_t first = len < SESSION_SCREEN - start ? len : SESSION_SCREEN - start;
+  session_frame_t *frame = session_frame_new(NULL, 2 + len);
+  memcpy(frame->data, "\033c", 2);
+  memcpy(frame->data + 2, session->screen + start, first);
+  memcpy(frame->data + 2 + first, session->screen, len - first);
+  if (session->end > SESSION_SCREEN) {
+    // the ring starts mid line, maybe inside an escape sequence, begin at the next line
+    unsigned char *nl = memchr(frame->data + 2, '\n', len);
+    if (nl != NULL) {
+      size_t skip = (size_t)(nl + 1 - (frame->data + 2));
+      memmove(frame->data + 2, nl + 1, len - skip);
+      frame->len -= skip;
+    }
+  }
+  frame->reset = true;
+  frame->end = session->end;
+
+  session_frame_unref(session->snapshot);
+  session->snapshot = frame;
+  return frame_ref(frame);
+}
+
+static void viewer_skip(session_t *session, struct session_viewer *viewer) {
+  session_frame_unref(viewer->reset);
+  viewer->reset = screen_snapshot(session);
+  session_frame_unref(viewer->last);
+  viewer->last = frame_ref(session->tail);
+}
+
+static void session_output(session_t *session, const char *data, size_t len) {
+  screen_append(session, data, len);
+  session->end += len;
+
+  // the new frame's only reference is the previous tail's, frames nobody still has to send go away here
+  session_frame_t *frame = session_frame_new(data, len);
+  session_frame_t *prev = session->tail;
+  frame->end = session->end;
+  prev->next = frame;
+  session->tail = frame_ref(frame);
+  session_frame_unref(prev);
+
+  // slow viewers never hold the command back, they lose the backlog and redraw the screen instead
+  for (struct session_viewer *viewer = session->viewers; viewer != NULL; viewer = viewer->next) {
+    if (session->end - viewer->last->end > SESSION_LAG_MAX) viewer_skip(session, viewer);
+    viewer->wake(viewer->data);
+  }
+}
+
+static void session_free(session_t *session) {
+  session_frame_unref(session->tail);
+  session_frame_unref(session->snapshot);
+  free(session);
+}
+
+static void read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
+  session_t *session = (session_t *)process->ctx;
+  if (eof || buf == NULL) return;
+  session_output(session, buf->base, buf->len);
+  pty_buf_free(buf);
+  pty_resume(process);
+}
+
+static void exit_cb(pty_process *process) {
+  session_t *session = (session_t *)process->ctx;
+  lwsl_notice("shared session exited with code %d, pid: %d\n", process->exit_code, process->pid);
+  session->process = NULL;
+  session->exited = true;
+  if (shared == session) shared = NULL;
+  if (session->viewer_count == 0) {
+    session_free(session);
+    return;
+  }
+  for (struct session_viewer *viewer = session->viewers; viewer != NULL; viewer = viewer->next)
+    viewer->wake(viewer->data);
+}
+
+static session_t *session_spawn() {
+  session_t *session = xmalloc(sizeof(session_t));
+  memset(session, 0, sizeof(session_t));
+  session->tail = session_frame_new(NULL, 0);
+
+  char **argv = xmalloc((server->argc + 1) * sizeof(char *));
+  memcpy(argv, server->argv, server->argc * sizeof(char *));
+  argv[server->argc] = NULL;
+  char **envp = xmalloc(2 * sizeof(char *));
+  envp[0] = xmalloc(36);
+  snprintf(envp[0], 36, "TERM=%s", server->terminal_type);
+  envp[1] = NULL;
+
+  pty_process *process = process_init(session, server->loop, argv, envp);
+  if (server->cwd != NULL) process->cwd = strdup(server->cwd);
+  if (pty_spawn(process, read_cb, exit_cb) != 0) {
+    lwsl_err("pty_spawn: %d (%s)\n", errno, strerror(errno));
+    process_free(process);
+    session_free(session);
+    return NULL;
+  }
+  lwsl_notice("started shared session, pid: %d\n", process->pid);
+  session->process = process;
+  pty_resume(process);
+  return session;
+}
+
+struct session_viewer *session_watch(session_wake_cb wake, void *data) {
+  if (shared == NULL && (shared = session_spawn()) == NULL) return NULL;
+
+  struct session_viewer *viewer = xmalloc(sizeof(struct session_viewer));
+  memset(viewer, 0, sizeof(struct session_viewer));
+  viewer->session = shared;
+  viewer->wake = wake;
+  viewer->data = data;
+  viewer->last = frame_ref(shared->tail);
+  viewer->reset = screen_snapshot(shared);
+
+  viewer->next = shared->viewers;
+  if (shared->viewers != NULL) shared->viewers->prev = viewer;
+  shared->viewers = viewer;
+  shared->viewer_count++;
+  return viewer;
+}
+
+session_frame_t *session_next(struct session_viewer *viewer) {
+  if (viewer->reset != NULL) return viewer->reset;
+  return viewer->last->next;
+}
+
+void session_sent(struct session_viewer *viewer) {
+  if (viewer->reset != NULL) {
+    session_frame_unref(viewer->reset);
+    viewer->reset = NULL;
+    return;
+  }
+  session_frame_t *next = viewer->last->next;
+  if (next == NULL) return;
+  frame_ref(next);
+  session_frame_unref(viewer->last);
+  viewer->last = next;
+}
+
+bool session_ended(struct session_viewer *viewer) {
+  return viewer->session->exited && viewer->reset == NULL && viewer->last->next == NULL;
+}
+
+void session_unwatch(struct session_viewer *viewer) {
+  if (viewer == NULL) return;
+  session_t *session = viewer->session;
+  if (viewer->prev != NULL) viewer->prev->next = viewer->next;
+  if (viewer->next != NULL) viewer->next->prev = viewer->prev;
+  if (session->viewers == viewer) session->viewers = viewer->next;
+  session->viewer_count--;
+  session_frame_unref(viewer->reset);
+  session_frame_unref(viewer->last);
+  free(viewer);
+
+  if (session->viewer_count > 0) return;
+  if (session->exited) {
+    session_free(session);
+    return;
+  }
+  // nobody watches anymore, the next viewer starts a fresh command
+  if (shared == session) shared = NULL;
+  lwsl_notice("killing shared session, pid: %d\n", session->process->pid);
+  pty_kill(session->process, server->sig_code);
+}
@@ -0,0 +1,45 @@
+#ifndef TTYD_SESSION_H
+#define TTYD_SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// room in front of a frame's data (after LWS_PRE) for a chunk size line or the websocket OUTPUT byte,
+// and after it for the chunk's CRLF
+#define SESSION_FRAME_HDR 16
+#define SESSION_FRAME_TAIL 2
+
+// one chunk of session output, stored once and shared by every viewer that has yet to send it
+typedef struct session_frame_ {
+  int refs;
+  struct session_frame_ *next;  // the chunk that followed, holds a reference
+  uint64_t end;                 // session output offset right after this chunk
+  bool reset;                   // a screen snapshot for a viewer that starts or fell behind
+  size_t len;
+  unsigned char *data;          // LWS_PRE + SESSION_FRAME_HDR before it, SESSION_FRAME_TAIL after it
+  struct session_frame_ *sse;   // server-sent event encoding, made by the first viewer that needs it
+} session_frame_t;
+
+// a frame with one reference and room for len bytes, copied from data unless it is NULL
+session_frame_t *session_frame_new(const void *data, size_t len);
+void session_frame_unref(session_frame_t *frame);
+
+struct session_viewer;
+
+// called when a viewer has a frame to send or the session ended
+typedef void (*session_wake_cb)(void *data);
+
+// watch the shared session, spawning the command for it if it is not running,
+// returns NULL if that failed
+struct session_viewer *session_watch(session_wake_cb wake, void *data);
+// the next frame to send, NULL if there is none yet
+session_frame_t *session_next(struct session_viewer *viewer);
+// the frame returned by session_next() went out
+void session_sent(struct session_viewer *viewer);
+// true once the command exited and every frame was sent
+bool session_ended(struct session_viewer *viewer);
+// stop watching, the command is killed when its last viewer leaves
+void session_unwatch(struct session_viewer *viewer);
+
+#endif  // TTYD_SESSION_H
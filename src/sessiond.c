@@ -0,0 +1,444 @@
+#include "sessiond.h"
+
+#include <errno.h>
+#include <libwebsockets.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pty.h"
+#include "ticket.h"
+#include "utils.h"
+
+// output a session keeps for the frontend that attaches next
+#define SESSIOND_RING 65536
+// a frontend this far behind stops its pty from being read until it caught up
+#define SESSIOND_WRITE_MAX (256 * 1024)
+
+struct conn;
+
+typedef struct dsession {
+  pty_process *process;
+  char id[TICKET_LEN];
+  char user[30];
+  char *strings;          // argv points into it
+  uint32_t linger;        // seconds it waits detached for a frontend
+  uv_timer_t *timer;      // kills it once linger ran out
+  struct conn *conn;      // attached frontend, NULL while detached
+  char ring[SESSIOND_RING];
+  uint64_t end;           // bytes of output so far
+  uint64_t sent;          // output sent to the attached frontend
+  uint64_t acked;         // output the client of the last frontend got, the next one replays from here
+  bool paused;            // the frontend is behind, the pty is not read
+  struct dsession *prev, *next;
+} dsession_t;
+
+struct conn {
+  uv_pipe_t pipe;
+  sessiond_reader_t reader;
+  dsession_t *session;
+  bool detached;  // said how far its client got
+};
+
+static uv_loop_t *loop = NULL;
+static dsession_t *sessions = NULL;
+
+void sessiond_feed(sessiond_reader_t *reader, const char *data, size_t len) {
+  if (reader->pos > 0) {
+    memmove(reader->base, reader->base + reader->pos, reader->len - reader->pos);
+    reader->len -= reader->pos;
+    reader->pos = 0;
+  }
+  reader->base = xrealloc(reader->base, reader->len + len);
+  memcpy(reader->base + reader->len, data, len);
+  reader->len += len;
+}
+
+bool sessiond_next(sessiond_reader_t *reader, char *type, char **payload, uint32_t *len) {
+  size_t avail = reader->len - reader->pos;
+  if (avail < SESSIOND_HDR) return false;
+  char *p = reader->base + reader->pos;
+  memcpy(len, p + 1, sizeof(uint32_t));
+  if (avail - SESSIOND_HDR < *len) return false;
+  *type = p[0];
+  *payload = p + SESSIOND_HDR;
+  reader->pos += SESSIOND_HDR + *len;
+  return true;
+}
+
+void sessiond_reader_free(sessiond_reader_t *reader) {
+  free(reader->base);
+  memset(reader, 0, sizeof(sessiond_reader_t));
+}
+
+uv_buf_t sessiond_frame(char type, const void *data, size_t len, const void *extra, size_t extra_len) {
+  uint32_t n = (uint32_t)(len + extra_len);
+  char *base = xmalloc(SESSIOND_HDR + n);
+  base[0] = type;
+  memcpy(base + 1, &n, sizeof(n));
+  if (len > 0) memcpy(base + SESSIOND_HDR, data, len);
+  if (extra_len > 0) memcpy(base + SESSIOND_HDR + len, extra, extra_len);
+  return uv_buf_init(base, SESSIOND_HDR + n);
+}
+
+static void session_resume(dsession_t *s) {
+  s->paused = false;
+  pty_resume(s->process);
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  struct conn *conn = (struct conn *)req->handle->data;
+  free(req->data);
+  free(req);
+  dsession_t *s = conn->session;
+  if (s != NULL && s->paused && uv_stream_get_write_queue_size((uv_stream_t *)&conn->pipe) < SESSIOND_WRITE_MAX)
+    session_resume(s);
+}
+
+static void send_frame(struct conn *conn, char type, const void *data, size_t len, const void *extra,
+                       size_t extra_len) {
+  uv_buf_t b = sessiond_frame(type, data, len, extra, extra_len);
+  uv_write_t *req = xmalloc(sizeof(uv_write_t));
+  req->data = b.base;
+  if (uv_write(req, (uv_stream_t *)&conn->pipe, &b, 1, write_cb) != 0) {
+    free(b.base);
+    free(req);
+  }
+}
+
+static void send_error(struct conn *conn, const char *message) {
+  send_frame(conn, SESSIOND_ERROR, message, strlen(message), NULL, 0);
+}
+
+static void ring_append(dsession_t *s, const char *data, size_t len) {
+  uint64_t at = s->end;
+  if (len > SESSIOND_RING) {
+    at += len - SESSIOND_RING;
+    data += len - SESSIOND_RING;
+    len = SESSIOND_RING;
+  }
+  size_t pos = (size_t)(at % SESSIOND_RING);
+  size_t first = len < SESSIOND_RING - pos ? len : SESSIOND_RING - pos;
+  memcpy(s->ring + pos, data, first);
+  memcpy(s->ring, data + first, len - first);
+}
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static void conn_free_cb(uv_handle_t *handle) {
+  struct conn *conn = (struct conn *)handle->data;
+  sessiond_reader_free(&conn->reader);
+  free(conn);
+}
+
+static void shutdown_cb(uv_shutdown_t *req, int status) {
+  if (!uv_is_closing((uv_handle_t *)req->handle)) uv_close((uv_handle_t *)req->handle, conn_free_cb);
+  free(req);
+}
+
+static void session_free(dsession_t *s) {
+  if (s->prev != NULL) s->prev->next = s->next;
+  if (s->next != NULL) s->next->prev = s->prev;
+  if (sessions == s) sessions = s->next;
+  if (s->timer != NULL) uv_close((uv_handle_t *)s->timer, close_cb);
+  free(s->strings);
+  free(s);
+}
+
+static void linger_cb(uv_timer_t *timer) {
+  dsession_t *s = (dsession_t *)timer->data;
+  lwsl_notice("killing detached session, pid: %d\n", s->process->pid);
+  pty_kill(s->process, SIGHUP);
+}
+
+// the frontend went away: the command runs on for the next one, or ends without --resume-timeout
+static void session_detach(dsession_t *s, struct conn *conn) {
+  s->conn = NULL;
+  if (!conn->detached) s->acked = s->sent;
+  if (s->paused) session_resume(s);
+  if (s->linger == 0) {
+    lwsl_notice("killing session of a frontend that left, pid: %d\n", s->process->pid);
+    pty_kill(s->process, SIGHUP);
+    return;
+  }
+  if (s->timer == NULL) {
+    s->timer = xmalloc(sizeof(uv_timer_t));
+    uv_timer_init(loop, s->timer);
+    s->timer->data = s;
+  }
+  uv_timer_start(s->timer, linger_cb, (uint64_t)s->linger * 1000, 0);
+  lwsl_notice("detached session, pid: %d\n", s->process->pid);
+}
+
+static void conn_close(struct conn *conn) {
+  if (conn->session != NULL && conn->session->conn == conn) session_detach(conn->session, conn);
+  conn->session = NULL;
+  if (!uv_is_closing((uv_handle_t *)&conn->pipe)) uv_close((uv_handle_t *)&conn->pipe, conn_free_cb);
+}
+
+static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
+  dsession_t *s = (dsession_t *)process->ctx;
+  if (eof || buf == NULL) return;
+  ring_append(s, buf->base, buf->len);
+  s->end += buf->len;
+  struct conn *conn = s->conn;
+  if (conn != NULL) {
+    send_frame(conn, SESSIOND_OUTPUT, buf->base, buf->len, NULL, 0);
+    s->sent = s->end;
+  }
+  pty_buf_free(buf);
+
+  if (conn != NULL && uv_stream_get_write_queue_size((uv_stream_t *)&conn->pipe) >= SESSIOND_WRITE_MAX) {
+    s->paused = true;
+    return;
+  }
+  pty_resume(process);
+}
+
+static void process_exit_cb(pty_process *process) {
+  dsession_t *s = (dsession_t *)process->ctx;
+  lwsl_notice("session exited with code %d, pid: %d\n", process->exit_code, process->pid);
+  struct conn *conn = s->conn;
+  if (conn != NULL) {
+    int32_t status[2] = {process->exit_code, process->exit_signal};
+    send_frame(conn, SESSIOND_EXIT, status, sizeof(status), NULL, 0);
+    conn->session = NULL;
+    // the frames still queued go out before the connection closes
+    uv_shutdown_t *req = xmalloc(sizeof(uv_shutdown_t));
+    if (uv_shutdown(req, (uv_stream_t *)&conn->pipe, shutdown_cb) != 0) {
+      free(req);
+      conn_close(conn);
+    }
+  }
+  session_free(s);
+}
+
+// the session now belongs to conn: it learns the id and gets the output its client has not seen
+static void session_attach(dsession_t *s, struct conn *conn) {
+  if (s->conn != NULL) {
+    // a frontend that did not notice its client left, the newer one wins
+    struct conn *old = s->conn;
+    old->detached = true;
+    old->session = NULL;
+    s->conn = NULL;
+    conn_close(old);
+  }
+  if (s->timer != NULL) uv_timer_stop(s->timer);
+  s->conn = conn;
+  conn->session = s;
+
+  uint64_t from = s->acked;
+  if (s->end - from > SESSIOND_RING) from = s->end - SESSIOND_RING;
+  char reply[sizeof(int32_t) + sizeof(uint64_t)];
+  int32_t pid = s->process->pid;
+  memcpy(reply, &pid, sizeof(pid));
+  memcpy(reply + sizeof(pid), &from, sizeof(from));
+  send_frame(conn, SESSIOND_SESSION, reply, sizeof(reply), s->id, strlen(s->id));
+
+  size_t len = (size_t)(s->end - from);
+  if (len > 0) {
+    size_t pos = (size_t)(from % SESSIOND_RING);
+    size_t first = len < SESSIOND_RING - pos ? len : SESSIOND_RING - pos;
+    send_frame(conn, SESSIOND_OUTPUT, s->ring + pos, first, s->ring, len - first);
+  }
+  s->sent = s->end;
+  if (s->paused) session_resume(s);
+}
+
+static bool random_id(char *id, size_t len) {
+  unsigned char rand[(TICKET_LEN - 1) / 2];
+  if (len < TICKET_LEN || uv_random(NULL, NULL, rand, sizeof(rand), 0, NULL) != 0) return false;
+  for (size_t i = 0; i < sizeof(rand); i++) snprintf(id + i * 2, 3, "%02x", rand[i]);
+  return true;
+}
+
+static void handle_spawn(struct conn *conn, char *payload, uint32_t len) {
+  uint16_t columns, rows;
+  uint32_t linger;
+  if (len < 8 + 3 || payload[len - 1] != '\0') {
+    send_error(conn, "malformed spawn");
+    return;
+  }
+  memcpy(&columns, payload, sizeof(columns));
+  memcpy(&rows, payload + 2, sizeof(rows));
+  memcpy(&linger, payload + 4, sizeof(linger));
+
+  dsession_t *s = xmalloc(sizeof(dsession_t));
+  memset(s, 0, sizeof(dsession_t));
+  s->linger = linger;
+  s->strings = xmalloc(len - 8);
+  memcpy(s->strings, payload + 8, len - 8);
+  char *p = s->strings, *end = s->strings + len - 8;
+
+  snprintf(s->user, sizeof(s->user), "%s", p);
+  p += strlen(p) + 1;
+  char *cwd = p < end ? p : "";
+  p += strlen(cwd) + 1;
+  int argc = 0;
+  for (char *q = p; q < end && *q != '\0'; q += strlen(q) + 1) argc++;
+  if (argc == 0 || !random_id(s->id, sizeof(s->id))) {
+    free(s->strings);
+    free(s);
+    send_error(conn, argc == 0 ? "no command" : "no session id");
+    return;
+  }
+  char **argv = xmalloc((argc + 1) * sizeof(char *));
+  for (int i = 0; i < argc; i++, p += strlen(p) + 1) argv[i] = p;
+  argv[argc] = NULL;
+  p++;
+  int envc = 0;
+  for (char *q = p; q < end; q += strlen(q) + 1) envc++;
+  char **envp = xmalloc((envc + 1) * sizeof(char *));
+  for (int i = 0; i < envc; i++, p += strlen(p) + 1) envp[i] = strdup(p);
+  envp[envc] = NULL;
+
+  pty_process *process = process_init(s, loop, argv, envp);
+  if (*cwd != '\0') process->cwd = strdup(cwd);
+  if (columns > 0) process->columns = columns;
+  if (rows > 0) process->rows = rows;
+  if (pty_spawn(process, process_read_cb, process_exit_cb) != 0) {
+    lwsl_err("pty_spawn: %d (%s)\n", errno, strerror(errno));
+    process_free(process);
+    free(s->strings);
+    free(s);
+    send_error(conn, "spawn failed");
+    return;
+  }
+  s->process = process;
+  s->next = sessions;
+  if (sessions != NULL) sessions->prev = s;
+  sessions = s;
+  lwsl_notice("started session, pid: %d\n", process->pid);
+  session_attach(s, conn);
+  pty_resume(process);
+}
+
+static void handle_attach(struct conn *conn, char *payload, uint32_t len) {
+  if (len < 4 + 2 || payload[len - 1] != '\0') {
+    send_error(conn, "malformed attach");
+    return;
+  }
+  uint16_t columns, rows;
+  memcpy(&columns, payload, sizeof(columns));
+  memcpy(&rows, payload + 2, sizeof(rows));
+  const char *id = payload + 4;
+  const char *user = id + strlen(id) + 1;
+  if (user >= payload + len) user = "";
+
+  dsession_t *s = sessions;
+  while (s != NULL && strcmp(s->id, id) != 0) s = s->next;
+  if (s == NULL || strcmp(s->user, user) != 0) {
+    send_error(conn, "no such session");
+    return;
+  }
+  if (columns > 0 && rows > 0) {
+    s->process->columns = columns;
+    s->process->rows = rows;
+    pty_resize(s->process);
+  }
+  lwsl_notice("attached session, pid: %d\n", s->process->pid);
+  session_attach(s, conn);
+}
+
+static void handle_frame(struct conn *conn, char type, char *payload, uint32_t len) {
+  dsession_t *s = conn->session;
+  if (s == NULL) {
+    if (type == SESSIOND_SPAWN)
+      handle_spawn(conn, payload, len);
+    else if (type == SESSIOND_ATTACH)
+      handle_attach(conn, payload, len);
+    return;
+  }
+
+  switch (type) {
+    case SESSIOND_INPUT:
+      pty_write(s->process, pty_buf_init(payload, len));
+      break;
+    case SESSIOND_RESIZE:
+      if (len < 4) break;
+      memcpy(&s->process->columns, payload, sizeof(uint16_t));
+      memcpy(&s->process->rows, payload + 2, sizeof(uint16_t));
+      pty_resize(s->process);
+      break;
+    case SESSIOND_KILL: {
+      int32_t sig;
+      if (len < sizeof(sig)) break;
+      memcpy(&sig, payload, sizeof(sig));
+      if (sig == SIGSTOP || sig == SIGCONT)
+        pty_freeze(s->process, sig == SIGSTOP);
+      else
+        pty_kill(s->process, sig);
+      break;
+    }
+    case SESSIOND_DETACH: {
+      uint64_t offset;
+      if (len < sizeof(offset)) break;
+      memcpy(&offset, payload, sizeof(offset));
+      s->acked = offset < s->end ? offset : s->end;
+      conn->detached = true;
+      break;
+    }
+    default:
+      lwsl_warn("ignored unknown frame type: %c\n", type);
+      break;
+  }
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  buf->base = xmalloc(suggested_size);
+  buf->len = suggested_size;
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
+  struct conn *conn = (struct conn *)stream->data;
+  if (n < 0) {
+    free(buf->base);
+    conn_close(conn);
+    return;
+  }
+  sessiond_feed(&conn->reader, buf->base, (size_t)n);
+  free(buf->base);
+
+  char type;
+  char *payload;
+  uint32_t len;
+  while (!uv_is_closing((uv_handle_t *)stream) && sessiond_next(&conn->reader, &type, &payload, &len))
+    handle_frame(conn, type, payload, len);
+}
+
+static void connection_cb(uv_stream_t *server, int status) {
+  if (status < 0) return;
+  struct conn *conn = xmalloc(sizeof(struct conn));
+  memset(conn, 0, sizeof(struct conn));
+  uv_pipe_init(loop, &conn->pipe, 0);
+  conn->pipe.data = conn;
+  if (uv_accept(server, (uv_stream_t *)&conn->pipe) != 0) {
+    uv_close((uv_handle_t *)&conn->pipe, conn_free_cb);
+    return;
+  }
+  uv_read_start((uv_stream_t *)&conn->pipe, alloc_cb, read_cb);
+}
+
+int sessiond_run(uv_loop_t *uv_loop, const char *path) {
+  loop = uv_loop;
+  uv_pipe_t server;
+  uv_pipe_init(loop, &server, 0);
+
+  // whoever can connect runs commands, only our own user may
+  unlink(path);
+  mode_t mask = umask(0077);
+  int err = uv_pipe_bind(&server, path);
+  umask(mask);
+  if (err == 0) err = uv_listen((uv_stream_t *)&server, 128, connection_cb);
+  if (err != 0) {
+    lwsl_err("sessiond: can not listen on %s: %s\n", path, uv_strerror(err));
+    return 1;
+  }
+
+  lwsl_notice("ttyd session daemon listening on %s\n", path);
+  uv_run(loop, UV_RUN_DEFAULT);
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef TTYD_SESSIOND_H
+#define TTYD_SESSIOND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// frames on a session daemon connection: a type byte and the 32 bit payload length, then the payload,
+// integers in host byte order as both ends run on the same host
+#define SESSIOND_HDR 5
+
+// frontend: u16 columns, u16 rows, u32 seconds to keep it detached (0: killed once detached),
+// then nul terminated user, cwd (empty for none), argv..., an empty string and envp...
+#define SESSIOND_SPAWN 'S'
+// frontend: u16 columns, u16 rows, then nul terminated id and user
+#define SESSIOND_ATTACH 'A'
+// daemon, the reply to both: i32 pid, u64 output offset the replay starts at, then the session id
+#define SESSIOND_SESSION 's'
+// daemon, the other reply: a message
+#define SESSIOND_ERROR 'e'
+// frontend: bytes for the pty
+#define SESSIOND_INPUT 'i'
+// daemon: bytes from the pty
+#define SESSIOND_OUTPUT 'o'
+// frontend: u16 columns, u16 rows
+#define SESSIOND_RESIZE 'r'
+// frontend: i32 signal for the process group
+#define SESSIOND_KILL 'k'
+// frontend, before it lets go of the session: u64 output offset its client got up to
+#define SESSIOND_DETACH 'd'
+// daemon: i32 exit code, i32 signal, the last frame
+#define SESSIOND_EXIT 'x'
+
+// bytes read from a connection, complete frames are taken out with sessiond_next()
+typedef struct {
+  char *base;
+  size_t len;
+  size_t pos;
+} sessiond_reader_t;
+
+void sessiond_feed(sessiond_reader_t *reader, const char *data, size_t len);
+// the next complete frame, its payload stays valid until the next sessiond_feed()
+bool sessiond_next(sessiond_reader_t *reader, char *type, char **payload, uint32_t *len);
+void sessiond_reader_free(sessiond_reader_t *reader);
+// a frame of two payload parts (either may be empty), its base is freed by the uv_write() callback
+uv_buf_t sessiond_frame(char type, const void *data, size_t len, const void *extra, size_t extra_len);
+
+// run the session daemon on the unix socket at path until it is killed, see --sessiond-listen
+int sessiond_run(uv_loop_t *loop, const char *path);
+
+#endif  // TTYD_SESSIOND_H
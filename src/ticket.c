@@ -0,0 +1,133 @@
+#include "ticket.h"
+
+#include <libwebsockets.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "utils.h"
+
+// the page that carries the ticket opens its websocket right away, so this can be short
+#define TICKET_TTL_MS 30000
+// upper bound on outstanding tickets, further index requests fall back to /token
+#define TICKET_MAX 4096
+// how often tickets holding data are checked for expiry
+#define TICKET_SWEEP_MS 1000
+
+typedef struct ticket_ {
+  char id[TICKET_LEN];
+  char user[30];
+  uint64_t expires;
+  void *data;
+  ticket_release_cb release;
+  struct ticket_ *next;
+} ticket_t;
+
+static ticket_t *tickets = NULL;
+static int ticket_count = 0;
+static int data_count = 0;
+static uv_timer_t *sweep_timer = NULL;
+
+// unlinks the ticket and returns its data, the caller owns it from now on
+static void *ticket_free(ticket_t **link) {
+  ticket_t *t = *link;
+  void *data = t->data;
+  *link = t->next;
+  if (data != NULL) data_count--;
+  free(t);
+  ticket_count--;
+  return data;
+}
+
+static void ticket_release(ticket_t **link) {
+  ticket_release_cb release = (*link)->release;
+  void *data = ticket_free(link);
+  if (data != NULL && release != NULL) release(data);
+}
+
+static void prune(uint64_t now) {
+  ticket_t **link = &tickets;
+  while (*link != NULL) {
+    if ((*link)->expires <= now)
+      ticket_release(link);
+    else
+      link = &(*link)->next;
+  }
+  if (data_count == 0 && sweep_timer != NULL) uv_timer_stop(sweep_timer);
+}
+
+static void sweep_cb(uv_timer_t *timer) { prune(uv_now(timer->loop)); }
+
+static void timer_close_cb(uv_handle_t *handle) { free(handle); }
+
+bool ticket_random_id(char *id, size_t len) {
+  unsigned char rand[(TICKET_LEN - 1) / 2];
+  if (len < TICKET_LEN || lws_get_random(context, rand, sizeof(rand)) != sizeof(rand)) return false;
+  for (size_t i = 0; i < sizeof(rand); i++) snprintf(id + i * 2, 3, "%02x", rand[i]);
+  return true;
+}
+
+bool ticket_issue(const char *user, void *data, ticket_release_cb release, char *id, size_t len) {
+  uint64_t now = uv_now(server->loop);
+  prune(now);
+  if (ticket_count >= TICKET_MAX || len < TICKET_LEN) return false;
+
+  ticket_t *t = xmalloc(sizeof(ticket_t));
+  if (!ticket_random_id(t->id, sizeof(t->id))) {
+    free(t);
+    return false;
+  }
+  snprintf(t->user, sizeof(t->user), "%s", user != NULL ? user : "");
+  t->expires = now + TICKET_TTL_MS;
+  t->data = data;
+  t->release = release;
+  t->next = tickets;
+  tickets = t;
+  ticket_count++;
+
+  // plain tickets expire lazily, data such as a spawned process must not outlive its ticket
+  if (data != NULL && data_count++ == 0) {
+    if (sweep_timer == NULL) {
+      sweep_timer = xmalloc(sizeof(uv_timer_t));
+      uv_timer_init(server->loop, sweep_timer);
+    }
+    uv_timer_start(sweep_timer, sweep_cb, TICKET_SWEEP_MS, TICKET_SWEEP_MS);
+  }
+
+  snprintf(id, len, "%s", t->id);
+  return true;
+}
+
+bool ticket_claim(const char *id, const char *user, void **data) {
+  *data = NULL;
+  prune(uv_now(server->loop));
+  for (ticket_t **link = &tickets; *link != NULL; link = &(*link)->next) {
+    if (strcmp((*link)->id, id) != 0) continue;
+    if (strcmp((*link)->user, user != NULL ? user : "") != 0) {
+      ticket_release(link);
+      return false;
+    }
+    *data = ticket_free(link);
+    return true;
+  }
+  return false;
+}
+
+void ticket_detach(const void *data) {
+  for (ticket_t *t = tickets; t != NULL; t = t->next) {
+    if (t->data != data) continue;
+    t->data = NULL;
+    data_count--;
+    break;
+  }
+}
+
+void ticket_close() {
+  while (tickets != NULL) ticket_release(&tickets);
+  if (sweep_timer != NULL) {
+    uv_timer_stop(sweep_timer);
+    uv_close((uv_handle_t *)sweep_timer, timer_close_cb);
+    sweep_timer = NULL;
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef TTYD_TICKET_H
+#define TTYD_TICKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// hex chars of a ticket id, plus the terminating null
+#define TICKET_LEN 33
+
+// called with the data of a ticket that expired or was claimed by the wrong user
+typedef void (*ticket_release_cb)(void *data);
+
+// fill id with TICKET_LEN - 1 random hex chars
+bool ticket_random_id(char *id, size_t len);
+// issue a single-use ticket for user (may be empty), valid for a few seconds,
+// data (may be NULL) goes to whoever claims it, or to release if nobody does
+bool ticket_issue(const char *user, void *data, ticket_release_cb release, char *id, size_t len);
+// consume the ticket, true if it existed, has not expired and belongs to user
+bool ticket_claim(const char *id, const char *user, void **data);
+// forget data that went away on its own before the ticket was claimed
+void ticket_detach(const void *data);
+// drop all tickets, releasing their data
+void ticket_close();
+
+#endif  // TTYD_TICKET_H
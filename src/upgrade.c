@@ -0,0 +1,390 @@
+#include "upgrade.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pty.h"
+#include "server.h"
+#include "utils.h"
+
+// how long the old process waits for the new one to listen, it serves nobody meanwhile
+#define UPGRADE_TIMEOUT_MS 10000
+// time the close frames get to reach the clients before the old process exits
+#define UPGRADE_DRAIN_MS 1000
+// bumped whenever the records change, a ttyd speaking another version refuses the handover
+#define UPGRADE_VERSION 1
+// the new process finds the handover socket here, see upgrade_start()
+#define UPGRADE_FD 3
+
+enum { UPGRADE_HELLO = 1, UPGRADE_LISTEN, UPGRADE_SESSION, UPGRADE_END };
+
+// a record on the handover socket, its fd (if any) arrives with the first byte
+struct upgrade_record {
+  uint32_t type;
+  uint32_t len;  // bytes of payload that follow
+};
+
+extern char **environ;
+
+extern pty_ctx_t *process_sessions();
+extern bool process_movable(pty_ctx_t *ctx);
+extern bool process_adopt(int pty, const struct upgrade_session *session, pty_buf_t *pending);
+extern void process_handoff(int pid, int port);
+
+static struct {
+  uv_loop_t *loop;
+  char **argv;
+  uv_process_t *child;  // the new ttyd, while it takes over
+  int sock;             // new process: the handover socket, until upgrade_done()
+  uv_timer_t drain;
+} upgrade = {.sock = -1};
+
+void upgrade_init(uv_loop_t *loop, int argc, char **argv) {
+  upgrade.loop = loop;
+  // getopt permutes argv
+  upgrade.argv = xmalloc((argc + 1) * sizeof(char *));
+  memcpy(upgrade.argv, argv, argc * sizeof(char *));
+  upgrade.argv[argc] = NULL;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, void *data, size_t len) {
+  char *p = data;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool send_record(int sock, uint32_t type, int fd, const void *data, size_t len, const void *extra,
+                        size_t extra_len) {
+  struct upgrade_record rec = {type, (uint32_t)(len + extra_len)};
+  struct iovec iov = {&rec, sizeof(rec)};
+  struct msghdr msg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } cmsg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(&cmsg, 0, sizeof(cmsg));
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  }
+
+  ssize_t n;
+  do
+    n = sendmsg(sock, &msg, 0);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0) return false;
+  return write_all(sock, (char *)&rec + n, sizeof(rec) - (size_t)n) && write_all(sock, data, len) &&
+         write_all(sock, extra, extra_len);
+}
+
+static bool recv_record(int sock, struct upgrade_record *rec, int *fd) {
+  struct iovec iov = {rec, sizeof(*rec)};
+  struct msghdr msg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } cmsg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg.buf;
+  msg.msg_controllen = sizeof(cmsg.buf);
+
+  *fd = -1;
+  ssize_t n;
+  do
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0) return false;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) memcpy(fd, CMSG_DATA(c), sizeof(int));
+  }
+  return read_all(sock, (char *)rec + n, sizeof(*rec) - (size_t)n);
+}
+
+// lws keeps its listening socket to itself, it is the one open socket accepting connections
+static int find_listen_fd() {
+  long max = sysconf(_SC_OPEN_MAX);
+  if (max < 0 || max > 65536) max = 65536;
+  for (int fd = 0; fd < max; fd++) {
+    int accepting = 0;
+    socklen_t len = sizeof(accepting);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == 0 && accepting) return fd;
+  }
+  return -1;
+}
+
+bool upgrade_send(int sock, int listen_fd, int pid, int *count) {
+  uint32_t version = UPGRADE_VERSION;
+  if (!send_record(sock, UPGRADE_HELLO, -1, &version, sizeof(version), NULL, 0)) return false;
+  if (listen_fd >= 0 && !send_record(sock, UPGRADE_LISTEN, listen_fd, NULL, 0, NULL, 0)) return false;
+
+  *count = 0;
+  for (pty_ctx_t *ctx = process_sessions(); ctx != NULL; ctx = ctx->next) {
+    if (!process_movable(ctx) || (pid > 0 && ctx->process->pid != pid)) continue;
+
+    struct upgrade_session session;
+    memset(&session, 0, sizeof(session));
+    session.pid = ctx->process->pid;
+    session.columns = ctx->process->columns;
+    session.rows = ctx->process->rows;
+    snprintf(session.id, sizeof(session.id), "%s", ctx->id);
+    snprintf(session.user, sizeof(session.user), "%s", ctx->user);
+    session.frozen = ctx->frozen;
+
+    // output read from the pty that its client did not get yet
+    const char *pending = NULL;
+    size_t len = 0;
+    if (ctx->parked && ctx->pty_buf != NULL) {
+      pending = ctx->pty_buf->base;
+      len = ctx->pty_buf->len;
+    } else if (ctx->pss != NULL && ctx->pss->pty_buf != NULL) {
+      pending = ctx->pss->pty_buf->base + ctx->pss->pty_off;
+      len = ctx->pss->pty_buf->len - ctx->pss->pty_off;
+    }
+    session.pending_len = (uint32_t)len;
+
+    if (!send_record(sock, UPGRADE_SESSION, ctx->process->pty, &session, sizeof(session), pending, len))
+      return false;
+    (*count)++;
+  }
+
+  return send_record(sock, UPGRADE_END, -1, NULL, 0, NULL, 0);
+}
+
+struct received {
+  int fd;
+  struct upgrade_session session;
+  pty_buf_t *pending;
+};
+
+bool upgrade_recv(int sock, int *listen_fd, int *count) {
+  struct upgrade_record rec;
+  int fd;
+  uint32_t version = 0;
+  *listen_fd = -1;
+  *count = 0;
+  if (!recv_record(sock, &rec, &fd) || rec.type != UPGRADE_HELLO || rec.len != sizeof(version) ||
+      !read_all(sock, &version, sizeof(version)) || version != UPGRADE_VERSION)
+    return false;
+
+  // nothing is adopted before the end arrived, the sender keeps the sessions of a broken handover
+  struct received *received = NULL;
+  int n = 0;
+  bool ok = false;
+  while (recv_record(sock, &rec, &fd)) {
+    if (rec.type == UPGRADE_LISTEN) {
+      *listen_fd = fd;
+      continue;
+    }
+    if (rec.type == UPGRADE_END) {
+      ok = true;
+      break;
+    }
+    struct upgrade_session session;
+    if (rec.type != UPGRADE_SESSION || fd < 0 || rec.len < sizeof(session) ||
+        !read_all(sock, &session, sizeof(session)) || rec.len - sizeof(session) != session.pending_len) {
+      if (fd >= 0) close(fd);
+      break;
+    }
+    session.id[sizeof(session.id) - 1] = '\0';
+    session.user[sizeof(session.user) - 1] = '\0';
+
+    received = xrealloc(received, (n + 1) * sizeof(struct received));
+    received[n].fd = fd;
+    received[n].session = session;
+    received[n].pending = NULL;
+    n++;
+    if (session.pending_len > 0) {
+      pty_buf_t *pending = xmalloc(sizeof(pty_buf_t));
+      pending->base = xmalloc(session.pending_len);
+      pending->len = session.pending_len;
+      received[n - 1].pending = pending;
+      if (!read_all(sock, pending->base, pending->len)) break;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (ok && process_adopt(received[i].fd, &received[i].session, received[i].pending)) {
+      (*count)++;
+      continue;
+    }
+    if (!ok) {
+      close(received[i].fd);
+      pty_buf_free(received[i].pending);
+    }
+  }
+  free(received);
+  if (!ok && *listen_fd >= 0) {
+    close(*listen_fd);
+    *listen_fd = -1;
+  }
+  return ok;
+}
+
+static bool wait_ready(int sock) {
+  struct pollfd pfd = {sock, POLLIN, 0};
+  int n;
+  do
+    n = poll(&pfd, 1, UPGRADE_TIMEOUT_MS);
+  while (n < 0 && errno == EINTR);
+  char c;
+  return n > 0 && read(sock, &c, 1) == 1;
+}
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static void child_exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+  lwsl_warn("upgrade: new ttyd exited with code %d, signal %d\n", (int)exit_status, term_signal);
+  upgrade.child = NULL;
+  uv_close((uv_handle_t *)process, close_cb);
+}
+
+static void drained() {
+  // server_free() would unlink the unix socket the new process listens on now
+  lwsl_notice("upgrade: done, exiting...\n");
+  exit(0);
+}
+
+static void drain_cb(uv_timer_t *timer) { drained(); }
+
+void upgrade_start() {
+#if LWS_LIBRARY_VERSION_NUMBER < 4002000
+  lwsl_err("upgrade: needs libwebsockets 4.2 or later to listen on an inherited socket\n");
+  return;
+#endif
+  if (upgrade.child != NULL) {
+    lwsl_warn("upgrade: already under way\n");
+    return;
+  }
+  int listen_fd = find_listen_fd();
+  if (listen_fd < 0) {
+    lwsl_err("upgrade: no listening socket\n");
+    return;
+  }
+  if (server->resume_timeout == 0) lwsl_warn("upgrade: sessions end with this process without --resume-timeout\n");
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    lwsl_err("upgrade: socketpair: %d (%s)\n", errno, strerror(errno));
+    return;
+  }
+
+  int n = 0;
+  while (environ[n] != NULL) n++;
+  char **env = xmalloc((n + 2) * sizeof(char *));
+  memcpy(env, environ, n * sizeof(char *));
+  char fd_env[32];
+  snprintf(fd_env, sizeof(fd_env), "%s=%d", UPGRADE_ENV, UPGRADE_FD);
+  env[n] = fd_env;
+  env[n + 1] = NULL;
+
+  uv_stdio_container_t stdio[UPGRADE_FD + 1];
+  for (int i = 0; i <= UPGRADE_FD; i++) {
+    stdio[i].flags = UV_INHERIT_FD;
+    stdio[i].data.fd = i == UPGRADE_FD ? sv[1] : i;
+  }
+
+  // argv[0] rather than /proc/self/exe, which is the old binary when a new one was installed over it
+  uv_process_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.exit_cb = child_exit_cb;
+  options.file = upgrade.argv[0];
+  options.args = upgrade.argv;
+  options.env = env;
+  options.stdio_count = UPGRADE_FD + 1;
+  options.stdio = stdio;
+
+  upgrade.child = xmalloc(sizeof(uv_process_t));
+  int err = uv_spawn(upgrade.loop, upgrade.child, &options);
+  free(env);
+  close(sv[1]);
+  if (err != 0) {
+    lwsl_err("upgrade: uv_spawn: %s (%s)\n", uv_err_name(err), uv_strerror(err));
+    uv_close((uv_handle_t *)upgrade.child, close_cb);
+    upgrade.child = NULL;
+    close(sv[0]);
+    return;
+  }
+  lwsl_notice("upgrade: started new ttyd, pid: %d\n", upgrade.child->pid);
+
+  // nothing is read from the ptys until the new process took over or gave up, so no output is lost
+  int count = 0;
+  bool ok = upgrade_send(sv[0], listen_fd, 0, &count) && wait_ready(sv[0]);
+  close(sv[0]);
+  if (!ok) {
+    lwsl_err("upgrade: new ttyd did not take over, serving on\n");
+    if (upgrade.child != NULL) uv_process_kill(upgrade.child, SIGKILL);
+    return;
+  }
+
+  lwsl_notice("upgrade: pid %d took over %d session(s)\n", upgrade.child->pid, count);
+  process_handoff(0, 0);
+  // new clients go to the new process only: this one closes its listening sockets, the kernel keeps the
+  // shared one open for the new process; it exits once its last client left, or when the drain ends
+  lws_context_deprecate(context, drained);
+  uv_timer_init(upgrade.loop, &upgrade.drain);
+  uv_timer_start(&upgrade.drain, drain_cb, UPGRADE_DRAIN_MS, 0);
+}
+
+int upgrade_receive() {
+  const char *env = getenv(UPGRADE_ENV);
+  if (env == NULL) return -1;
+  int sock = atoi(env);
+  // commands spawned later must not see it
+  unsetenv(UPGRADE_ENV);
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+  int listen_fd, count;
+  if (upgrade_recv(sock, &listen_fd, &count) && listen_fd >= 0) {
+    lwsl_notice("upgrade: took over %d session(s)\n", count);
+    upgrade.sock = sock;
+    return listen_fd;
+  }
+
+  // binding on our own would steal a unix socket path from the old process, which keeps serving
+  lwsl_err("upgrade: broken handover, exiting\n");
+  exit(EXIT_FAILURE);
+}
+
+void upgrade_done() {
+  if (upgrade.sock < 0) return;
+  char c = 1;
+  if (write(upgrade.sock, &c, 1) != 1) lwsl_warn("upgrade: old ttyd went away: %d (%s)\n", errno, strerror(errno));
+  close(upgrade.sock);
+  upgrade.sock = -1;
+}
@@ -0,0 +1,42 @@
+#ifndef TTYD_UPGRADE_H
+#define TTYD_UPGRADE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+#include "ticket.h"
+
+// set in the environment of the new ttyd, the fd of the socket it receives the handover on
+#define UPGRADE_ENV "TTYD_UPGRADE_FD"
+
+// a session as it travels to the new process, its pty master fd rides along and its pending output follows
+struct upgrade_session {
+  int32_t pid;
+  uint16_t columns, rows;
+  char id[TICKET_LEN];
+  char user[30];
+  uint8_t frozen;
+  uint32_t pending_len;
+};
+
+// the record stream sessions are handed over with, by an upgrade or a migration (see migrate.c):
+// send the listening socket (unless listen_fd < 0) and the sessions of pid (0: all of them),
+// count gets how many went
+bool upgrade_send(int sock, int listen_fd, int pid, int *count);
+// receive what upgrade_send() sent and adopt the sessions once all of them arrived, none on failure,
+// listen_fd gets the listening socket or -1
+bool upgrade_recv(int sock, int *listen_fd, int *count);
+
+// remember how ttyd was started, the new binary is started the same way
+void upgrade_init(uv_loop_t *loop, int argc, char **argv);
+// SIGUSR2: exec the ttyd binary again and hand it the listening socket and the resumable sessions,
+// this process exits once the new one listens, or keeps serving if that failed
+void upgrade_start();
+// in the new process, before the vhost is created: receive the handover, adopting its sessions,
+// returns the listening socket, or -1 if ttyd was not started by an upgrade
+int upgrade_receive();
+// the vhost listens on the socket, let the old process go
+void upgrade_done();
+
+#endif  // TTYD_UPGRADE_H
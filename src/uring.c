@@ -0,0 +1,405 @@
+#include "uring.h"
+
+#ifdef TTYD_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define URING_ENTRIES 1024
+// the provided buffers all ptys read into, a read takes one only once the pty has output, an idle session none;
+// a power of two
+#define URING_BUFS 64
+#define URING_BUF_SIZE 65536
+#define URING_BGID 0
+
+// the low bits of user_data say what a completion was for, the rest points to its struct uring_io;
+// a user_data of 0 is a cancel, nothing waits for those
+enum { OP_READ = 1, OP_WRITE = 2, OP_HELD = 3 };
+#define OP_MASK 3
+
+struct write_req {
+  pty_buf_t *buf;
+  size_t off;  // written so far
+  struct write_req *next;
+};
+
+struct uring_io {
+  pty_process *process;  // NULL once freed, the struct lives until its last request completed
+  int fd;
+  int inflight;          // requests the kernel has
+  bool paused;
+  bool reading;          // a read (or the delivery of held) is in flight
+  pty_buf_t *held;       // read while pausing, handed out on resume
+  struct write_req *writes, *last;  // the first one is in flight
+};
+
+static struct {
+  bool active;
+  int fd;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_len, cq_ring_len, sqes_len;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+  unsigned sqe_tail;  // sqes handed out, published to the kernel on submit
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  unsigned short br_tail;
+  int efd;  // signalled by the kernel on completions
+  uv_poll_t poll;
+  uv_prepare_t prepare;
+} ring = {.fd = -1, .efd = -1};
+
+static int sys_enter(unsigned to_submit) {
+  return (int) syscall(SYS_io_uring_enter, ring.fd, to_submit, 0, 0, NULL, 0);
+}
+
+// hand the queued sqes to the kernel, all in one syscall
+static void submit() {
+  unsigned pending = ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+  if (pending == 0) return;
+  __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+  while (sys_enter(pending) < 0 && errno == EINTR)
+    ;
+}
+
+static struct io_uring_sqe *get_sqe() {
+  if (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) submit();
+  if (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) return NULL;
+  unsigned idx = ring.sqe_tail & *ring.sq_mask;
+  ring.sq_array[idx] = idx;
+  ring.sqe_tail++;
+  struct io_uring_sqe *sqe = &ring.sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+static void buf_return(unsigned short bid) {
+  struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+  b->addr = (uintptr_t) (ring.bufs + (size_t) bid * URING_BUF_SIZE);
+  b->len = URING_BUF_SIZE;
+  b->bid = bid;
+  ring.br_tail++;
+  __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static bool queue(struct uring_io *io, int op, uint8_t opcode, void *addr, unsigned len) {
+  struct io_uring_sqe *sqe = get_sqe();
+  if (sqe == NULL) {
+    lwsl_err("io_uring: submission queue full\n");
+    return false;
+  }
+  sqe->opcode = opcode;
+  sqe->fd = io->fd;
+  sqe->addr = (uintptr_t) addr;
+  sqe->len = len;
+  sqe->off = (uint64_t) -1;  // ptys have no offset
+  sqe->user_data = (uintptr_t) io | op;
+  if (op == OP_READ) {
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+  }
+  io->inflight++;
+  return true;
+}
+
+static void cancel(struct uring_io *io, int op) {
+  struct io_uring_sqe *sqe = get_sqe();
+  if (sqe == NULL) return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t) io | op;
+}
+
+static void read_start(struct uring_io *io) {
+  io->reading = io->held != NULL ? queue(io, OP_HELD, IORING_OP_NOP, NULL, 0)
+                                 : queue(io, OP_READ, IORING_OP_READ, NULL, URING_BUF_SIZE);
+}
+
+static void write_start(struct uring_io *io) {
+  struct write_req *req = io->writes;
+  if (!queue(io, OP_WRITE, IORING_OP_WRITE, req->buf->base + req->off, (unsigned) (req->buf->len - req->off))) {
+    io->writes = req->next;
+    pty_buf_free(req->buf);
+    free(req);
+    if (io->writes != NULL) write_start(io);
+  }
+}
+
+static void read_done(struct uring_io *io, int res, unsigned flags) {
+  io->reading = false;
+  pty_buf_t *buf = NULL;
+  if (flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = (unsigned short) (flags >> IORING_CQE_BUFFER_SHIFT);
+    if (res > 0 && io->process != NULL) buf = pty_buf_init(ring.bufs + (size_t) bid * URING_BUF_SIZE, (size_t) res);
+    buf_return(bid);
+  }
+  pty_process *process = io->process;
+  if (process == NULL) return;
+
+  // cancelled by a pause, or out of buffers for the moment: read again unless still paused
+  if (res == -ECANCELED || res == -ENOBUFS || res == -EAGAIN || res == -EINTR) {
+    if (!io->paused) read_start(io);
+    return;
+  }
+  if (res <= 0) {
+    process->read_cb(process, NULL, true);
+    return;
+  }
+  if (io->paused) {
+    io->held = buf;
+    return;
+  }
+  process->read_cb(process, buf, false);
+}
+
+static void held_done(struct uring_io *io) {
+  io->reading = false;
+  if (io->process == NULL || io->paused || io->held == NULL) return;
+  pty_buf_t *buf = io->held;
+  io->held = NULL;
+  io->process->read_cb(io->process, buf, false);
+}
+
+static void write_done(struct uring_io *io, int res) {
+  struct write_req *req = io->writes;
+  if (res > 0) req->off += (size_t) res;
+  // a failed write is dropped like libuv drops it, the pty is most likely gone
+  bool retry = res == -EAGAIN || res == -EINTR;
+  if (io->process == NULL || (!retry && (res <= 0 || req->off == req->buf->len))) {
+    io->writes = req->next;
+    pty_buf_free(req->buf);
+    free(req);
+  }
+  if (io->process != NULL && io->writes != NULL) write_start(io);
+}
+
+static void complete(uint64_t user_data, int res, unsigned flags) {
+  struct uring_io *io = (struct uring_io *) (uintptr_t) (user_data & ~(uint64_t) OP_MASK);
+  if (io == NULL) return;
+  switch (user_data & OP_MASK) {
+    case OP_READ:
+      read_done(io, res, flags);
+      break;
+    case OP_HELD:
+      held_done(io);
+      break;
+    case OP_WRITE:
+      write_done(io, res);
+      break;
+  }
+  // only now, the callbacks above may have freed the process
+  if (--io->inflight == 0 && io->process == NULL) free(io);
+}
+
+static void poll_cb(uv_poll_t *handle, int status, int events) {
+  uint64_t n;
+  while (read(ring.efd, &n, sizeof(n)) < 0 && errno == EINTR)
+    ;
+  unsigned head = *ring.cq_head;
+  for (;;) {
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) break;
+    struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+    __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+    complete(cqe.user_data, cqe.res, cqe.flags);
+  }
+  submit();
+}
+
+// right before the loop blocks: everything queued during this iteration goes out at once
+static void prepare_cb(uv_prepare_t *handle) { submit(); }
+
+bool uring_enabled() { return ring.active; }
+
+static void *map(size_t len, int fd, off_t offset) {
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : MAP_POPULATE), fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static void unmap() {
+  if (ring.sq_ring != NULL) munmap(ring.sq_ring, ring.sq_ring_len);
+  if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_ring_len);
+  if (ring.sqes != NULL) munmap(ring.sqes, ring.sqes_len);
+  if (ring.br != NULL) munmap(ring.br, URING_BUFS * sizeof(struct io_uring_buf));
+  if (ring.bufs != NULL) munmap(ring.bufs, (size_t) URING_BUFS * URING_BUF_SIZE);
+  if (ring.efd >= 0) close(ring.efd);
+  if (ring.fd >= 0) close(ring.fd);
+  ring.sq_ring = ring.cq_ring = ring.sqes = NULL;
+  ring.br = NULL;
+  ring.bufs = NULL;
+  ring.efd = ring.fd = -1;
+}
+
+bool uring_init(uv_loop_t *loop) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CLAMP;
+  ring.fd = (int) syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+  if (ring.fd < 0) {
+    lwsl_warn("io_uring: setup: %s\n", strerror(errno));
+    return false;
+  }
+
+  ring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring.cq_ring_len > ring.sq_ring_len) ring.sq_ring_len = ring.cq_ring_len;
+    ring.cq_ring_len = ring.sq_ring_len;
+  }
+  ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sq_ring = map(ring.sq_ring_len, ring.fd, IORING_OFF_SQ_RING);
+  ring.cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring.sq_ring
+                                                         : map(ring.cq_ring_len, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = map(ring.sqes_len, ring.fd, IORING_OFF_SQES);
+  ring.br = map(URING_BUFS * sizeof(struct io_uring_buf), -1, 0);
+  ring.bufs = map((size_t) URING_BUFS * URING_BUF_SIZE, -1, 0);
+  if (ring.sq_ring == NULL || ring.cq_ring == NULL || ring.sqes == NULL || ring.br == NULL || ring.bufs == NULL) {
+    lwsl_warn("io_uring: mmap: %s\n", strerror(errno));
+    goto failed;
+  }
+
+  char *sq = ring.sq_ring, *cq = ring.cq_ring;
+  ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring.sq_entries = p.sq_entries;
+  ring.sqe_tail = *ring.sq_tail;
+  ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) ring.br;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = URING_BGID;
+  if (syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    lwsl_warn("io_uring: provided buffer ring: %s\n", strerror(errno));
+    goto failed;
+  }
+  for (unsigned short i = 0; i < URING_BUFS; i++) buf_return(i);
+
+  ring.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (ring.efd < 0 || syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD, &ring.efd, 1) != 0) {
+    lwsl_warn("io_uring: eventfd: %s\n", strerror(errno));
+    goto failed;
+  }
+
+  uv_poll_init(loop, &ring.poll, ring.efd);
+  uv_poll_start(&ring.poll, UV_READABLE, poll_cb);
+  uv_prepare_init(loop, &ring.prepare);
+  uv_prepare_start(&ring.prepare, prepare_cb);
+  // the sessions keep the loop alive, not the ring
+  uv_unref((uv_handle_t *) &ring.poll);
+  uv_unref((uv_handle_t *) &ring.prepare);
+  ring.active = true;
+  return true;
+
+failed:
+  unmap();
+  return false;
+}
+
+void uring_close() {
+  if (!ring.active) return;
+  uv_poll_stop(&ring.poll);
+  uv_prepare_stop(&ring.prepare);
+  uv_close((uv_handle_t *) &ring.poll, NULL);
+  uv_close((uv_handle_t *) &ring.prepare, NULL);
+  unmap();
+  ring.active = false;
+}
+
+int uring_open(pty_process *process, int fd) {
+  // a read on a non-blocking fd fails with EAGAIN instead of waiting for output in the kernel
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) return -errno;
+  struct uring_io *io = xmalloc(sizeof(struct uring_io));
+  memset(io, 0, sizeof(struct uring_io));
+  io->process = process;
+  io->fd = fd;
+  io->paused = true;
+  process->uring = io;
+  return 0;
+}
+
+void uring_pause(pty_process *process) {
+  struct uring_io *io = process->uring;
+  if (io->paused) return;
+  io->paused = true;
+  // right away: nothing may be read once paused, the pty could be moving to another process
+  if (io->reading) {
+    cancel(io, OP_READ);
+    submit();
+  }
+}
+
+void uring_resume(pty_process *process) {
+  struct uring_io *io = process->uring;
+  io->paused = false;
+  if (!io->reading) read_start(io);
+}
+
+int uring_write(pty_process *process, pty_buf_t *buf) {
+  struct uring_io *io = process->uring;
+  struct write_req *req = xmalloc(sizeof(struct write_req));
+  req->buf = buf;
+  req->off = 0;
+  req->next = NULL;
+  // one write at a time, the kernel may run queued ones out of order
+  if (io->writes == NULL) {
+    io->writes = io->last = req;
+    write_start(io);
+  } else {
+    io->last->next = req;
+    io->last = req;
+  }
+  return 0;
+}
+
+void uring_free(pty_process *process) {
+  struct uring_io *io = process->uring;
+  process->uring = NULL;
+  io->process = NULL;
+  pty_buf_free(io->held);
+  io->held = NULL;
+  // the one in flight is freed by its completion
+  struct write_req *req = io->writes != NULL ? io->writes->next : NULL;
+  while (req != NULL) {
+    struct write_req *next = req->next;
+    pty_buf_free(req->buf);
+    free(req);
+    req = next;
+  }
+  if (io->writes != NULL) io->writes->next = NULL;
+  if (io->inflight == 0) {
+    free(io);
+    return;
+  }
+  // a read in flight keeps the pty open after it was closed, until it is cancelled
+  if (io->reading) cancel(io, OP_READ);
+  if (io->writes != NULL) cancel(io, OP_WRITE);
+}
+#else
+bool uring_init(uv_loop_t *loop) { return false; }
+bool uring_enabled() { return false; }
+void uring_close() {}
+int uring_open(pty_process *process, int fd) { return UV_ENOSYS; }
+void uring_pause(pty_process *process) {}
+void uring_resume(pty_process *process) {}
+int uring_write(pty_process *process, pty_buf_t *buf) { return UV_ENOSYS; }
+void uring_free(pty_process *process) {}
+#endif
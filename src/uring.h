@@ -0,0 +1,25 @@
+#ifndef TTYD_URING_H
+#define TTYD_URING_H
+
+#include <stdbool.h>
+#include <uv.h>
+
+#include "pty.h"
+
+// --io-uring: the ptys of the loop are read and written through one io_uring, its submissions go to the
+// kernel in a single batch per loop iteration; reads land in a shared ring of provided buffers
+
+// set up the ring, false where the kernel or the build has no io_uring, the ptys then use libuv
+bool uring_init(uv_loop_t *loop);
+bool uring_enabled();
+void uring_close();
+
+// drive the pty master fd of process through the ring, the fd is made blocking for it; 0 on success
+int uring_open(pty_process *process, int fd);
+void uring_pause(pty_process *process);
+void uring_resume(pty_process *process);
+int uring_write(pty_process *process, pty_buf_t *buf);
+// requests in flight are cancelled, whatever they bring back is dropped
+void uring_free(pty_process *process);
+
+#endif  // TTYD_URING_H
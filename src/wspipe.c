@@ -16,7 +16,12 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <strings.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
+#include "cgroup.h"
+#include "pipepool.h"
 #include "runcmd.h"
 #include "server.h"
 #include "urlargs.h"
@@ -24,8 +29,33 @@
 static int g_log_stderr = 0;
 void set_errlog(int enable) { g_log_stderr = enable ? 1 : 0; }
 
+static int g_pipe_mux = 0;
+void set_pipe_mux(int enable) { g_pipe_mux = enable ? 1 : 0; }
+
+enum { RECORDS_OFF, RECORDS_NEWLINE, RECORDS_NUL, RECORDS_LENGTH };
+static int g_records = RECORDS_OFF;
+static size_t g_batch_size = 65536;
+static unsigned int g_batch_delay = 0;
+
+int set_pipe_records(const char *mode) {
+  if (!strcmp(mode, "newline")) g_records = RECORDS_NEWLINE;
+  else if (!strcmp(mode, "nul")) g_records = RECORDS_NUL;
+  else if (!strcmp(mode, "length")) g_records = RECORDS_LENGTH;
+  else return -1;
+  return 0;
+}
+
+void set_pipe_batch(size_t size, unsigned int delay_ms) {
+  if (size > 0) g_batch_size = size;
+  g_batch_delay = delay_ms;
+}
+
 #define WS_MAX_CHUNK 32768
-#define SUL_POLL_USEC 1000
+/* a record that grows past this without its delimiter is sent as it is */
+#define RECORD_MAX (16 * 1024 * 1024)
+/* queued stdin above which the socket stops being read, and below which it resumes */
+#define IN_HIGH_WATER (1024 * 1024)
+#define IN_LOW_WATER (256 * 1024)
 
 /* Build a temporary argv vector that borrows pointers from base + extra */
 static char **merge_argv(const char *const *base, char *const *extra, int extra_count) {
@@ -48,24 +78,36 @@ static void nb_set(int fd) {
   (void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
 }
 
-static int spawn_pipes(const char *const *argv, pid_t *out_pid, int *fd_in_w, int *fd_out_r, int *fd_err_r) {
+int spawn_pipes(const char *const *argv, pid_t *out_pid, int *fd_in_w, int *fd_out_r, int *fd_err_r) {
   int in_p[2], out_p[2], err_p[2];
 
+  /* the command runs confined or not at all */
+  struct cgroup *cg = cgroup_new();
+  if (cg == NULL && cgroup_enabled()) return -1;
+
 #if defined(O_CLOEXEC) && (defined(__linux__) || defined(__FreeBSD__) || defined(__DragonFly__) || defined(__NetBSD__) || defined(__OpenBSD__))
   if (pipe2(in_p,  O_CLOEXEC) ||
       pipe2(out_p, O_CLOEXEC) ||
-      pipe2(err_p, O_CLOEXEC))
+      pipe2(err_p, O_CLOEXEC)) {
+    cgroup_bind(cg, -1);
     return -1;
+  }
 #else
-  if (pipe(in_p) || pipe(out_p) || pipe(err_p))
+  if (pipe(in_p) || pipe(out_p) || pipe(err_p)) {
+    cgroup_bind(cg, -1);
     return -1;
+  }
 #endif
 
   pid_t pid = fork();
-  if (pid < 0) return -1;
+  if (pid < 0) {
+    cgroup_bind(cg, pid);
+    return -1;
+  }
 
   if (pid == 0) {
     /* child */
+    if (!cgroup_enter(cg)) _exit(126);
     if (server) {
       if (server->cwd) (void)chdir(server->cwd);
     }
@@ -85,6 +127,7 @@ static int spawn_pipes(const char *const *argv, pid_t *out_pid, int *fd_in_w, in
   }
 
   /* parent */
+  cgroup_bind(cg, pid);
   close(in_p[0]);
   close(out_p[1]);
   close(err_p[1]);
@@ -128,77 +171,567 @@ static void accumulate_stderr(struct pss_raw *pss, const uint8_t *p, size_t n) {
   }
 }
 
+/* ----- child exit: pidfd where available, SIGCHLD otherwise ----- */
+
+struct pipe_child {
+  pid_t pid;
+  int pidfd;                 /* -1 when relying on SIGCHLD */
+  uv_poll_t *poll;
+  pipe_child_exit_cb exit_cb;
+  void *data;                /* NULL once the owner is gone, the child is still reaped */
+  struct pipe_child *next;
+};
+
+static struct pipe_child *g_children = NULL;
+static uv_signal_t *g_sigchld = NULL;
+
+static void handle_free_cb(uv_handle_t *handle) { free(handle); }
+
+static void pidfd_close_cb(uv_handle_t *handle) {
+  struct pipe_child *child = (struct pipe_child *)handle->data;
+  close(child->pidfd);
+  free(child);
+  free(handle);
+}
+
+static void child_free(struct pipe_child *child) {
+  for (struct pipe_child **link = &g_children; *link; link = &(*link)->next) {
+    if (*link == child) {
+      *link = child->next;
+      break;
+    }
+  }
+  if (child->poll) {
+    uv_poll_stop(child->poll);
+    uv_close((uv_handle_t *)child->poll, pidfd_close_cb);
+  } else {
+    free(child);
+  }
+}
+
+/* returns 1 if the child was reaped (and freed) */
+static int child_reap(struct pipe_child *child) {
+  int st;
+  pid_t r;
+  do r = waitpid(child->pid, &st, WNOHANG);
+  while (r < 0 && errno == EINTR);
+  if (r == 0) return 0;
+  if (r < 0) st = 0; /* ECHILD: somebody else reaped it, nothing left to wait for */
+
+  pipe_child_exit_cb exit_cb = child->exit_cb;
+  void *data = child->data;
+  cgroup_release(child->pid);
+  child_free(child);
+  if (data) exit_cb(data, st);
+  return 1;
+}
+
+static void pidfd_cb(uv_poll_t *handle, int status, int events) {
+  (void)status;
+  (void)events;
+  (void)child_reap((struct pipe_child *)handle->data);
+}
+
+static void sigchld_cb(uv_signal_t *handle, int signum) {
+  (void)handle;
+  (void)signum;
+  /* signals coalesce, so every watched child is checked */
+  struct pipe_child *child = g_children;
+  while (child) {
+    struct pipe_child *next = child->next;
+    if (!child->poll) (void)child_reap(child);
+    child = next;
+  }
+}
+
+struct pipe_child *pipe_child_watch(pid_t pid, pipe_child_exit_cb exit_cb, void *data) {
+  struct pipe_child *child = (struct pipe_child *)calloc(1, sizeof(*child));
+  if (!child) return NULL;
+  child->pid = pid;
+  child->pidfd = -1;
+  child->exit_cb = exit_cb;
+  child->data = data;
+  child->next = g_children;
+  g_children = child;
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  child->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+  if (child->pidfd >= 0) {
+    child->poll = (uv_poll_t *)malloc(sizeof(uv_poll_t));
+    if (child->poll && uv_poll_init(server->loop, child->poll, child->pidfd) == 0) {
+      child->poll->data = child;
+      uv_poll_start(child->poll, UV_READABLE, pidfd_cb);
+      return child;
+    }
+    free(child->poll);
+    child->poll = NULL;
+    close(child->pidfd);
+    child->pidfd = -1;
+  }
+#endif
+
+  /* pre-5.3 kernels and other systems */
+  if (!g_sigchld) {
+    g_sigchld = (uv_signal_t *)malloc(sizeof(uv_signal_t));
+    uv_signal_init(server->loop, g_sigchld);
+    uv_signal_start(g_sigchld, sigchld_cb, SIGCHLD);
+    uv_unref((uv_handle_t *)g_sigchld);
+  }
+  /* it may have exited before the watcher was in place */
+  if (child_reap(child)) return NULL;
+  return child;
+}
+
+void pipe_child_forget(struct pipe_child *child) {
+  if (child) child->data = NULL;
+}
+
 /* ----- data pump helpers ----- */
 
-static int pump_fd_to_wsbuf(struct pss_raw *pss, int fd) {
-  if (fd < 0) return 0;
-  if (pss->ws_len) return 0; /* wait for WRITEABLE to flush previous */
-  unsigned char *p = (unsigned char *)malloc(LWS_PRE + WS_MAX_CHUNK);
+static uv_poll_t *poll_open(struct pss_raw *pss, int fd, uv_poll_cb cb) {
+  uv_poll_t *handle = (uv_poll_t *)malloc(sizeof(uv_poll_t));
+  if (!handle) return NULL;
+  if (uv_poll_init(server->loop, handle, fd) != 0) {
+    free(handle);
+    return NULL;
+  }
+  handle->data = pss;
+  uv_poll_start(handle, UV_READABLE, cb);
+  return handle;
+}
+
+/* the poll handle has to go before its fd is closed */
+static void stream_close(uv_poll_t **handle, int *fd) {
+  if (*handle) {
+    uv_poll_stop(*handle);
+    uv_close((uv_handle_t *)*handle, handle_free_cb);
+    *handle = NULL;
+  }
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+/* once the child is gone, both pipes are drained and every frame went out */
+static int pipe_finished(struct pss_raw *pss) {
+  return pss->child_dead && pss->fd_out_r < 0 && pss->fd_err_r < 0 && !pss->ws_len && !pss->err_len &&
+         !pss->rec_len;
+}
+
+static void pipe_maybe_finish(struct pss_raw *pss) {
+  if (pipe_finished(pss)) lws_callback_on_writable(pss->wsi);
+}
+
+/* read result n of a pipe, closes it on EOF, on errors and once drained after the child exited */
+static int stream_done(struct pss_raw *pss, ssize_t n) {
+  if (n > 0) return 0;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && !pss->child_dead) return 0;
+  return 1;
+}
+
+/* read one chunk of fd into a frame, with the channel tag in front in --pipe-mux mode */
+static int pump_stream(struct pss_raw *pss, int *fd, uv_poll_t **poll, unsigned char **buf, size_t *len,
+                       char tag) {
+  if (*fd < 0) return 0;
+  if (*len) {
+    /* wait for WRITEABLE to flush previous, the data stays in the pipe meanwhile */
+    uv_poll_stop(*poll);
+    return 0;
+  }
+  size_t hdr = g_pipe_mux ? 1 : 0;
+  unsigned char *p = (unsigned char *)malloc(LWS_PRE + hdr + WS_MAX_CHUNK);
   if (!p) return 0;
-  ssize_t n = read(fd, p + LWS_PRE, WS_MAX_CHUNK);
+  ssize_t n = read(*fd, p + LWS_PRE + hdr, WS_MAX_CHUNK);
   if (n > 0) {
-    pss->ws_buf = p;
-    pss->ws_len = (size_t)n;
+    if (tag == PIPE_STDERR && g_log_stderr) {
+      accumulate_stderr(pss, p + LWS_PRE + hdr, (size_t)n);
+      free(p);
+      return 1;
+    }
+    if (hdr) p[LWS_PRE] = (unsigned char)tag;
+    *buf = p;
+    *len = hdr + (size_t)n;
+    uv_poll_stop(*poll);
     lws_callback_on_writable(pss->wsi);
     return 1;
   }
   free(p);
+  if (stream_done(pss, n)) {
+    stream_close(poll, fd);
+    pipe_maybe_finish(pss);
+  }
   return 0;
 }
 
+static int pump_records(struct pss_raw *pss);
+
+static void pump_out(struct pss_raw *pss) {
+  if (g_records) {
+    (void)pump_records(pss);
+    return;
+  }
+  (void)pump_stream(pss, &pss->fd_out_r, &pss->out_poll, &pss->ws_buf, &pss->ws_len, PIPE_STDOUT);
+}
+
 static void pump_err(struct pss_raw *pss) {
-  if (pss->fd_err_r < 0) return;
-  uint8_t tmp[WS_MAX_CHUNK];
-  ssize_t n = read(pss->fd_err_r, tmp, sizeof(tmp));
-  if (n <= 0) return;
+  (void)pump_stream(pss, &pss->fd_err_r, &pss->err_poll, &pss->err_buf, &pss->err_len, PIPE_STDERR);
+}
+
+/* ----- --pipe-records: whole records, packed into batches ----- */
+
+enum { EMIT_BATCH, EMIT_NOW, EMIT_EOF };
+
+#if !defined(__GLIBC__)
+static void *memrchr(const void *s, int c, size_t n) {
+  const unsigned char *p = (const unsigned char *)s + n;
+  while (n--)
+    if (*--p == (unsigned char)c) return (void *)p;
+  return NULL;
+}
+#endif
+
+/* bytes of whole records at the start of p that fit a batch, a single larger record goes alone */
+static size_t records_cut(const unsigned char *p, size_t len) {
+  size_t batch = len < g_batch_size ? len : g_batch_size;
+
+  if (g_records == RECORDS_LENGTH) {
+    size_t off = 0;
+    while (len - off >= 4) {
+      size_t rl = 4 + (((size_t)p[off] << 24) | ((size_t)p[off + 1] << 16) | ((size_t)p[off + 2] << 8) | p[off + 3]);
+      if (rl > len - off) {
+        /* a broken prefix must not stall the stream forever */
+        if (off == 0 && rl > RECORD_MAX) return len;
+        break;
+      }
+      if (off > 0 && off + rl > g_batch_size) break;
+      off += rl;
+      if (off >= g_batch_size) break;
+    }
+    return off;
+  }
+
+  /* memrchr/memchr scan a word or vector at a time, records are never walked byte by byte */
+  int delim = g_records == RECORDS_NUL ? '\0' : '\n';
+  const unsigned char *end = (const unsigned char *)memrchr(p, delim, batch);
+  if (end) return (size_t)(end - p) + 1;
+  if (len <= batch) return len >= RECORD_MAX ? len : 0;
+  end = (const unsigned char *)memchr(p + batch, delim, len - batch);
+  if (end) return (size_t)(end - p) + 1;
+  return len >= RECORD_MAX ? len : 0;
+}
 
-  if (g_log_stderr) {
-    accumulate_stderr(pss, tmp, (size_t)n);
+static void batch_timer_cb(uv_timer_t *timer);
+
+/* hand whole records over as the stdout frame, the rest moves to a fresh buffer */
+static void records_emit(struct pss_raw *pss, int mode) {
+  if (pss->ws_len || !pss->rec_len) return;
+  size_t hdr = g_pipe_mux ? 1 : 0;
+  unsigned char *data = pss->rec_buf + LWS_PRE + hdr;
+  size_t cut = records_cut(data, pss->rec_len);
+  if (mode == EMIT_EOF && !cut) cut = pss->rec_len; /* trailing record without delimiter */
+  if (!cut) return;
+
+  /* wait a little for more records to fill the batch */
+  if (mode == EMIT_BATCH && g_batch_delay && cut < g_batch_size) {
+    if (!pss->batch_timer) {
+      pss->batch_timer = (uv_timer_t *)malloc(sizeof(uv_timer_t));
+      if (!pss->batch_timer) return;
+      uv_timer_init(server->loop, pss->batch_timer);
+      pss->batch_timer->data = pss;
+    }
+    if (!uv_is_active((uv_handle_t *)pss->batch_timer))
+      uv_timer_start(pss->batch_timer, batch_timer_cb, g_batch_delay, 0);
     return;
   }
+  if (pss->batch_timer) uv_timer_stop(pss->batch_timer);
+
+  size_t rest = pss->rec_len - cut;
+  size_t cap = pss->rec_cap;
+  unsigned char *next = (unsigned char *)malloc(LWS_PRE + hdr + cap);
+  if (!next) return;
+  memcpy(next + LWS_PRE + hdr, data + cut, rest);
+
+  if (hdr) pss->rec_buf[LWS_PRE] = PIPE_STDOUT;
+  pss->ws_buf = pss->rec_buf;
+  pss->ws_len = hdr + cut;
+  pss->rec_buf = next;
+  pss->rec_len = rest;
+  if (pss->out_poll) uv_poll_stop(pss->out_poll);
+  lws_callback_on_writable(pss->wsi);
+}
+
+static void batch_timer_cb(uv_timer_t *timer) { records_emit((struct pss_raw *)timer->data, EMIT_NOW); }
 
+static int pump_records(struct pss_raw *pss) {
+  if (pss->fd_out_r < 0) return 0;
   if (pss->ws_len) {
-    // Already a frame queued: just drop silently (explicit)
-    // Optional: lwsl_debug("stderr chunk dropped (%zd bytes)\n", n);
+    uv_poll_stop(pss->out_poll);
+    return 0;
+  }
+  size_t hdr = g_pipe_mux ? 1 : 0;
+  if (pss->rec_cap - pss->rec_len < WS_MAX_CHUNK) {
+    size_t cap = pss->rec_cap ? pss->rec_cap * 2 : g_batch_size + WS_MAX_CHUNK;
+    unsigned char *p = (unsigned char *)realloc(pss->rec_buf, LWS_PRE + hdr + cap);
+    if (!p) return 0;
+    pss->rec_buf = p;
+    pss->rec_cap = cap;
+  }
+  ssize_t n = read(pss->fd_out_r, pss->rec_buf + LWS_PRE + hdr + pss->rec_len, WS_MAX_CHUNK);
+  if (n > 0) {
+    pss->rec_len += (size_t)n;
+    records_emit(pss, EMIT_BATCH);
+    return 1;
+  }
+  if (stream_done(pss, n)) {
+    stream_close(&pss->out_poll, &pss->fd_out_r);
+    records_emit(pss, EMIT_EOF);
+    pipe_maybe_finish(pss);
+  }
+  return 0;
+}
+
+static void out_cb(uv_poll_t *handle, int status, int events) {
+  (void)status;
+  (void)events;
+  pump_out((struct pss_raw *)handle->data);
+}
+
+static void err_cb(uv_poll_t *handle, int status, int events) {
+  (void)status;
+  (void)events;
+  pump_err((struct pss_raw *)handle->data);
+}
+
+/* resume reading after a frame went out, or drain what is left once the child exited */
+static void pipe_pump(struct pss_raw *pss) {
+  /* records left over from the last read go out before reading more */
+  if (pss->rec_len) records_emit(pss, pss->fd_out_r < 0 ? EMIT_EOF : EMIT_BATCH);
+  if (pss->child_dead) {
+    if (!pss->ws_len) pump_out(pss);
+    if (!pss->err_len) pump_err(pss);
     return;
   }
-  pss->ws_buf = (unsigned char *)malloc(LWS_PRE + (size_t)n);
-  if (!pss->ws_buf) return;
-  memcpy(pss->ws_buf + LWS_PRE, tmp, (size_t)n);
-  pss->ws_len = (size_t)n;
-  lws_callback_on_writable(pss->wsi);
+  if (pss->out_poll && !pss->ws_len) uv_poll_start(pss->out_poll, UV_READABLE, out_cb);
+  if (pss->err_poll && !pss->err_len) uv_poll_start(pss->err_poll, UV_READABLE, err_cb);
 }
 
-static void sul_poll_cb(lws_sorted_usec_list_t *sul) {
-  struct pss_raw *pss = lws_container_of(sul, struct pss_raw, sul);
-  if (!pss || !pss->wsi) return;
+/* the last --pipe-mux frame: exit code, or the signal that killed the child */
+static int write_status(struct pss_raw *pss) {
+  unsigned char buf[LWS_PRE + 16];
+  char *p = (char *)buf + LWS_PRE;
+  int st = pss->exit_status;
+  int n;
+  if (WIFSIGNALED(st))
+    n = snprintf(p, 16, "%c%d", PIPE_SIGNAL, WTERMSIG(st));
+  else
+    n = snprintf(p, 16, "%c%d", PIPE_EXIT, WIFEXITED(st) ? WEXITSTATUS(st) : 0);
+  return lws_write(pss->wsi, (unsigned char *)p, (size_t)n, LWS_WRITE_BINARY);
+}
 
-  (void)pump_fd_to_wsbuf(pss, pss->fd_out_r);
-  pump_err(pss);
+/* ----- client → stdin, queued while the child is not reading ----- */
 
-  if (!pss->child_dead) {
-    int st;
-    for (;;) {
-      pid_t r = waitpid(pss->pid, &st, WNOHANG);
-      if (r == 0) break;                  // still running
-      if (r == pss->pid) {
-        pss->child_dead = 1;
+struct pipe_chunk {
+  struct pipe_chunk *next;
+  size_t len;
+  size_t off;
+  uint8_t data[];
+};
 
-        /* --- NEW: close the pipes immediately to stop further I/O --- */
-        if (pss->fd_in_w >= 0)  { close(pss->fd_in_w);  pss->fd_in_w  = -1; }
-        if (pss->fd_out_r >= 0) { close(pss->fd_out_r); pss->fd_out_r = -1; }
-        if (pss->fd_err_r >= 0) { close(pss->fd_err_r); pss->fd_err_r = -1; }
+static void in_queue_free(struct pss_raw *pss) {
+  while (pss->in_head) {
+    struct pipe_chunk *c = pss->in_head;
+    pss->in_head = c->next;
+    free(c);
+  }
+  pss->in_tail = NULL;
+  pss->in_queued = 0;
+}
 
-        /* Tell the peer we're closing normally and flush any pending payload */
-        lws_close_reason(pss->wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
-        lws_callback_on_writable(pss->wsi);
-        break;
-      }
-      if (r < 0 && errno == EINTR) continue;
-      break;
+static void in_close(struct pss_raw *pss) {
+  stream_close(&pss->in_poll, &pss->fd_in_w);
+  in_queue_free(pss);
+  if (pss->rx_paused && pss->wsi) {
+    lws_rx_flow_control(pss->wsi, 1);
+    pss->rx_paused = 0;
+  }
+}
+
+/* returns bytes written, -1 if stdin is gone */
+static ssize_t in_write(struct pss_raw *pss, const uint8_t *p, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t w = write(pss->fd_in_w, p + done, len - done);
+    if (w > 0) {
+      done += (size_t)w;
+      continue;
     }
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    return -1; /* EPIPE: the child closed its stdin */
+  }
+  return (ssize_t)done;
+}
+
+static void in_cb(uv_poll_t *handle, int status, int events);
+
+static void in_flush(struct pss_raw *pss) {
+  while (pss->in_head) {
+    struct pipe_chunk *c = pss->in_head;
+    ssize_t w = in_write(pss, c->data + c->off, c->len - c->off);
+    if (w < 0) {
+      in_close(pss);
+      return;
+    }
+    c->off += (size_t)w;
+    pss->in_queued -= (size_t)w;
+    if (c->off < c->len) break;
+    pss->in_head = c->next;
+    if (!pss->in_head) pss->in_tail = NULL;
+    free(c);
+  }
+
+  if (pss->in_head) {
+    uv_poll_start(pss->in_poll, UV_WRITABLE, in_cb);
+  } else {
+    uv_poll_stop(pss->in_poll);
+    if (pss->in_eof) {
+      in_close(pss);
+      return;
+    }
+  }
+  if (pss->rx_paused && pss->in_queued < IN_LOW_WATER) {
+    lws_rx_flow_control(pss->wsi, 1);
+    pss->rx_paused = 0;
+  }
+}
+
+static void in_cb(uv_poll_t *handle, int status, int events) {
+  (void)status;
+  (void)events;
+  in_flush((struct pss_raw *)handle->data);
+}
+
+/* write what the pipe takes now, queue the rest and stop reading the socket past the high water mark */
+static void in_push(struct pss_raw *pss, const uint8_t *p, size_t len) {
+  if (!pss->in_head) {
+    ssize_t w = in_write(pss, p, len);
+    if (w < 0) {
+      in_close(pss);
+      return;
+    }
+    p += w;
+    len -= (size_t)w;
+    if (!len) return;
+  }
+
+  struct pipe_chunk *c = (struct pipe_chunk *)malloc(sizeof(*c) + len);
+  if (!c) {
+    lwsl_err("pipe: out of memory queueing %zu bytes of input\n", len);
+    return;
+  }
+  c->next = NULL;
+  c->len = len;
+  c->off = 0;
+  memcpy(c->data, p, len);
+  if (pss->in_tail)
+    pss->in_tail->next = c;
+  else
+    pss->in_head = c;
+  pss->in_tail = c;
+  pss->in_queued += len;
+  uv_poll_start(pss->in_poll, UV_WRITABLE, in_cb);
+
+  if (!pss->rx_paused && pss->in_queued > IN_HIGH_WATER) {
+    lws_rx_flow_control(pss->wsi, 0);
+    pss->rx_paused = 1;
+  }
+}
+
+/* ----- --pipe-workers: every message is a request, answered by a pooled worker ----- */
+
+/* hand the oldest queued request to the pool, one at a time so answers keep their order */
+static void pool_next(struct pss_raw *pss) {
+  if (pss->pool_busy || !pss->in_head) return;
+  struct pipe_chunk *c = pss->in_head;
+  pss->in_head = c->next;
+  if (!pss->in_head) pss->in_tail = NULL;
+  pss->in_queued -= c->len;
+  pss->pool_busy = 1;
+  pipepool_submit(pss, c->data, c->len);
+  free(c);
+
+  if (pss->rx_paused && pss->in_queued < IN_LOW_WATER) {
+    lws_rx_flow_control(pss->wsi, 1);
+    pss->rx_paused = 0;
   }
-  lws_sul_schedule(lws_get_context(pss->wsi), 0, &pss->sul, sul_poll_cb, SUL_POLL_USEC);
+}
+
+static void pool_receive(struct pss_raw *pss, const uint8_t *p, size_t len) {
+  unsigned char *msg = (unsigned char *)realloc(pss->msg, pss->msg_len + len);
+  if (!msg) {
+    lwsl_err("pipe: out of memory receiving a request\n");
+    return;
+  }
+  memcpy(msg + pss->msg_len, p, len);
+  pss->msg = msg;
+  pss->msg_len += len;
+  if (lws_remaining_packet_payload(pss->wsi) > 0 || !lws_is_final_fragment(pss->wsi)) return;
+
+  struct pipe_chunk *c = (struct pipe_chunk *)malloc(sizeof(*c) + pss->msg_len);
+  if (c) {
+    c->next = NULL;
+    c->len = pss->msg_len;
+    c->off = 0;
+    memcpy(c->data, pss->msg, pss->msg_len);
+    if (pss->in_tail)
+      pss->in_tail->next = c;
+    else
+      pss->in_head = c;
+    pss->in_tail = c;
+    pss->in_queued += c->len;
+  }
+  free(pss->msg);
+  pss->msg = NULL;
+  pss->msg_len = 0;
+
+  if (!pss->rx_paused && pss->in_queued > IN_HIGH_WATER) {
+    lws_rx_flow_control(pss->wsi, 0);
+    pss->rx_paused = 1;
+  }
+  pool_next(pss);
+}
+
+void pipe_pool_response(struct pss_raw *pss, const unsigned char *data, size_t len) {
+  size_t hdr = g_pipe_mux ? 1 : 0;
+  unsigned char *p = (unsigned char *)malloc(LWS_PRE + hdr + len);
+  if (!p) {
+    pipe_pool_failed(pss);
+    return;
+  }
+  if (hdr) p[LWS_PRE] = PIPE_STDOUT;
+  memcpy(p + LWS_PRE + hdr, data, len);
+  pss->ws_buf = p;
+  pss->ws_len = hdr + len;
+  lws_callback_on_writable(pss->wsi);
+}
+
+void pipe_pool_failed(struct pss_raw *pss) {
+  pss->pool_failed = 1;
+  lws_callback_on_writable(pss->wsi);
+}
+
+static void pipe_child_exited(void *data, int status) {
+  struct pss_raw *pss = (struct pss_raw *)data;
+  pss->child = NULL;
+  pss->child_dead = 1;
+  pss->exit_status = status;
+  pss->pid = -1;
+
+  /* nobody reads stdin anymore, output already written is still in the pipes */
+  in_close(pss);
+  pipe_pump(pss);
+  pipe_maybe_finish(pss);
 }
 
 /* ----- protocol callback ----- */
@@ -213,6 +746,12 @@ int callback_pipe(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       pss->wsi = wsi;
       pss->fd_in_w = pss->fd_out_r = pss->fd_err_r = -1;
 
+      if (pipepool_active()) {
+        pss->pooled = 1;
+        server->client_count++;
+        break;
+      }
+
       if (server && server->url_arg) {
         pss->argv = ttyd_collect_url_args(wsi, &pss->argc);  // owns strings
       }
@@ -248,9 +787,13 @@ int callback_pipe(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         return -1;
       }
 
-      lws_sul_schedule(lws_get_context(wsi), 0, &pss->sul, sul_poll_cb, SUL_POLL_USEC);
-      lws_callback_on_writable(wsi);
       server->client_count++;
+      pss->out_poll = poll_open(pss, pss->fd_out_r, out_cb);
+      pss->err_poll = poll_open(pss, pss->fd_err_r, err_cb);
+      pss->in_poll = poll_open(pss, pss->fd_in_w, in_cb);
+      if (!pss->out_poll || !pss->err_poll || !pss->in_poll) return -1;
+      uv_poll_stop(pss->in_poll);
+      pss->child = pipe_child_watch(pss->pid, pipe_child_exited, pss);
       break;
     }
 
@@ -259,36 +802,71 @@ int callback_pipe(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       if (!server || !server->writable) {
         break;
       }
+      if (pss->pooled) {
+        if (len) pool_receive(pss, (const uint8_t *)in, len);
+        break;
+      }
+      if (pss->fd_in_w < 0 || pss->in_eof) break;
 
-      if (pss->fd_in_w >= 0 && len) {
-        const uint8_t *p = (const uint8_t *)in;
-        size_t left = len;
-        while (left) {
-          ssize_t w = write(pss->fd_in_w, p, (ssize_t)left);
-          if (w > 0) { p += (size_t)w; left -= (size_t)w; continue; }
-          if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break; /* try later */
-          /* EPIPE or fatal: stop consuming further */
-          break;
-        }
+      /* an empty message is end of input, the child sees EOF once the queue is written */
+      if (!len && lws_is_first_fragment(wsi) && lws_is_final_fragment(wsi)) {
+        pss->in_eof = 1;
+        if (!pss->in_head) in_close(pss);
+        break;
       }
+      if (len) in_push(pss, (const uint8_t *)in, len);
       break;
 
-    case LWS_CALLBACK_SERVER_WRITEABLE:
-      if (pss->ws_len && pss->ws_buf) {
-        (void)lws_write(wsi, pss->ws_buf + LWS_PRE, (int)pss->ws_len, LWS_WRITE_BINARY);
-        free(pss->ws_buf);
-        pss->ws_buf = NULL;
-        pss->ws_len = 0;
+    case LWS_CALLBACK_SERVER_WRITEABLE: {
+      if (pss->pool_failed) {
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
+        return -1;
       }
-      if (pss->child_dead && !pss->ws_len) return -1;
-      break;
+      /* one frame per callback, stdout and stderr take turns when both are queued */
+      int err = pss->err_len && (!pss->ws_len || pss->err_turn);
+      unsigned char **buf = err ? &pss->err_buf : &pss->ws_buf;
+      size_t *blen = err ? &pss->err_len : &pss->ws_len;
+      if (*blen && *buf) {
+        int n = lws_write(wsi, *buf + LWS_PRE, *blen, LWS_WRITE_BINARY);
+        free(*buf);
+        *buf = NULL;
+        *blen = 0;
+        if (n < 0) return -1;
+        pss->err_turn = !err;
+        if (pss->pooled) {
+          pss->pool_busy = 0;
+          pool_next(pss);
+          break;
+        }
+        pipe_pump(pss);
+        if (pss->ws_len || pss->err_len || pipe_finished(pss)) lws_callback_on_writable(wsi);
+        break;
+      }
+      if (!pipe_finished(pss)) break;
+      if (g_pipe_mux && !pss->status_sent) {
+        pss->status_sent = 1;
+        if (write_status(pss) < 0) return -1;
+        lws_callback_on_writable(wsi);
+        break;
+      }
+      lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+      return -1;
+    }
 
     case LWS_CALLBACK_CLOSED:
     case LWS_CALLBACK_WSI_DESTROY:
-      lws_sul_cancel(&pss->sul);
-      if (pss->fd_in_w  >= 0) close(pss->fd_in_w);
-      if (pss->fd_out_r >= 0) close(pss->fd_out_r);
-      if (pss->fd_err_r >= 0) close(pss->fd_err_r);
+      /* both arrive for an established connection, the first one cleans up */
+      if (!pss || !pss->wsi) break;
+      stream_close(&pss->out_poll, &pss->fd_out_r);
+      stream_close(&pss->err_poll, &pss->fd_err_r);
+      stream_close(&pss->in_poll, &pss->fd_in_w);
+      in_queue_free(pss);
+      if (pss->pooled) pipepool_detach(pss);
+      free(pss->msg);
+      pss->msg = NULL;
+      /* the watcher stays until the child is reaped */
+      pipe_child_forget(pss->child);
+      pss->child = NULL;
       if (pss->pid > 0) {
         kill(pss->pid, SIGHUP);
         kill(pss->pid, SIGTERM);
@@ -307,6 +885,22 @@ int callback_pipe(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         pss->ws_buf = NULL;
         pss->ws_len = 0;
       }
+      if (pss->batch_timer) {
+        uv_timer_stop(pss->batch_timer);
+        uv_close((uv_handle_t *)pss->batch_timer, handle_free_cb);
+        pss->batch_timer = NULL;
+      }
+      if (pss->rec_buf) {
+        free(pss->rec_buf);
+        pss->rec_buf = NULL;
+        pss->rec_len = pss->rec_cap = 0;
+      }
+      if (pss->err_buf) {
+        free(pss->err_buf);
+        pss->err_buf = NULL;
+        pss->err_len = 0;
+      }
+      pss->wsi = NULL;
       if (server->client_count > 0)
         server->client_count--;
 
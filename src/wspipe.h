@@ -4,6 +4,16 @@
 // ReSharper disable once CppUnusedIncludeDirective
 #include <sys/types.h>    /* pid_t, u_char, etc (macOS needs this before lws) */
 #include <libwebsockets.h>
+#include <uv.h>
+
+/* channel tag in front of every server message with --pipe-mux */
+#define PIPE_STDOUT '1'
+#define PIPE_STDERR '2'
+#define PIPE_EXIT 'x'   /* exit code in decimal, last message before the close */
+#define PIPE_SIGNAL 's' /* number of the signal that killed the child, in decimal */
+
+struct pipe_child;
+struct pipe_chunk;
 
 struct pss_raw {
   struct lws *wsi;
@@ -11,17 +21,56 @@ struct pss_raw {
   int fd_in_w;
   int fd_out_r;
   int fd_err_r;
-  unsigned char *ws_buf;
+  uv_poll_t *out_poll;         /* readability of fd_out_r, stopped while a frame is queued */
+  uv_poll_t *err_poll;         /* readability of fd_err_r */
+  uv_poll_t *in_poll;          /* writability of fd_in_w, started while input is queued */
+  struct pipe_chunk *in_head;  /* client input the child has not read yet */
+  struct pipe_chunk *in_tail;
+  size_t in_queued;
+  int in_eof;                  /* client sent end of input, close stdin once the queue drains */
+  int rx_paused;               /* socket reads stopped until the queue drains */
+  struct pipe_child *child;    /* exit watcher, outlives the connection */
+  unsigned char *ws_buf;        /* stdout frame */
   size_t ws_len;
+  unsigned char *err_buf;       /* stderr frame, unless --log-stderr */
+  size_t err_len;
+  unsigned char *rec_buf;       /* --pipe-records: stdout not yet sent, LWS_PRE and tag room in front */
+  size_t rec_len;
+  size_t rec_cap;
+  uv_timer_t *batch_timer;      /* sends a partial batch after --pipe-batch-delay */
+  int pooled;                   /* requests go to --pipe-workers instead of an own child */
+  int pool_busy;                /* a request is with a worker or its answer not written yet */
+  int pool_failed;
+  unsigned char *msg;           /* request being reassembled from fragments */
+  size_t msg_len;
+  int err_turn;                 /* stdout and stderr alternate when both are queued */
+  int status_sent;
   char err_line[2048];
   size_t err_used;
-  lws_sorted_usec_list_t sul;  /* libwebsockets micro-timer */
   int child_dead;
+  int exit_status;             /* waitpid() status once child_dead */
   char **argv;
   int argc;
 };
 
+/* fork argv with non-blocking pipes for stdin, stdout and stderr */
+int spawn_pipes(const char *const *argv, pid_t *out_pid, int *fd_in_w, int *fd_out_r, int *fd_err_r);
+
+/* reaps pid once it exits and reports its waitpid() status, pidfd based where the kernel has it */
+typedef void (*pipe_child_exit_cb)(void *data, int status);
+struct pipe_child *pipe_child_watch(pid_t pid, pipe_child_exit_cb exit_cb, void *data);
+/* the owner is gone, reap the child without reporting it */
+void pipe_child_forget(struct pipe_child *child);
+
 void set_errlog(int enable);
+void set_pipe_mux(int enable);
+/* "newline", "nul" or "length" (4 byte big-endian prefix), returns -1 for anything else */
+int set_pipe_records(const char *mode);
+void set_pipe_batch(size_t size, unsigned int delay_ms);
+
+/* called by the worker pool with the answer to the request of pss, or when its worker died */
+void pipe_pool_response(struct pss_raw *pss, const unsigned char *data, size_t len);
+void pipe_pool_failed(struct pss_raw *pss);
 
 int callback_pipe(struct lws *wsi,
                             enum lws_callback_reasons reason,